@@ -0,0 +1,379 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#define FRAME_TILE 32
+#define FRAME_TILES_X ((IMAGE_WIDTH + FRAME_TILE - 1) / FRAME_TILE)
+#define FRAME_TILES_Y ((HEIGHT + FRAME_TILE - 1) / FRAME_TILE)
+// Frames shown each second during playback
+#define PLAYBACK_FPS 12
+// Alpha of the previous frame when it is drawn over the image as an onion skin
+#define ONION_ALPHA 0x60
+
+using namespace std;
+
+/*  Each frame is a list of tiles, and a tile is never changed once it is stored. Storing a
+    frame looks each of its tiles up by the hash of its pixels, and uses the tile already
+    stored if one matches, so frames that are mostly the same share most of their tiles.
+    Drawing on a frame gives it new tiles the next time it is stored, leaving the tiles other
+    frames share alone. The frame being drawn on is the user image itself, and is only stored
+    when another frame is shown. */
+
+struct frame_tile
+{
+    unsigned int hash;
+    pixel_buffer pixels;
+};
+
+typedef shared_ptr<const frame_tile> tile_handle;
+
+struct frame_store
+{
+    vector<vector<tile_handle>> frames;
+    size_t current;
+
+    // Every stored tile by the hash of its pixels. Tiles no frame uses any more have expired.
+    unordered_map<unsigned int, vector<weak_ptr<const frame_tile>>> index;
+
+    bool onion_skin;
+    bitmap onion;
+};
+
+/**
+ * Get the area of the image a frame tile covers
+ *
+ * @param tile      Number of the tile, counting across each row from the top left
+ *
+ * @returns         Area of the tile, which is smaller along the right and bottom edges
+ */
+rectangle frame_tile_area (int tile)
+{
+    int x = tile % FRAME_TILES_X * FRAME_TILE, y = tile / FRAME_TILES_X * FRAME_TILE;
+
+    return rectangle_from (x, y, min (FRAME_TILE, IMAGE_WIDTH - x), min (FRAME_TILE, HEIGHT - y));
+}
+
+/**
+ * Set up the frame store with the user image as its only frame
+ *
+ * @param program   Struct containing program data
+ */
+void init_frames (program_data &program)
+{
+    program.frames = new frame_store;
+    program.frames->frames.push_back (vector<tile_handle>());
+    program.frames->current = 0;
+    program.frames->onion_skin = false;
+    program.frames->onion = create_bitmap ("onion_skin", IMAGE_WIDTH, HEIGHT);
+}
+
+/**
+ * Find a stored tile with the same pixels, or store them as a new tile
+ *
+ * @param store     The frame store
+ * @param pixels    Pixels of the tile
+ * @param hash      Hash of the pixels
+ *
+ * @returns         The tile
+ */
+tile_handle share_tile (frame_store &store, pixel_buffer &pixels, unsigned int hash)
+{
+    vector<weak_ptr<const frame_tile>> &matches = store.index[hash];
+
+    matches.erase (remove_if (matches.begin(), matches.end(), [](const weak_ptr<const frame_tile> &tile) { return tile.expired(); }), matches.end());
+
+    for (const weak_ptr<const frame_tile> &match : matches)
+    {
+        tile_handle tile = match.lock();
+        if (tile->pixels.pixels == pixels.pixels)
+            return tile;
+    }
+
+    shared_ptr<frame_tile> result = make_shared<frame_tile>();
+    result->hash = hash;
+    result->pixels.width = pixels.width;
+    result->pixels.height = pixels.height;
+    result->pixels.pixels.swap (pixels.pixels);
+    matches.push_back (result);
+
+    return result;
+}
+
+/**
+ * Store the user image as the current frame. Tiles are copied and hashed across the job
+ * pool, and a tile the same as the one the frame already had is kept without a lookup.
+ *
+ * @param program   Struct containing program data
+ */
+void store_current_frame (program_data &program)
+{
+    frame_store &store = *program.frames;
+    vector<tile_handle> &frame = store.frames[store.current];
+    const pixel_buffer &image = canvas_pixels (program);
+    vector<pixel_buffer> tiles (FRAME_TILES_X * FRAME_TILES_Y);
+    vector<unsigned int> hashes (tiles.size());
+
+    parallel_for (tiles.size(), [&](int i)
+    {
+        rectangle area = frame_tile_area (i);
+
+        tiles[i] = copy_pixels (image, area.x, area.y, area.width, area.height);
+        hashes[i] = hash_bytes ((const unsigned char *) tiles[i].pixels.data(), tiles[i].pixels.size() * sizeof (unsigned int));
+    });
+
+    frame.resize (tiles.size());
+
+    for (size_t i = 0; i < tiles.size(); i++)
+    {
+        if (frame[i] != nullptr && frame[i]->hash == hashes[i] && frame[i]->pixels.pixels == tiles[i].pixels)
+            continue;
+
+        frame[i] = share_tile (store, tiles[i], hashes[i]);
+    }
+}
+
+/**
+ * Draw the tiles of one frame that aren't shared with another onto a bitmap
+ *
+ * @param destination   The bitmap to be drawn to
+ * @param showing       Tiles of the frame the bitmap currently shows
+ * @param frame         Tiles of the frame to be drawn
+ * @param changed       Set to the area of each tile drawn, if not nullptr
+ */
+void draw_frame_changes (bitmap destination, const vector<tile_handle> &showing, const vector<tile_handle> &frame, vector<rectangle> *changed)
+{
+    for (size_t i = 0; i < frame.size(); i++)
+    {
+        if (frame[i] == showing[i])
+            continue;
+
+        rectangle area = frame_tile_area (i);
+        write_pixels (destination, frame[i]->pixels, area.x, area.y);
+
+        if (changed != nullptr)
+            changed->push_back (area);
+    }
+}
+
+/**
+ * Count the memory used by the frame store's pixels. Tiles shared between frames are only
+ * counted once.
+ *
+ * @param store     The frame store
+ *
+ * @returns         Bytes of pixels stored
+ */
+size_t frame_memory (const frame_store &store)
+{
+    unordered_set<const frame_tile *> counted;
+    size_t result = 0;
+
+    for (const vector<tile_handle> &frame : store.frames)
+        for (const tile_handle &tile : frame)
+            if (counted.insert (tile.get()).second)
+                result += tile->pixels.pixels.size() * sizeof (unsigned int);
+
+    return result;
+}
+
+/**
+ * Redraw the onion skin bitmap from the frame before the current one
+ *
+ * @param store     The frame store
+ */
+void update_onion_skin (frame_store &store)
+{
+    clear_bitmap (store.onion, COLOR_TRANSPARENT);
+
+    if (store.current == 0)
+        return;
+
+    const vector<tile_handle> &previous = store.frames[store.current - 1];
+
+    for (size_t i = 0; i < previous.size(); i++)
+    {
+        rectangle area = frame_tile_area (i);
+        pixel_buffer faded = previous[i]->pixels;
+
+        for (unsigned int &pixel : faded.pixels)
+            pixel = (pixel & 0xFFFFFF) | (ONION_ALPHA << 24);
+
+        write_pixels (store.onion, faded, area.x, area.y);
+    }
+}
+
+/**
+ * Show another frame in the user image, drawing only the tiles that differ from what it
+ * showed. The history is started again from the new frame.
+ *
+ * @param program   Struct containing program data
+ * @param showing   Tiles of the frame the user image currently shows
+ * @param index     The frame to be shown
+ */
+void show_frame (program_data &program, const vector<tile_handle> &showing, size_t index)
+{
+    frame_store &store = *program.frames;
+    vector<rectangle> changed;
+
+    store.current = index;
+    draw_frame_changes (program.to_draw, showing, store.frames[index], &changed);
+
+    for (const rectangle &area : changed)
+    {
+        mark_dirty (program.document, area);
+        mark_stale (program.canvas, area);
+    }
+
+    // Commands drawn on one frame can't be undone on another
+    journal_reset (program.journal);
+    init_history (program);
+
+    if (store.onion_skin)
+        update_onion_skin (store);
+
+    write_line ("Frame " + to_string (index + 1) + " of " + to_string (store.frames.size()) + ", " + to_string (frame_memory (store) / 1024) + " KB of tiles");
+}
+
+/**
+ * Store the current frame before showing another. Frames are stored in full color, so the
+ * indexed canvas is turned off first.
+ *
+ * @param program   Struct containing program data
+ */
+void leave_frame (program_data &program)
+{
+    if (program.indexed.enabled)
+        set_indexed_mode (program, false);
+
+    store_current_frame (program);
+}
+
+/**
+ * Add a frame after the current one, starting as a copy of it, and show it
+ *
+ * @param program   Struct containing program data
+ */
+void add_frame (program_data &program)
+{
+    frame_store &store = *program.frames;
+
+    leave_frame (program);
+
+    // The copy shares every tile, so it costs no pixels until it is drawn on
+    store.frames.insert (store.frames.begin() + store.current + 1, store.frames[store.current]);
+    show_frame (program, store.frames[store.current], store.current + 1);
+}
+
+/**
+ * Remove the current frame and show the one before it, unless it is the only frame
+ *
+ * @param program   Struct containing program data
+ */
+void delete_frame (program_data &program)
+{
+    frame_store &store = *program.frames;
+
+    if (store.frames.size() == 1)
+        return;
+
+    leave_frame (program);
+
+    vector<tile_handle> showing = store.frames[store.current];
+    store.frames.erase (store.frames.begin() + store.current);
+    show_frame (program, showing, store.current == 0 ? 0 : store.current - 1);
+}
+
+/**
+ * Show the next or previous frame, wrapping around at either end
+ *
+ * @param program   Struct containing program data
+ * @param direction 1 for the next frame, -1 for the previous one
+ */
+void step_frame (program_data &program, int direction)
+{
+    frame_store &store = *program.frames;
+
+    if (store.frames.size() == 1)
+        return;
+
+    leave_frame (program);
+    show_frame (program, store.frames[store.current], (store.current + store.frames.size() + direction) % store.frames.size());
+}
+
+/**
+ * Turn drawing the previous frame faintly over the image on or off
+ *
+ * @param program   Struct containing program data
+ */
+void toggle_onion_skin (program_data &program)
+{
+    frame_store &store = *program.frames;
+
+    // Every frame but the current one is already stored, so the previous frame can be drawn as it is
+    store.onion_skin = not store.onion_skin;
+    if (store.onion_skin)
+        update_onion_skin (store);
+}
+
+/**
+ * Draw the onion skin over the user image on the window, if it is turned on
+ *
+ * @param program   Struct containing program data
+ */
+void draw_onion_skin (program_data &program)
+{
+    if (program.frames->onion_skin && program.frames->current > 0)
+        queue_bitmap (program.the_window, program.frames->onion, 0, 0);
+}
+
+/**
+ * Play the frames in a loop until a key is pressed or the mouse is clicked, then show the
+ * current frame again. Frames are due at fixed times from the start, and any that are
+ * missed are skipped, so a slow frame doesn't slow the animation down. Only the tiles that
+ * differ from the frame before are drawn.
+ *
+ * @param program   Struct containing program data
+ */
+void play_animation (program_data &program)
+{
+    frame_store &store = *program.frames;
+    unsigned int interval = 1000 / PLAYBACK_FPS;
+
+    leave_frame (program);
+
+    vector<tile_handle> showing = store.frames[store.current];
+    size_t frame = store.current;
+    unsigned int next_frame = current_ticks() + interval;
+
+    // Events are processed first, so the Ctrl+P that started playback doesn't stop it
+    while (not quit_requested())
+    {
+        process_events();
+
+        if (any_key_pressed() || mouse_clicked (LEFT_BUTTON))
+            break;
+
+        unsigned int now = current_ticks();
+        if (now < next_frame)
+        {
+            delay (1);
+            continue;
+        }
+
+        while (now >= next_frame)
+        {
+            frame = (frame + 1) % store.frames.size();
+            next_frame += interval;
+        }
+
+        draw_frame_changes (program.to_draw, showing, store.frames[frame], nullptr);
+        showing = store.frames[frame];
+
+        queue_bitmap (program.the_window, program.to_draw, 0, 0);
+        flush_render (program.the_window);
+    }
+
+    // Playback drew straight onto the user image, so put the current frame back
+    draw_frame_changes (program.to_draw, showing, store.frames[store.current], nullptr);
+}
@@ -0,0 +1,127 @@
+#include "graphic_creator.h"
+#include "shared_canvas.h"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+struct canvas_share
+{
+    int file;
+    size_t size;
+    shared_canvas_header *header;
+    unsigned int *pixels;
+};
+
+/**
+ * Start or stop publishing the user image to shared memory. Starting publishes the whole
+ * image on the next frame. Stopping removes the shared memory, and readers that still have
+ * it mapped keep the last image published.
+ *
+ * @param program   Struct containing program data
+ * @param enabled   True to start publishing, false to stop
+ */
+void set_canvas_share (program_data &program, bool enabled)
+{
+    if (enabled == (program.share != nullptr))
+        return;
+
+    if (not enabled)
+    {
+        munmap (program.share->header, program.share->size);
+        close (program.share->file);
+        shm_unlink (SHARED_CANVAS_NAME);
+        delete program.share;
+        program.share = nullptr;
+        write_line ("Stopped sharing the image");
+        return;
+    }
+
+    canvas_share *share = new canvas_share;
+    void *map = MAP_FAILED;
+
+    share->size = sizeof (shared_canvas_header) + (size_t) IMAGE_WIDTH * HEIGHT * sizeof (unsigned int);
+    share->file = shm_open (SHARED_CANVAS_NAME, O_RDWR | O_CREAT, 0644);
+
+    if (share->file >= 0 && ftruncate (share->file, share->size) == 0)
+        map = mmap (nullptr, share->size, PROT_READ | PROT_WRITE, MAP_SHARED, share->file, 0);
+
+    if (map == MAP_FAILED)
+    {
+        write_line ("The image could not be shared");
+        if (share->file >= 0)
+            close (share->file);
+        shm_unlink (SHARED_CANVAS_NAME);
+        delete share;
+        return;
+    }
+
+    share->header = (shared_canvas_header *) map;
+    share->pixels = (unsigned int *) ((unsigned char *) map + sizeof (shared_canvas_header));
+
+    // Left over memory from an earlier run is cleared while its sequence is odd, and gets a
+    // new session, so a reader that was already watching it copies the whole image again
+    bool left_over = share->header->magic == SHARED_CANVAS_MAGIC && share->header->version == SHARED_CANVAS_VERSION;
+    uint64_t sequence = left_over ? share->header->sequence.load() | 1 : 1;
+
+    share->header->sequence.store (sequence, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+
+    memset (share->header->dirty, 0, sizeof (share->header->dirty));
+    share->header->width = IMAGE_WIDTH;
+    share->header->height = HEIGHT;
+    share->header->session = left_over ? share->header->session + 1 : 1;
+    share->header->version = SHARED_CANVAS_VERSION;
+    share->header->dirty_count.store (0, memory_order_relaxed);
+    share->header->magic = SHARED_CANVAS_MAGIC;
+    share->header->sequence.store (sequence + 1, memory_order_release);
+
+    program.share = share;
+    mark_stale (program.canvas, rectangle_from (0, 0, IMAGE_WIDTH, HEIGHT));
+    write_line ("Sharing the image as " + string (SHARED_CANVAS_NAME));
+}
+
+/**
+ * Copy the areas of the user image drawn on since the last publish into shared memory, and
+ * add them to the dirty areas. Called once a frame.
+ *
+ * @param program   Struct containing program data
+ */
+void publish_canvas (program_data &program)
+{
+    if (program.share == nullptr)
+        return;
+
+    vector<rectangle> areas = take_unpublished (program.canvas);
+
+    if (areas.size() == 0)
+        return;
+
+    shared_canvas_header &header = *program.share->header;
+    const pixel_buffer &image = canvas_pixels (program);
+    uint64_t sequence = header.sequence.load (memory_order_relaxed) + 1;
+    uint64_t count = header.dirty_count.load (memory_order_relaxed);
+
+    // Odd while the pixels are being changed
+    header.sequence.store (sequence, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+
+    for (const rectangle &area : areas)
+    {
+        for (int y = area.y; y < area.y + area.height; y++)
+            memcpy (&program.share->pixels[(size_t) y * IMAGE_WIDTH + (int) area.x], &image.pixels[(size_t) y * IMAGE_WIDTH + (int) area.x], area.width * sizeof (unsigned int));
+
+        shared_dirty_area &slot = header.dirty[count % SHARED_DIRTY_SLOTS];
+        slot.sequence = sequence + 1;
+        slot.x = area.x;
+        slot.y = area.y;
+        slot.width = area.width;
+        slot.height = area.height;
+        count++;
+    }
+
+    header.dirty_count.store (count, memory_order_relaxed);
+    header.sequence.store (sequence + 1, memory_order_release);
+}
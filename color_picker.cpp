@@ -0,0 +1,161 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cmath>
+
+#define PI 3.14159
+// Panel holding the color wheel, next to the active color block on the sidebar
+#define PICKER_X 560
+#define PICKER_Y 400
+#define PICKER_WIDTH 240
+#define PICKER_HEIGHT 200
+#define WHEEL_SIZE 180
+#define WHEEL_X (PICKER_X + 10)
+#define WHEEL_Y (PICKER_Y + 10)
+#define STRIP_X (PICKER_X + 200)
+#define STRIP_WIDTH 30
+
+using namespace std;
+
+/**
+ * Get the color wheel, creating it the first time. Hue goes around the wheel and saturation
+ * goes out from the centre, all at full brightness.
+ *
+ * @returns     The color wheel bitmap
+ */
+bitmap color_wheel()
+{
+    if (has_bitmap ("color_wheel"))
+        return bitmap_named ("color_wheel");
+
+    pixel_buffer pixels = new_pixel_buffer (WHEEL_SIZE, WHEEL_SIZE);
+    double radius = WHEEL_SIZE / 2.0;
+
+    for (int y = 0; y < WHEEL_SIZE; y++)
+    {
+        for (int x = 0; x < WHEEL_SIZE; x++)
+        {
+            double dx = x + 0.5 - radius;
+            double dy = y + 0.5 - radius;
+            double distance = sqrt (dx * dx + dy * dy);
+
+            if (distance <= radius)
+                pixels.pixels[y * WHEEL_SIZE + x] = pack_color (hsb_color (atan2 (dy, dx) / (2 * PI) + 0.5, distance / radius, 1));
+        }
+    }
+
+    bitmap result = create_bitmap ("color_wheel", WHEEL_SIZE, WHEEL_SIZE);
+    write_pixels (result, pixels, 0, 0);
+
+    return result;
+}
+
+/**
+ * Draw the color wheel panel, with markers at the chosen hue, saturation and brightness
+ *
+ * @param program       Struct containing program data
+ * @param hue           Chosen hue, from 0 to 1
+ * @param saturation    Chosen saturation, from 0 to 1
+ * @param brightness    Chosen brightness, from 0 to 1
+ */
+void draw_color_wheel (program_data &program, double hue, double saturation, double brightness)
+{
+    double radius = WHEEL_SIZE / 2.0;
+    double angle = (hue - 0.5) * 2 * PI;
+
+    queue_bitmap (program.the_window, program.to_draw, 0, 0);
+    queue_fill_rectangle (program.the_window, COLOR_WHITE, PICKER_X, PICKER_Y, PICKER_WIDTH, PICKER_HEIGHT);
+    queue_rectangle (program.the_window, COLOR_BLACK, PICKER_X, PICKER_Y, PICKER_WIDTH, PICKER_HEIGHT);
+
+    // Darken the cached wheel to the chosen brightness rather than redrawing it
+    queue_bitmap (program.the_window, color_wheel(), WHEEL_X, WHEEL_Y);
+    queue_fill_circle (program.the_window, rgba_color (0, 0, 0, (int) ((1 - brightness) * 255)), WHEEL_X + radius, WHEEL_Y + radius, radius);
+    queue_circle (program.the_window, COLOR_GRAY, WHEEL_X + radius + cos (angle) * saturation * radius,
+                  WHEEL_Y + radius + sin (angle) * saturation * radius, 4);
+
+    for (int y = 0; y < WHEEL_SIZE; y++)
+        queue_line (program.the_window, hsb_color (hue, saturation, 1 - (double) y / (WHEEL_SIZE - 1)), STRIP_X, WHEEL_Y + y, STRIP_X + STRIP_WIDTH - 1, WHEEL_Y + y);
+    queue_rectangle (program.the_window, COLOR_GRAY, STRIP_X - 2, WHEEL_Y + (1 - brightness) * (WHEEL_SIZE - 1) - 2, STRIP_WIDTH + 4, 5);
+
+    draw_sidebar (program);
+    flush_render (program.the_window);
+}
+
+/**
+ * Choose the active color from a color wheel and brightness strip. The chosen color comes
+ * from where the mouse is on the wheel, so nothing is read back from the window. The panel
+ * closes when the mouse is pressed outside it, or Enter or Escape is pressed.
+ *
+ * @param program   Struct containing program data
+ */
+void color_wheel_picker (program_data &program)
+{
+    double hue = hue_of (program.active_color);
+    double saturation = saturation_of (program.active_color);
+    double brightness = brightness_of (program.active_color);
+    double radius = WHEEL_SIZE / 2.0;
+    bool on_wheel = false, on_strip = false;
+
+    draw_color_wheel (program, hue, saturation, brightness);
+
+    while (not quit_requested() && not key_typed (ESCAPE_KEY) && not key_typed (RETURN_KEY))
+    {
+        process_events();
+
+        if (not mouse_down (LEFT_BUTTON))
+        {
+            on_wheel = on_strip = false;
+            continue;
+        }
+
+        double dx = mouse_x() - (WHEEL_X + radius);
+        double dy = mouse_y() - (WHEEL_Y + radius);
+
+        // A drag stays with the wheel or strip it started on, even if the mouse leaves it
+        if (not on_wheel && not on_strip)
+        {
+            on_wheel = sqrt (dx * dx + dy * dy) <= radius;
+            on_strip = mouse_x() >= STRIP_X && mouse_x() < STRIP_X + STRIP_WIDTH && mouse_y() >= WHEEL_Y && mouse_y() < WHEEL_Y + WHEEL_SIZE;
+
+            if (not on_wheel && not on_strip && not point_in_rectangle (mouse_position(), rectangle_from (PICKER_X, PICKER_Y, PICKER_WIDTH, PICKER_HEIGHT)))
+                break;
+        }
+
+        if (on_wheel)
+        {
+            hue = atan2 (dy, dx) / (2 * PI) + 0.5;
+            saturation = min (sqrt (dx * dx + dy * dy) / radius, 1.0);
+        }
+        else if (on_strip)
+            brightness = 1 - min (max ((mouse_y() - WHEEL_Y) / (WHEEL_SIZE - 1.0), 0.0), 1.0);
+
+        program.active_color = hsb_color (hue, saturation, brightness);
+        draw_color_wheel (program, hue, saturation, brightness);
+    }
+
+    // Wait for the click that closed the panel to finish, so it doesn't start drawing
+    while (mouse_down (LEFT_BUTTON))
+        process_events();
+
+    queue_bitmap (program.the_window, program.to_draw, 0, 0);
+    draw_sidebar (program);
+    flush_render (program.the_window);
+}
+
+/**
+ * Eyedropper. Sets the active color from the user image under the mouse while the left mouse
+ * is down, taken from the in-memory copy of the image.
+ *
+ * @param program   Struct containing program data
+ */
+void pick_canvas_color (program_data &program)
+{
+    while (mouse_down (LEFT_BUTTON))
+    {
+        process_events();
+
+        program.active_color = unpack_color (canvas_pixel (program, mouse_x(), mouse_y()));
+
+        draw_sidebar (program);
+        flush_render (program.the_window);
+    }
+}
@@ -0,0 +1,584 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Number of commands between full checkpoints of the image
+#define CHECKPOINT_INTERVAL 20
+// Number of newest checkpoints kept as bitmaps, older ones are read back from the journal
+#define CHECKPOINTS_IN_MEMORY 4
+#define PI 3.14159
+
+using namespace std;
+
+/**
+ * Advance a xorshift random number generator. Used instead of rnd() wherever a command
+ * has to be replayed exactly.
+ *
+ * @param state     The generator state, which must not be 0
+ *
+ * @returns         The next random number
+ */
+unsigned int next_random (unsigned int &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
+/**
+ * Get a random number between 0 and 1 from a xorshift generator
+ *
+ * @param state     The generator state
+ *
+ * @returns         A number from 0 up to but not including 1
+ */
+double random_unit (unsigned int &state)
+{
+    return (next_random (state) >> 8) / 16777216.0;
+}
+
+/**
+ * Create a command for the active draw mode and color
+ *
+ * @param program   Struct containing program data
+ *
+ * @returns         The new command, with no points yet
+ */
+tool_command new_command (program_data &program)
+{
+    tool_command result;
+
+    result.mode = program.mode;
+    result.draw_color = program.active_color;
+    result.seed = 0;
+
+    return result;
+}
+
+/**
+ * Find the area of the image a command can change. Flood fills are not bounded by anything
+ * the command holds, so they cover the whole image.
+ *
+ * @param command   The command to be checked
+ *
+ * @returns         The bounding rectangle of the command
+ */
+rectangle command_bounds (const tool_command &command)
+{
+    rectangle result = { 0, 0, IMAGE_WIDTH, HEIGHT };
+    const vector<double> &v = command.values;
+    double left = IMAGE_WIDTH, top = HEIGHT, right = 0, bottom = 0;
+    double margin = 1;
+
+    if ((command.mode == FILL && v.size() == 0) || command.mode == PALETTE || command.mode == NONE)
+        return result;
+
+    // Pen and eraser dots are drawn to the bottom right of each point, the spray and sampling
+    // brushes all around it
+    bool centred = command.mode == SPRAY || command.mode == SMUDGE || command.mode == BLUR_BRUSH || command.mode == CLONE;
+
+    if (command.mode == ERASER)
+        margin = 11;
+    else if (command.mode == PEN)
+        margin = 5;
+    else if (command.mode == SPRAY)
+        margin = 21;
+    else if (centred)
+        margin = v[0] / 2 + 1;
+
+    for (point_2d point : command.points)
+    {
+        left = min (left, point.x - (centred ? margin : 1));
+        top = min (top, point.y - (centred ? margin : 1));
+        right = max (right, point.x + margin);
+        bottom = max (bottom, point.y + margin);
+    }
+
+    if (command.mode >= DRAW_REC && command.mode <= FILL_ELL)
+    {
+        left = min (v[0], v[0] + v[2]) - 1;
+        top = min (v[1], v[1] + v[3]) - 1;
+        right = max (v[0], v[0] + v[2]) + 1;
+        bottom = max (v[1], v[1] + v[3]) + 1;
+    }
+
+    else if (command.mode == FILL)
+    {
+        left = v[1];
+        top = v[2];
+        right = v[1] + v[3];
+        bottom = v[2] + v[4];
+    }
+
+    else if (command.mode == STYLED_FILL)
+    {
+        left = v[2];
+        top = v[3];
+        right = v[2] + v[4];
+        bottom = v[3] + v[5];
+    }
+
+    else if (command.mode == VECTOR)
+    {
+        left = v[4];
+        top = v[5];
+        right = v[4] + v[6];
+        bottom = v[5] + v[7];
+    }
+
+    else if (command.mode == FILTER)
+    {
+        left = v[0];
+        top = v[1];
+        right = v[0] + v[2];
+        bottom = v[1] + v[3];
+    }
+
+    else if (command.mode == SELECT)
+    {
+        // The area the selection was cut from, and the area it was drawn to after transforming
+        double half_width = fabs (v[2] * v[6] * cos (v[8] * PI / 180)) / 2 + fabs (v[3] * v[7] * sin (v[8] * PI / 180)) / 2;
+        double half_height = fabs (v[2] * v[6] * sin (v[8] * PI / 180)) / 2 + fabs (v[3] * v[7] * cos (v[8] * PI / 180)) / 2;
+        double centre_x = v[4] + v[2] / 2;
+        double centre_y = v[5] + v[3] / 2;
+
+        left = min (v[0], centre_x - half_width) - 1;
+        top = min (v[1], centre_y - half_height) - 1;
+        right = max (v[0] + v[2], centre_x + half_width) + 1;
+        bottom = max (v[1] + v[3], centre_y + half_height) + 1;
+    }
+
+    result.x = left;
+    result.y = top;
+    result.width = max (right - left, 0.0);
+    result.height = max (bottom - top, 0.0);
+
+    return result;
+}
+
+/**
+ * Draw a recorded command onto an image. Given the same image, this gives exactly the
+ * same result as the tool did when the command was recorded.
+ *
+ * @param to_draw   The image to be drawn to
+ * @param command   The command to be drawn
+ */
+void apply_command (bitmap to_draw, const tool_command &command)
+{
+    const vector<point_2d> &p = command.points;
+    const vector<double> &v = command.values;
+    color c = command.draw_color;
+    unsigned int state = command.seed;
+    select_tool_data selection;
+    pixel_buffer pixels;
+    rectangle area;
+
+    switch (command.mode)
+    {
+        case ERASER:   for (point_2d point : p)
+                           fill_rectangle_on_bitmap (to_draw, COLOR_WHITE, point.x, point.y, 10, 10);
+                       break;
+        case PEN:      for (point_2d point : p)
+                           fill_ellipse_on_bitmap (to_draw, c, point.x, point.y, 4, 4);
+                       break;
+        case SPRAY:    for (point_2d point : p)
+                           spray_particles (to_draw, c, point.x, point.y, state);
+                       break;
+        case DRAW_REC: draw_rectangle_on_bitmap (to_draw, c, v[0], v[1], v[2], v[3]);
+                       break;
+        case FILL_REC: fill_rectangle_on_bitmap (to_draw, c, v[0], v[1], v[2], v[3]);
+                       break;
+        case DRAW_ELL: draw_ellipse_on_bitmap (to_draw, c, v[0], v[1], v[2], v[3]);
+                       break;
+        case FILL_ELL: fill_ellipse_on_bitmap (to_draw, c, v[0], v[1], v[2], v[3]);
+                       break;
+        case DRAW_TRI: draw_triangle_on_bitmap (to_draw, c, p[0].x, p[0].y, p[1].x, p[1].y, p[2].x, p[2].y);
+                       break;
+        case FILL_TRI: fill_triangle_on_bitmap (to_draw, c, p[0].x, p[0].y, p[1].x, p[1].y, p[2].x, p[2].y);
+                       break;
+        case SELECT:   // values are the selected area, then where it was moved to and how it was transformed
+                       selection.graphic = draw_selection (to_draw, v[0], v[1], v[2], v[3]);
+                       selection.x = v[4];
+                       selection.y = v[5];
+                       selection.scale_x = v[6];
+                       selection.scale_y = v[7];
+                       selection.angle = v[8];
+                       commit_selection (to_draw, selection);
+                       break;
+        case FILL:     // Replacing all also has a tolerance and the area it changed, and nothing outside it matched
+                       if (v.size() > 0)
+                       {
+                           unsigned int target = pack_color (get_pixel (to_draw, p[0].x, p[0].y));
+                           pixels = read_pixels (to_draw, v[1], v[2], v[3], v[4]);
+                           replace_color (pixels, target, pack_color (c), v[0]);
+                           write_pixels (to_draw, pixels, v[1], v[2]);
+                       }
+                       else
+                           fill_area (to_draw, c, p[0].x, p[0].y);
+                       break;
+        case FILTER:   // values are the filtered area, then the filter and its two settings
+                       pixels = read_pixels (to_draw, v[0], v[1], v[2], v[3]);
+                       apply_filter (pixels, (filter_type) v[4], v[5], v[6], 1);
+                       write_pixels (to_draw, pixels, v[0], v[1]);
+                       break;
+        case STYLED_FILL: // values are the fill style and second color, then the area the fill covers
+                       pixels = read_pixels (to_draw, v[2], v[3], v[4], v[5]);
+                       styled_fill (pixels, v[2], v[3], command);
+                       write_pixels (to_draw, pixels, v[2], v[3]);
+                       break;
+        case SMUDGE:
+        case BLUR_BRUSH:
+        case CLONE:    // values are the brush size and strength, then for cloning how far away the source is
+                       area = brush_read_area (command);
+                       pixels = read_pixels (to_draw, area.x, area.y, area.width, area.height);
+                       brush_stroke (pixels, area.x, area.y, command);
+                       write_pixels (to_draw, pixels, area.x, area.y);
+                       break;
+        case VECTOR:   // values are the vector layer edit, then the area it redrew and its pixels
+                       write_pixels (to_draw, vector_edit_pixels (command), v[4], v[5]);
+                       break;
+        case PALETTE:  // Only changes the indexed canvas
+        case NONE:     break;
+    }
+}
+
+/**
+ * Take a checkpoint of the current image, and start saving it to the undo journal
+ *
+ * @param program   Struct containing program data
+ */
+void add_checkpoint (program_data &program)
+{
+    history_checkpoint checkpoint;
+
+    checkpoint.command_index = program.history.commands.size();
+    checkpoint.journal_offset = 0;
+
+    // The indexed canvas is checkpointed as indices, at a quarter of the size of a bitmap
+    if (program.indexed.enabled)
+    {
+        checkpoint.graphic = nullptr;
+        checkpoint.indices = program.indexed.pixels;
+        checkpoint.palette = program.indexed.palette;
+    }
+    else
+    {
+        checkpoint.graphic = create_bitmap ("checkpoint", IMAGE_WIDTH, HEIGHT);
+        draw_bitmap_on_bitmap (checkpoint.graphic, program.to_draw, 0, 0);
+    }
+
+    program.history.checkpoints.push_back (checkpoint);
+    journal_checkpoint (program.journal, program.to_draw, checkpoint.command_index);
+    trim_checkpoints (program.history);
+}
+
+/**
+ * Free the bitmaps of older checkpoints once they are safely stored in the undo journal
+ *
+ * @param history   The command history
+ */
+void trim_checkpoints (command_history &history)
+{
+    int in_memory = 0;
+
+    for (int i = history.checkpoints.size() - 1; i >= 0; i--)
+    {
+        history_checkpoint &checkpoint = history.checkpoints[i];
+
+        if (checkpoint.graphic == nullptr)
+            continue;
+
+        if (in_memory < CHECKPOINTS_IN_MEMORY || checkpoint.journal_offset == 0)
+            in_memory++;
+        else
+        {
+            free_bitmap (checkpoint.graphic);
+            checkpoint.graphic = nullptr;
+        }
+    }
+}
+
+/**
+ * Drop checkpoints that come after a given number of commands
+ *
+ * @param history       The command history
+ * @param command_count Number of commands that are still in the history
+ */
+void drop_checkpoints_after (command_history &history, size_t command_count)
+{
+    while (history.checkpoints.size() > 0 && history.checkpoints.back().command_index > command_count)
+    {
+        if (history.checkpoints.back().graphic != nullptr)
+            free_bitmap (history.checkpoints.back().graphic);
+        history.checkpoints.pop_back();
+    }
+}
+
+/**
+ * Start a new history for the current image, with a checkpoint of the image as it is now
+ *
+ * @param program   Struct containing program data
+ */
+void init_history (program_data &program)
+{
+    drop_checkpoints_after (program.history, 0);
+    if (program.history.checkpoints.size() > 0 && program.history.checkpoints[0].graphic != nullptr)
+        free_bitmap (program.history.checkpoints[0].graphic);
+
+    program.history.commands.clear();
+    program.history.redo.clear();
+    program.history.checkpoints.clear();
+    forget_thumbnails (program, 0);
+
+    add_checkpoint (program);
+
+    // The saved base image no longer matches the start of the history
+    program.document.base_dirty = true;
+
+    // Shapes can't be moved once the commands that drew them are gone
+    if (program.vectors.enabled)
+        flatten_vector_layer (program);
+}
+
+/**
+ * Add a finished tool operation to the history. This clears the redo list, and takes a new
+ * checkpoint every CHECKPOINT_INTERVAL commands.
+ *
+ * @param program   Struct containing program data
+ * @param command   The command that has just been drawn
+ */
+void record_command (program_data &program, tool_command &command)
+{
+    command_history &history = program.history;
+
+    // Drawing after an undo throws away the undone commands, and the thumbnails of the
+    // points in the history they led to
+    if (history.redo.size() > 0)
+        forget_thumbnails (program, history.commands.size() + 1);
+
+    history.commands.push_back (command);
+    history.redo.clear();
+
+    // The tool drew with SplashKit, so redraw its area from the indices it should have set
+    if (program.indexed.enabled)
+    {
+        apply_indexed_command (program.indexed, command);
+        present_indexed (program, command_bounds (command));
+    }
+
+    if (program.vectors.enabled)
+        vector_record (program, command);
+
+    journal_command (program.journal, command);
+    mark_dirty (program.document, command_bounds (command));
+    mark_stale (program.canvas, command_bounds (command));
+
+    if (history.commands.size() - history.checkpoints.back().command_index >= CHECKPOINT_INTERVAL)
+        add_checkpoint (program);
+}
+
+/**
+ * Redraw the image for the current point in the history, by restoring the nearest
+ * checkpoint and replaying the commands that follow it.
+ *
+ * @param program   Struct containing program data
+ */
+void restore_history (program_data &program)
+{
+    command_history &history = program.history;
+    history_checkpoint &checkpoint = history.checkpoints.back();
+
+    if (program.indexed.enabled && checkpoint.indices.size() > 0)
+    {
+        program.indexed.pixels = checkpoint.indices;
+        program.indexed.palette = checkpoint.palette;
+
+        for (size_t i = checkpoint.command_index; i < history.commands.size(); i++)
+            apply_indexed_command (program.indexed, history.commands[i]);
+
+        present_indexed (program, rectangle_from (0, 0, IMAGE_WIDTH, HEIGHT));
+        return;
+    }
+
+    if (checkpoint.graphic != nullptr)
+        draw_bitmap_on_bitmap (program.to_draw, checkpoint.graphic, 0, 0);
+    else
+        write_pixels (program.to_draw, journal_read (program.journal, checkpoint.journal_offset), 0, 0);
+
+    for (size_t i = checkpoint.command_index; i < history.commands.size(); i++)
+        apply_command (program.to_draw, history.commands[i]);
+
+    if (program.vectors.enabled)
+        rebuild_vector_layer (program);
+}
+
+/**
+ * Move to any point in the history in one step. Going back restores the nearest checkpoint
+ * once rather than undoing each command, and going forward draws the undone commands again
+ * without redrawing the window between them.
+ *
+ * @param program   Struct containing program data
+ * @param state     Number of commands drawn at the point to move to
+ */
+void jump_to_state (program_data &program, size_t state)
+{
+    command_history &history = program.history;
+
+    // Commands from before the oldest checkpoint can't be replayed
+    if (state < history.checkpoints.front().command_index || state > history.commands.size() + history.redo.size())
+        return;
+
+    if (state < history.commands.size())
+    {
+        while (history.commands.size() > state)
+        {
+            history.redo.push_back (history.commands.back());
+            history.commands.pop_back();
+            mark_dirty (program.document, command_bounds (history.redo.back()));
+            mark_stale (program.canvas, command_bounds (history.redo.back()));
+        }
+
+        drop_checkpoints_after (history, state);
+        journal_pop (program.journal, state);
+        restore_history (program);
+        return;
+    }
+
+    // record_command clears the redo list, so keep the rest of it
+    vector<tool_command> redo;
+    redo.swap (history.redo);
+
+    while (history.commands.size() < state)
+    {
+        tool_command command = redo.back();
+        redo.pop_back();
+
+        apply_command (program.to_draw, command);
+        record_command (program, command);
+    }
+
+    history.redo.swap (redo);
+}
+
+/**
+ * Undo the last action done by user
+ *
+ * @param program    Struct containing program data
+ */
+void undo_changes (program_data &program)
+{
+    if (program.history.commands.size() > 0)
+        jump_to_state (program, program.history.commands.size() - 1);
+}
+
+/**
+ * Redo last undone action by user
+ *
+ * @param program    Struct containing program data
+ */
+void redo_changes (program_data &program)
+{
+    jump_to_state (program, program.history.commands.size() + 1);
+}
+
+/**
+ * Append a double to serialised command data as two words
+ *
+ * @param data      The serialised data
+ * @param value     The value to append
+ */
+void serialise_double (vector<unsigned int> &data, double value)
+{
+    unsigned int words[2];
+
+    memcpy (words, &value, sizeof (value));
+    data.push_back (words[0]);
+    data.push_back (words[1]);
+}
+
+/**
+ * Read a double written by serialise_double
+ *
+ * @param data      The serialised data
+ *
+ * @returns         The value
+ */
+double deserialise_double (const unsigned int *data)
+{
+    double result;
+
+    memcpy (&result, data, sizeof (result));
+
+    return result;
+}
+
+/**
+ * Convert a command into words for storing in the undo journal
+ *
+ * @param command   The command to be converted
+ *
+ * @returns         The serialised command
+ */
+vector<unsigned int> serialise_command (const tool_command &command)
+{
+    vector<unsigned int> result;
+
+    result.push_back (command.mode);
+    result.push_back (pack_color (command.draw_color));
+    result.push_back (command.seed);
+    result.push_back (command.points.size());
+    result.push_back (command.values.size());
+
+    for (point_2d point : command.points)
+    {
+        serialise_double (result, point.x);
+        serialise_double (result, point.y);
+    }
+
+    for (double value : command.values)
+        serialise_double (result, value);
+
+    return result;
+}
+
+/**
+ * Convert words written by serialise_command back into a command
+ *
+ * @param data      The serialised command
+ * @param length    Number of words of data
+ *
+ * @returns         The command, with mode NONE if the data is not valid
+ */
+tool_command deserialise_command (const unsigned int *data, size_t length)
+{
+    tool_command result;
+    point_2d point;
+
+    result.mode = NONE;
+
+    if (length < 5 || length != 5 + (size_t) data[3] * 4 + (size_t) data[4] * 2)
+        return result;
+
+    unsigned int point_count = data[3];
+    unsigned int value_count = data[4];
+
+    result.mode = (mode_option) data[0];
+    result.draw_color = unpack_color (data[1]);
+    result.seed = data[2];
+    data += 5;
+
+    for (unsigned int i = 0; i < point_count; i++, data += 4)
+    {
+        point.x = deserialise_double (data);
+        point.y = deserialise_double (data + 2);
+        result.points.push_back (point);
+    }
+
+    for (unsigned int i = 0; i < value_count; i++, data += 2)
+        result.values.push_back (deserialise_double (data));
+
+    return result;
+}
@@ -0,0 +1,689 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DOCUMENT_FILE "User_image.sadoc"
+#define DOCUMENT_MAGIC 0x43444153
+#define DOCUMENT_VERSION 2
+#define TILE_SIZE 64
+#define LAYER_NAME_LENGTH 24
+#define LAYER_HISTORY_BASE 1
+#define LAYER_INDEXED 2
+
+using namespace std;
+
+/*  File layout:
+        header                      at offset 0, always rewritten last on save
+        tile data                   run length encoded (run, pixel) pairs, one block per tile
+        history                     command count, then each serialised command prefixed with its length
+        palette                     indexed documents only, the history base palette then the current one
+        layer table                 one document_layer per layer, each followed by its tile index
+    Layers flagged LAYER_INDEXED hold (run, palette index) pairs instead of pixels.
+    Saving appends changed tiles, a new history and a new layer table, then points the
+    header at them. Space used by replaced tiles is only reclaimed when the whole file is
+    rewritten, which happens once it is more than half unused. */
+
+struct document_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile_size;
+    uint32_t layer_count;
+    uint64_t layer_table;
+    uint64_t history;
+    uint64_t history_size;
+    uint64_t live_bytes;
+
+    // Version 2 and later
+    uint64_t palette;
+    uint64_t palette_size;
+};
+
+struct document_layer
+{
+    char name[LAYER_NAME_LENGTH];
+    uint32_t flags;
+    uint32_t tile_count;
+};
+
+/**
+ * Number of tiles across and down the image
+ *
+ * @param tiles_x   Set to the number of tiles across
+ * @param tiles_y   Set to the number of tiles down
+ */
+void document_tile_counts (int &tiles_x, int &tiles_y)
+{
+    tiles_x = (IMAGE_WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_y = (HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+/**
+ * Get the area of the image covered by a tile
+ *
+ * @param index     The tile number, counting across then down
+ *
+ * @returns         The tile area, clipped to the image
+ */
+rectangle tile_area (int index)
+{
+    int tiles_x, tiles_y;
+    rectangle result;
+
+    document_tile_counts (tiles_x, tiles_y);
+
+    result.x = (index % tiles_x) * TILE_SIZE;
+    result.y = (index / tiles_x) * TILE_SIZE;
+    result.width = min (TILE_SIZE, IMAGE_WIDTH - (int) result.x);
+    result.height = min (TILE_SIZE, HEIGHT - (int) result.y);
+
+    return result;
+}
+
+/**
+ * Set up document data for an image that hasn't been saved yet
+ *
+ * @param document  The document data
+ */
+void init_document (document_data &document)
+{
+    int tiles_x, tiles_y;
+
+    document_tile_counts (tiles_x, tiles_y);
+
+    document.filename = DOCUMENT_FILE;
+    document.file_valid = false;
+    document.file_end = 0;
+    document.live_bytes = 0;
+    document.image_tiles.assign (tiles_x * tiles_y, document_tile());
+    document.base_tiles.assign (tiles_x * tiles_y, document_tile());
+    document.dirty.assign (tiles_x * tiles_y, true);
+    document.base_dirty = true;
+    document.indexed = false;
+}
+
+/**
+ * Mark the tiles under an area of the image as needing to be checked on the next save
+ *
+ * @param document  The document data
+ * @param area      The area that was drawn on
+ */
+void mark_dirty (document_data &document, rectangle area)
+{
+    int tiles_x, tiles_y;
+
+    document_tile_counts (tiles_x, tiles_y);
+
+    int left = max ((int) floor (area.x) / TILE_SIZE, 0);
+    int top = max ((int) floor (area.y) / TILE_SIZE, 0);
+    int right = min ((int) ceil (area.x + area.width) / TILE_SIZE, tiles_x - 1);
+    int bottom = min ((int) ceil (area.y + area.height) / TILE_SIZE, tiles_y - 1);
+
+    for (int y = top; y <= bottom; y++)
+        for (int x = left; x <= right; x++)
+            document.dirty[y * tiles_x + x] = true;
+}
+
+/**
+ * Run length encode a tile as (run, pixel) pairs
+ *
+ * @param tile      The tile pixels
+ *
+ * @returns         The encoded tile
+ */
+vector<unsigned int> encode_tile (const pixel_buffer &tile)
+{
+    vector<unsigned int> result;
+    unsigned int run = 0;
+    unsigned int run_pixel = 0;
+
+    for (unsigned int pixel : tile.pixels)
+    {
+        if (run > 0 && pixel == run_pixel)
+            run++;
+        else
+        {
+            if (run > 0)
+            {
+                result.push_back (run);
+                result.push_back (run_pixel);
+            }
+            run_pixel = pixel;
+            run = 1;
+        }
+    }
+
+    result.push_back (run);
+    result.push_back (run_pixel);
+
+    return result;
+}
+
+/**
+ * Decode a tile from a mapped document
+ *
+ * @param map       The mapped document file
+ * @param tile      Where the tile is stored
+ * @param area      The area of the image covered by the tile
+ *
+ * @returns         The tile pixels, or palette indices for an indexed layer
+ */
+pixel_buffer decode_document_tile (const unsigned char *map, const document_tile &tile, rectangle area)
+{
+    const unsigned int *data = (const unsigned int *) (map + tile.offset);
+    size_t words = tile.size / 4;
+    pixel_buffer pixels = new_pixel_buffer (area.width, area.height);
+    size_t pos = 0;
+
+    for (size_t i = 0; i + 1 < words; i += 2)
+        for (unsigned int run = 0; run < data[i] && pos < pixels.pixels.size(); run++)
+            pixels.pixels[pos++] = data[i + 1];
+
+    return pixels;
+}
+
+/**
+ * Decode a tile from a mapped document and draw it onto a bitmap. A tile that is a single
+ * run, such as an untouched area of background, is drawn as one rectangle.
+ *
+ * @param map       The mapped document file
+ * @param tile      Where the tile is stored
+ * @param area      The area of the image covered by the tile
+ * @param dest      The bitmap to be drawn to
+ */
+void draw_document_tile (const unsigned char *map, const document_tile &tile, rectangle area, bitmap dest)
+{
+    const unsigned int *data = (const unsigned int *) (map + tile.offset);
+
+    if (tile.size == 8)
+    {
+        fill_rectangle_on_bitmap (dest, unpack_color (data[1]), area.x, area.y, area.width, area.height);
+        return;
+    }
+
+    write_pixels (dest, decode_document_tile (map, tile, area), area.x, area.y);
+}
+
+/**
+ * Copy the indices of a tile out of an indexed image, or into it
+ *
+ * @param indices   The indexed image
+ * @param area      The area of the image covered by the tile
+ * @param tile      The tile, as a buffer of index values
+ * @param to_tile   True to copy from the image to the tile, false to copy the other way
+ */
+void copy_index_tile (vector<unsigned char> &indices, rectangle area, pixel_buffer &tile, bool to_tile)
+{
+    for (int y = 0; y < tile.height; y++)
+    {
+        for (int x = 0; x < tile.width; x++)
+        {
+            unsigned char &index = indices[((int) area.y + y) * IMAGE_WIDTH + (int) area.x + x];
+
+            if (to_tile)
+                tile.pixels[y * tile.width + x] = index;
+            else
+                index = tile.pixels[y * tile.width + x];
+        }
+    }
+}
+
+/**
+ * Write a block of data at a position in a file
+ *
+ * @param file      The open file
+ * @param offset    Where to write the data
+ * @param data      The data to be written
+ * @param length    Number of bytes of data
+ *
+ * @returns         True if all of the data was written
+ */
+bool write_block (int file, unsigned long long offset, const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+
+    while (length > 0)
+    {
+        ssize_t written = pwrite (file, bytes, length, offset);
+        if (written <= 0)
+            return false;
+
+        bytes += written;
+        offset += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+/**
+ * Append tiles to the document file if their pixels have changed since they were last saved.
+ * Each tile is hashed and encoded as its own job, and written by a job that waits for its
+ * encoding and for the write of the tile before it, so the tiles go into the file in order
+ * while later tiles are still being encoded.
+ *
+ * @param document  The document data
+ * @param file      The open document file
+ * @param tiles     Where each tile is stored, updated if it is rewritten
+ * @param pixels    The current pixels of each tile
+ *
+ * @returns         True if the tiles could be written or didn't need to be
+ */
+bool save_tiles (document_data &document, int file, const vector<document_tile *> &tiles, const vector<pixel_buffer> &pixels)
+{
+    vector<unsigned int> hashes (tiles.size());
+    vector<vector<unsigned int>> encoded (tiles.size());
+    vector<char> changed (tiles.size());
+    job_handle last_write = nullptr;
+    bool ok = true;
+
+    for (size_t i = 0; i < tiles.size(); i++)
+    {
+        job_handle encode = submit_job ([&, i]()
+        {
+            hashes[i] = hash_bytes ((const unsigned char *) pixels[i].pixels.data(), pixels[i].pixels.size() * 4);
+            changed[i] = not (document.file_valid && tiles[i]->size > 0 && tiles[i]->hash == hashes[i]);
+
+            if (changed[i])
+                encoded[i] = encode_tile (pixels[i]);
+        }, {});
+
+        vector<job_handle> after = { encode };
+        if (last_write != nullptr)
+            after.push_back (last_write);
+
+        // Only one write runs at a time, so the writes can share the file end and ok
+        last_write = submit_job ([&, i]()
+        {
+            document_tile &tile = *tiles[i];
+            const vector<unsigned int> &data = encoded[i];
+
+            if (not ok || not changed[i])
+                return;
+
+            if (not write_block (file, document.file_end, data.data(), data.size() * 4))
+            {
+                ok = false;
+                return;
+            }
+
+            document.live_bytes += data.size() * 4;
+            if (document.file_valid)
+                document.live_bytes -= tile.size;
+
+            tile.offset = document.file_end;
+            tile.size = data.size() * 4;
+            tile.hash = hashes[i];
+            document.file_end += tile.size;
+        }, after);
+    }
+
+    // The last write waits for every other job, so nothing is left using the buffers
+    if (last_write != nullptr)
+        wait_for_job (last_write);
+
+    return ok;
+}
+
+/**
+ * Get the pixels of the oldest checkpoint, which the saved history is replayed from
+ *
+ * @param program   Struct containing program data
+ *
+ * @returns         The checkpoint pixels
+ */
+pixel_buffer history_base_pixels (program_data &program)
+{
+    history_checkpoint &base = program.history.checkpoints.front();
+
+    if (base.graphic != nullptr)
+        return read_pixels (base.graphic, 0, 0, IMAGE_WIDTH, HEIGHT);
+
+    return journal_read (program.journal, base.journal_offset);
+}
+
+/**
+ * Save the image, its command history and the checkpoint the history starts from to the
+ * native document file. Only tiles drawn on since the last save are read back, and of
+ * those only tiles whose pixels actually changed are written.
+ *
+ * @param program   Struct containing program data
+ */
+void save_document (program_data &program)
+{
+    document_data &document = program.document;
+    command_history &history = program.history;
+    int tiles_x, tiles_y;
+    int file;
+    bool ok = true;
+    bool indexed = program.indexed.enabled && history.checkpoints.front().indices.size() > 0;
+
+    // Switching between indexed and full color changes what every tile holds
+    if (document.file_valid && indexed != document.indexed)
+        document.file_valid = false;
+
+    // Rewrite everything once more than half of the file is replaced tiles
+    if (document.file_valid && document.live_bytes * 2 < document.file_end)
+        document.file_valid = false;
+
+    file = open (document.filename.c_str(), O_RDWR | O_CREAT | (document.file_valid ? 0 : O_TRUNC), 0644);
+    if (file < 0)
+    {
+        write_line ("Could not save " + document.filename);
+        return;
+    }
+
+    if (not document.file_valid)
+    {
+        document.file_end = sizeof (document_header);
+        document.live_bytes = sizeof (document_header);
+    }
+
+    document_tile_counts (tiles_x, tiles_y);
+
+    // Tiles are read back here, since only this thread may draw or read pixels
+    vector<document_tile *> changed_tiles;
+    vector<pixel_buffer> pixels;
+
+    for (int i = 0; i < tiles_x * tiles_y; i++)
+    {
+        if (document.file_valid && not document.dirty[i])
+            continue;
+
+        rectangle area = tile_area (i);
+        pixel_buffer tile = new_pixel_buffer (area.width, area.height);
+
+        // Indexed tiles are taken straight from memory, with nothing read back
+        if (indexed)
+            copy_index_tile (program.indexed.pixels, area, tile, true);
+        else
+            tile = read_pixels (program.to_draw, area.x, area.y, area.width, area.height);
+
+        changed_tiles.push_back (&document.image_tiles[i]);
+        pixels.push_back (tile);
+    }
+
+    ok = save_tiles (document, file, changed_tiles, pixels);
+
+    if (ok && (not document.file_valid || document.base_dirty))
+    {
+        pixel_buffer base;
+        if (not indexed)
+            base = history_base_pixels (program);
+
+        changed_tiles.clear();
+        pixels.clear();
+
+        for (int i = 0; i < tiles_x * tiles_y; i++)
+        {
+            rectangle area = tile_area (i);
+            pixel_buffer tile = new_pixel_buffer (area.width, area.height);
+
+            if (indexed)
+                copy_index_tile (history.checkpoints.front().indices, area, tile, true);
+            else
+                for (int y = 0; y < tile.height; y++)
+                    memcpy (&tile.pixels[y * tile.width], &base.pixels[((int) area.y + y) * IMAGE_WIDTH + (int) area.x], tile.width * 4);
+
+            changed_tiles.push_back (&document.base_tiles[i]);
+            pixels.push_back (tile);
+        }
+
+        ok = save_tiles (document, file, changed_tiles, pixels);
+    }
+
+    // The history is small, so it is always written out again
+    vector<unsigned int> commands;
+    commands.push_back (history.commands.size() - history.checkpoints.front().command_index);
+
+    for (size_t i = history.checkpoints.front().command_index; i < history.commands.size(); i++)
+    {
+        vector<unsigned int> command = serialise_command (history.commands[i]);
+        commands.push_back (command.size());
+        commands.insert (commands.end(), command.begin(), command.end());
+    }
+
+    document_header header = { DOCUMENT_MAGIC, DOCUMENT_VERSION, IMAGE_WIDTH, HEIGHT, TILE_SIZE, 2, 0, 0, 0, 0, 0, 0 };
+    header.history = document.file_end;
+    header.history_size = commands.size() * 4;
+    ok = ok && write_block (file, header.history, commands.data(), header.history_size);
+
+    vector<unsigned int> palette;
+    if (indexed)
+    {
+        palette = history.checkpoints.front().palette;
+        palette.insert (palette.end(), program.indexed.palette.begin(), program.indexed.palette.end());
+    }
+
+    header.palette = header.history + header.history_size;
+    header.palette_size = palette.size() * 4;
+    ok = ok && write_block (file, header.palette, palette.data(), header.palette_size);
+
+    // Layer table, the image followed by the checkpoint the history starts from
+    vector<unsigned char> table;
+    uint32_t flags = indexed ? LAYER_INDEXED : 0;
+    document_layer layers[2] = { { "image", flags, (uint32_t) document.image_tiles.size() },
+                                 { "history base", LAYER_HISTORY_BASE | flags, (uint32_t) document.base_tiles.size() } };
+    vector<document_tile> *tiles[2] = { &document.image_tiles, &document.base_tiles };
+
+    for (int l = 0; l < 2; l++)
+    {
+        table.insert (table.end(), (unsigned char *) &layers[l], (unsigned char *) &layers[l] + sizeof (document_layer));
+        table.insert (table.end(), (unsigned char *) tiles[l]->data(), (unsigned char *) (tiles[l]->data() + tiles[l]->size()));
+    }
+
+    header.layer_table = header.palette + header.palette_size;
+    header.live_bytes = document.live_bytes + header.history_size + header.palette_size + table.size();
+    ok = ok && write_block (file, header.layer_table, table.data(), table.size());
+
+    // The header goes last, so an interrupted save leaves the previous version readable
+    ok = ok && fsync (file) == 0 && write_block (file, 0, &header, sizeof (header)) && fsync (file) == 0;
+    close (file);
+
+    if (not ok)
+    {
+        write_line ("Could not save " + document.filename);
+        document.file_valid = false;
+        return;
+    }
+
+    document.file_end = header.layer_table + table.size();
+    document.file_valid = true;
+    document.indexed = indexed;
+    document.dirty.assign (document.dirty.size(), false);
+    document.base_dirty = false;
+
+    write_line ("Saved " + document.filename);
+}
+
+/**
+ * Open the native document file. The file is mapped rather than read, and only tiles that
+ * are on screen are decoded. The saved history replaces the current one.
+ *
+ * @param program   Struct containing program data
+ */
+void open_document (program_data &program)
+{
+    document_data &document = program.document;
+    int file = open (document.filename.c_str(), O_RDONLY);
+    struct stat info;
+    document_header header;
+    int tiles_x, tiles_y;
+
+    document_tile_counts (tiles_x, tiles_y);
+
+    if (file < 0 || fstat (file, &info) != 0 || (size_t) info.st_size < sizeof (header))
+    {
+        write_line ("Could not open " + document.filename);
+        if (file >= 0)
+            close (file);
+        return;
+    }
+
+    unsigned char *map = (unsigned char *) mmap (nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close (file);
+
+    if (map == MAP_FAILED)
+    {
+        write_line ("Could not open " + document.filename);
+        return;
+    }
+
+    size_t size = info.st_size;
+    size_t table_size = 2 * (sizeof (document_layer) + tiles_x * tiles_y * sizeof (document_tile));
+    memcpy (&header, map, sizeof (header));
+
+    // Version 1 documents have no palette, and their tile data starts where it would be
+    if (header.version == 1)
+        header.palette = header.palette_size = 0;
+
+    if (header.magic != DOCUMENT_MAGIC || header.version < 1 || header.version > DOCUMENT_VERSION || header.width != IMAGE_WIDTH
+        || header.height != HEIGHT || header.tile_size != TILE_SIZE || header.layer_count != 2
+        || header.layer_table + table_size > size || header.history + header.history_size > size
+        || header.palette + header.palette_size > size)
+    {
+        write_line (document.filename + " is not a " + to_string (IMAGE_WIDTH) + "x" + to_string (HEIGHT) + " document");
+        munmap (map, size);
+        return;
+    }
+
+    const unsigned char *table = map + header.layer_table;
+    const document_layer *image_layer = (const document_layer *) table;
+    const document_tile *image_tiles = (const document_tile *) (table + sizeof (document_layer));
+    const document_tile *base_tiles = (const document_tile *) (table + 2 * sizeof (document_layer) + tiles_x * tiles_y * sizeof (document_tile));
+    const unsigned int *palette = (const unsigned int *) (map + header.palette);
+    size_t palette_entries = header.palette_size / 8;
+    bool indexed = (image_layer->flags & LAYER_INDEXED) != 0;
+
+    for (int i = 0; i < tiles_x * tiles_y; i++)
+    {
+        if (image_tiles[i].offset + image_tiles[i].size > size || base_tiles[i].offset + base_tiles[i].size > size
+            || (indexed && palette_entries == 0))
+        {
+            write_line (document.filename + " is damaged");
+            munmap (map, size);
+            return;
+        }
+    }
+
+    // Replace the history, and record that in the journal so a crash recovers the opened document
+    command_history &history = program.history;
+    for (history_checkpoint &checkpoint : history.checkpoints)
+        if (checkpoint.graphic != nullptr)
+            free_bitmap (checkpoint.graphic);
+    history.checkpoints.clear();
+    history.commands.clear();
+    history.redo.clear();
+    forget_thumbnails (program, 0);
+    journal_reset (program.journal);
+
+    history_checkpoint base;
+    base.command_index = 0;
+    base.journal_offset = 0;
+
+    if (indexed)
+    {
+        // Indexed tiles are decoded straight into the index buffers, and only drawn once
+        indexed_canvas &canvas = program.indexed;
+        bitmap journal_copy = create_bitmap ("checkpoint", IMAGE_WIDTH, HEIGHT);
+
+        canvas.enabled = true;
+        canvas.palette.assign (palette + palette_entries, palette + 2 * palette_entries);
+        canvas.pixels.assign (IMAGE_WIDTH * HEIGHT, 0);
+        base.graphic = nullptr;
+        base.palette.assign (palette, palette + palette_entries);
+        base.indices.assign (IMAGE_WIDTH * HEIGHT, 0);
+
+        for (int i = 0; i < tiles_x * tiles_y; i++)
+        {
+            pixel_buffer tile = decode_document_tile (map, image_tiles[i], tile_area (i));
+            copy_index_tile (canvas.pixels, tile_area (i), tile, false);
+
+            tile = decode_document_tile (map, base_tiles[i], tile_area (i));
+            copy_index_tile (base.indices, tile_area (i), tile, false);
+        }
+
+        // Indices past the end of the palette could only come from a damaged file
+        for (size_t i = 0; i < canvas.pixels.size(); i++)
+        {
+            if (canvas.pixels[i] >= palette_entries)
+                canvas.pixels[i] = 0;
+            if (base.indices[i] >= palette_entries)
+                base.indices[i] = 0;
+        }
+
+        present_indexed (program, rectangle_from (0, 0, IMAGE_WIDTH, HEIGHT));
+
+        // The journal stores full color checkpoints
+        pixel_buffer expanded = new_pixel_buffer (IMAGE_WIDTH, HEIGHT);
+        for (size_t i = 0; i < base.indices.size(); i++)
+            expanded.pixels[i] = base.palette[base.indices[i]];
+        write_pixels (journal_copy, expanded, 0, 0);
+
+        history.checkpoints.push_back (base);
+        journal_checkpoint (program.journal, journal_copy, 0);
+        free_bitmap (journal_copy);
+    }
+    else
+    {
+        if (program.indexed.enabled)
+        {
+            program.indexed.enabled = false;
+            vector<unsigned char>().swap (program.indexed.pixels);
+        }
+
+        // The window always shows the whole image, so every tile is decoded when it is opened
+        for (int i = 0; i < tiles_x * tiles_y; i++)
+            draw_document_tile (map, image_tiles[i], tile_area (i), program.to_draw);
+
+        base.graphic = create_bitmap ("checkpoint", IMAGE_WIDTH, HEIGHT);
+        for (int i = 0; i < tiles_x * tiles_y; i++)
+            draw_document_tile (map, base_tiles[i], tile_area (i), base.graphic);
+        history.checkpoints.push_back (base);
+        journal_checkpoint (program.journal, base.graphic, 0);
+    }
+
+    init_canvas_cache (program.canvas);
+
+    const unsigned int *commands = (const unsigned int *) (map + header.history);
+    size_t words = header.history_size / 4;
+    size_t pos = 1;
+
+    for (unsigned int i = 0; words > 0 && i < commands[0] && pos < words; i++)
+    {
+        size_t length = commands[pos];
+        if (pos + 1 + length > words)
+            break;
+
+        history.commands.push_back (deserialise_command (commands + pos + 1, length));
+        journal_command (program.journal, history.commands.back());
+        pos += 1 + length;
+    }
+
+    // Checkpoint the opened image too, so undoing the first steps doesn't replay the whole history
+    if (history.commands.size() > 0)
+        add_checkpoint (program);
+
+    document.image_tiles.assign (image_tiles, image_tiles + tiles_x * tiles_y);
+    document.base_tiles.assign (base_tiles, base_tiles + tiles_x * tiles_y);
+    document.dirty.assign (tiles_x * tiles_y, false);
+    document.base_dirty = false;
+    document.file_valid = true;
+    document.indexed = indexed;
+    document.file_end = size;
+    document.live_bytes = header.live_bytes - header.history_size - header.palette_size - table_size;
+
+    munmap (map, size);
+
+    if (program.vectors.enabled)
+        flatten_vector_layer (program);
+    write_line ("Opened " + document.filename);
+}
@@ -0,0 +1,321 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cmath>
+
+#define PI 3.14159265358979
+#define PATTERN_SIZE 8
+#define SPANS_PER_JOB 64
+#define FILL_STYLE_COUNT 6
+
+using namespace std;
+
+// A run of pixels along one row of a fill, from left to right inclusive
+struct fill_span
+{
+    int y;
+    int left;
+    int right;
+};
+
+/**
+ * Get the name of a fill style, to show the user
+ *
+ * @param style     The fill style
+ *
+ * @returns         Name of the style
+ */
+string fill_style_name (fill_style style)
+{
+    switch (style)
+    {
+        case FILL_FLAT:     return "Flat";
+        case FILL_LINEAR:   return "Linear gradient";
+        case FILL_RADIAL:   return "Radial gradient";
+        case FILL_ANGULAR:  return "Angular gradient";
+        case FILL_CHECKER:  return "Checker pattern";
+        case FILL_STRIPES:  return "Stripe pattern";
+    }
+
+    return "";
+}
+
+/**
+ * Get the fill style after a given one, going back to flat after the last
+ *
+ * @param style     The fill style
+ *
+ * @returns         The next fill style
+ */
+fill_style next_fill_style (fill_style style)
+{
+    return (fill_style) ((style + 1) % FILL_STYLE_COUNT);
+}
+
+/**
+ * Find the contiguous area of one color around a point, as spans along each row. Colors
+ * are compared without alpha, the same as fill_area.
+ *
+ * @param pixels    The pixels to be searched
+ * @param x         x position to start from
+ * @param y         y position to start from
+ *
+ * @returns         The spans of the area
+ */
+vector<fill_span> flood_spans (const pixel_buffer &pixels, int x, int y)
+{
+    vector<fill_span> result;
+    vector<char> visited (pixels.pixels.size(), 0);
+    vector<point_2d> stack;
+
+    if (x < 0 || y < 0 || x >= pixels.width || y >= pixels.height)
+        return result;
+
+    unsigned int target = pixels.pixels[y * pixels.width + x] & 0xFFFFFF;
+    auto matches = [&](int i, int j) { return (pixels.pixels[j * pixels.width + i] & 0xFFFFFF) == target && not visited[j * pixels.width + i]; };
+
+    stack.push_back (point_2d { (double) x, (double) y });
+
+    while (stack.size() > 0)
+    {
+        int row = stack.back().y;
+        int left = stack.back().x, right = left;
+        stack.pop_back();
+
+        if (not matches (left, row))
+            continue;
+
+        while (left > 0 && matches (left - 1, row))
+            left--;
+        // A run with one visited pixel was visited whole, so only colors are compared to the right
+        right += kernels().match_length (pixels.pixels.data() + row * pixels.width + right + 1, pixels.width - right - 1, target);
+
+        fill (visited.begin() + row * pixels.width + left, visited.begin() + row * pixels.width + right + 1, 1);
+        result.push_back (fill_span { row, left, right });
+
+        // Queue one point for each run of the target color in the rows above and below
+        for (int next_row = row - 1; next_row <= row + 1; next_row += 2)
+        {
+            if (next_row < 0 || next_row >= pixels.height)
+                continue;
+
+            for (int i = left; i <= right; i++)
+                if (matches (i, next_row) && (i == left || not matches (i - 1, next_row)))
+                    stack.push_back (point_2d { (double) i, (double) next_row });
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Find the bounds of the contiguous area of one color around a point
+ *
+ * @param pixels    The pixels to be searched
+ * @param x         x position to start from
+ * @param y         y position to start from
+ *
+ * @returns         Bounds of the area, with no size if the point is outside the pixels
+ */
+rectangle flood_bounds (const pixel_buffer &pixels, int x, int y)
+{
+    vector<fill_span> spans = flood_spans (pixels, x, y);
+    int left = pixels.width, top = pixels.height, right = -1, bottom = -1;
+
+    for (const fill_span &span : spans)
+    {
+        left = min (left, span.left);
+        right = max (right, span.right);
+        top = min (top, span.y);
+        bottom = max (bottom, span.y);
+    }
+
+    if (right < 0)
+        return rectangle_from (0, 0, 0, 0);
+
+    return rectangle_from (left, top, right - left + 1, bottom - top + 1);
+}
+
+/**
+ * Set a row of pixels to a linear gradient. Pixels before the start or past the end of the
+ * gradient are filled with its end colors, and the rest are looked up in the ramp by the
+ * ramp_row kernel, so positions never get too big for its fixed point.
+ *
+ * @param row       The pixels to be set
+ * @param count     Number of pixels in the row
+ * @param ramp      The 256 colors of the gradient
+ * @param t         Position along the gradient of the first pixel, from 0 to 255 inside it
+ * @param step      Change in position from one pixel to the next
+ */
+void linear_gradient_row (unsigned int *row, int count, const unsigned int *ramp, double t, double step)
+{
+    // Pixels before the part of the row inside the gradient, and up to the end of that part
+    double before = 0, inside = count;
+
+    if (step > 0)
+    {
+        before = t >= 0 ? 0 : ceil (-t / step);
+        inside = t >= 256 ? 0 : ceil ((256 - t) / step);
+    }
+    else if (step < 0)
+    {
+        before = t < 256 ? 0 : floor ((t - 256) / -step) + 1;
+        inside = t < 0 ? 0 : floor (t / -step) + 1;
+    }
+    else if (t < 0 || t >= 256)
+        inside = 0;
+
+    int start = min (before, (double) count), end = max (min (inside, (double) count), (double) start);
+
+    kernels().fill_row (row, start, ramp[step < 0 ? 255 : 0]);
+    kernels().ramp_row (row + start, end - start, ramp, llround ((t + start * step) * 65536), llround (step * 65536));
+    kernels().fill_row (row + end, count - end, ramp[step < 0 || (step == 0 && t < 0) ? 0 : 255]);
+}
+
+/**
+ * Fill an area with a gradient or pattern. A gradient goes from the draw color to the second
+ * color along the line between its start and end points. Each span works out the position
+ * along the gradient at its first pixel and steps it along, then takes the color from a
+ * table of 256 steps, so nothing is blended per pixel.
+ *
+ * @param pixels    Pixels of the area of the image the fill covers
+ * @param left      x position of the pixels on the image
+ * @param top       y position of the pixels on the image
+ * @param command   The fill. Points are the clicked point and the gradient start and end.
+ *                  Values are the style, the packed second color, the area, and whether the
+ *                  whole area is filled rather than the area of one color around the point.
+ */
+void styled_fill (pixel_buffer &pixels, int left, int top, const tool_command &command)
+{
+    const vector<double> &v = command.values;
+    const vector<point_2d> &p = command.points;
+    fill_style style = (fill_style) v[0];
+    unsigned int first = pack_color (command.draw_color), second = (unsigned int) v[1];
+    double ax = p[1].x, ay = p[1].y, dx = p[2].x - ax, dy = p[2].y - ay;
+    double length = max (sqrt (dx * dx + dy * dy), 1.0);
+    double base_angle = atan2 (dy, dx);
+    unsigned int ramp[256];
+    vector<fill_span> spans;
+
+    if (v[6] != 0)
+        for (int j = 0; j < pixels.height; j++)
+            spans.push_back (fill_span { j, 0, pixels.width - 1 });
+    else
+        spans = flood_spans (pixels, floor (p[0].x) - left, floor (p[0].y) - top);
+
+    for (int i = 0; i < 256; i++)
+    {
+        ramp[i] = 0;
+        for (int shift = 0; shift < 32; shift += 8)
+        {
+            int a = (first >> shift) & 0xFF, b = (second >> shift) & 0xFF;
+            ramp[i] |= (unsigned int) (a + (b - a) * i / 255) << shift;
+        }
+    }
+
+    parallel_for ((spans.size() + SPANS_PER_JOB - 1) / SPANS_PER_JOB, [&](int block)
+    {
+        for (size_t s = block * SPANS_PER_JOB; s < min (spans.size(), (size_t) (block + 1) * SPANS_PER_JOB); s++)
+        {
+            const fill_span &span = spans[s];
+            unsigned int *row = &pixels.pixels[(size_t) span.y * pixels.width];
+            int count = span.right - span.left + 1;
+            double x = left + span.left + 0.5 - ax, y = top + span.y + 0.5 - ay;
+
+            switch (style)
+            {
+                case FILL_FLAT:
+                    kernels().fill_row (row + span.left, count, first);
+                    break;
+                case FILL_LINEAR:
+                    // Position along the gradient only changes by a fixed step across a row
+                    linear_gradient_row (row + span.left, count, ramp, (x * dx + y * dy) / (length * length) * 255, dx / (length * length) * 255);
+                    break;
+                case FILL_RADIAL:
+                    for (int i = 0; i < count; i++)
+                        row[span.left + i] = ramp[(int) min (sqrt ((x + i) * (x + i) + y * y) / length * 255, 255.0)];
+                    break;
+                case FILL_ANGULAR:
+                    for (int i = 0; i < count; i++)
+                    {
+                        double turn = (atan2 (y, x + i) - base_angle) / (2 * PI);
+                        row[span.left + i] = ramp[(int) ((turn - floor (turn)) * 255)];
+                    }
+                    break;
+                case FILL_CHECKER:
+                case FILL_STRIPES:
+                {
+                    int image_x = left + span.left, image_y = top + span.y;
+
+                    for (int i = 0; i < count; i++)
+                    {
+                        int cell = style == FILL_CHECKER ? (image_x + i) / PATTERN_SIZE + image_y / PATTERN_SIZE : (image_x + i + image_y) / PATTERN_SIZE;
+                        row[span.left + i] = cell % 2 == 0 ? first : second;
+                    }
+                    break;
+                }
+            }
+        }
+    });
+}
+
+/**
+ * Fill the area of one color under the mouse, or a selected area, with the current fill
+ * style. Dragging sets the direction and length of a gradient. A click without dragging runs
+ * the gradient across the area, or out from its centre.
+ *
+ * @param program   Struct containing program data
+ * @param selection The selected area to fill, or a rectangle with no size to fill the area
+ *                  of one color under the mouse
+ */
+void styled_fill_tool (program_data &program, rectangle selection)
+{
+    tool_command command = new_command (program);
+    point_2d start = mouse_position(), end = start;
+    point_2d seed = point_2d { floor (min (max (start.x, 0.0), IMAGE_WIDTH - 1.0)), floor (min (max (start.y, 0.0), HEIGHT - 1.0)) };
+    rectangle area = selection;
+    bool whole_area = selection.width > 0 && selection.height > 0;
+
+    while (not whole_area && mouse_down (LEFT_BUTTON))
+    {
+        process_events();
+
+        end = mouse_position();
+        queue_bitmap (program.the_window, program.to_draw, 0, 0);
+        queue_line (program.the_window, COLOR_GRAY, start.x, start.y, end.x, end.y);
+        flush_render (program.the_window);
+    }
+
+    // Work on the in-memory copy of the image, so only tiles drawn on since are read back
+    const pixel_buffer &image = canvas_pixels (program);
+
+    if (not whole_area)
+    {
+        area = flood_bounds (image, seed.x, seed.y);
+        if (area.width == 0)
+            return;
+    }
+
+    // Without a drag, linear gradients cross the area and the others start from its centre
+    if (start.x == end.x && start.y == end.y)
+    {
+        bool linear = program.style == FILL_LINEAR;
+        start = point_2d { linear ? area.x : area.x + area.width / 2, area.y + area.height / 2 };
+        end = point_2d { area.x + area.width, area.y + area.height / 2 };
+    }
+
+    command.mode = STYLED_FILL;
+    command.points = { seed, start, end };
+    command.values = { (double) program.style, (double) pack_color (program.second_color), area.x, area.y, area.width, area.height, (double) whole_area };
+
+    // The indexed canvas fills its indices when the command is recorded
+    if (not program.indexed.enabled)
+    {
+        pixel_buffer pixels = copy_pixels (image, area.x, area.y, area.width, area.height);
+        styled_fill (pixels, area.x, area.y, command);
+        write_pixels (program.to_draw, pixels, area.x, area.y);
+    }
+
+    record_command (program, command);
+    queue_bitmap (program.the_window, program.to_draw, 0, 0);
+    flush_render (program.the_window);
+}
@@ -0,0 +1,462 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cmath>
+
+#define FILTER_TILE 64
+#define FILTER_COUNT 7
+// Largest side of the reduced copy that is filtered while the settings are being dragged
+#define PREVIEW_SIZE 200
+#define MAX_BLUR_SIGMA 20
+#define MAX_BOX_RADIUS 30
+
+using namespace std;
+
+/**
+ * Get the name of a filter, to show while it is being adjusted
+ *
+ * @param type      The filter
+ *
+ * @returns         The name of the filter
+ */
+string filter_name (filter_type type)
+{
+    switch (type)
+    {
+        case FILTER_GAUSSIAN_BLUR:      return "Gaussian blur";
+        case FILTER_BOX_BLUR:           return "Box blur";
+        case FILTER_SHARPEN:            return "Sharpen";
+        case FILTER_BRIGHTNESS_CONTRAST: return "Brightness / contrast";
+        case FILTER_HUE_SATURATION:     return "Hue / saturation";
+        case FILTER_INVERT:             return "Invert";
+        case FILTER_THRESHOLD:          return "Threshold";
+    }
+
+    return "";
+}
+
+/**
+ * One pass of a box blur along rows or columns, split into tiles across threads. Each
+ * output pixel is the average of the 2 * radius + 1 pixels around it along the pass, kept
+ * as a running sum so the cost doesn't depend on the radius. Pixels past the edge of the
+ * buffer repeat the edge pixel.
+ *
+ * @param source    The pixels to be blurred
+ * @param dest      Where the blurred pixels go, the same size as source
+ * @param radius    Number of pixels either side of each pixel to average
+ * @param vertical  True to blur along columns, false to blur along rows
+ */
+void box_blur_pass (const pixel_buffer &source, pixel_buffer &dest, int radius, bool vertical)
+{
+    int length = vertical ? source.height : source.width;
+    int step = vertical ? source.width : 1;
+    int count = 2 * radius + 1;
+
+    parallel_tiles (source.width, source.height, FILTER_TILE, [&](int tile_x, int tile_y, int tile_width, int tile_height)
+    {
+        int lines = vertical ? tile_width : tile_height;
+        int start = vertical ? tile_y : tile_x;
+        int end = start + (vertical ? tile_height : tile_width);
+
+        for (int l = 0; l < lines; l++)
+        {
+            size_t line = vertical ? tile_x + l : (size_t) (tile_y + l) * source.width;
+            const unsigned int *in = &source.pixels[line];
+            unsigned int *out = &dest.pixels[line];
+            unsigned int sums[4] = { 0, 0, 0, 0 };
+
+            for (int i = start - radius; i <= start + radius; i++)
+            {
+                unsigned int pixel = in[(size_t) min (max (i, 0), length - 1) * step];
+                sums[0] += pixel >> 24;
+                sums[1] += (pixel >> 16) & 0xFF;
+                sums[2] += (pixel >> 8) & 0xFF;
+                sums[3] += pixel & 0xFF;
+            }
+
+            for (int i = start; i < end; i++)
+            {
+                out[(size_t) i * step] = ((sums[0] / count) << 24) | ((sums[1] / count) << 16) | ((sums[2] / count) << 8) | (sums[3] / count);
+
+                unsigned int added = in[(size_t) min (i + radius + 1, length - 1) * step];
+                unsigned int removed = in[(size_t) max (i - radius, 0) * step];
+                sums[0] += (added >> 24) - (removed >> 24);
+                sums[1] += ((added >> 16) & 0xFF) - ((removed >> 16) & 0xFF);
+                sums[2] += ((added >> 8) & 0xFF) - ((removed >> 8) & 0xFF);
+                sums[3] += (added & 0xFF) - (removed & 0xFF);
+            }
+        }
+    });
+}
+
+/**
+ * Box blur a buffer in place, as a pass along rows then a pass along columns
+ *
+ * @param pixels    The pixels to be blurred
+ * @param radius    Number of pixels either side of each pixel to average
+ */
+void box_blur (pixel_buffer &pixels, int radius)
+{
+    if (radius < 1)
+        return;
+
+    pixel_buffer temp = new_pixel_buffer (pixels.width, pixels.height);
+
+    box_blur_pass (pixels, temp, radius, false);
+    box_blur_pass (temp, pixels, radius, true);
+}
+
+/**
+ * Gaussian blur a buffer in place. This is approximated by three box blurs with sizes
+ * chosen to give the same spread, which is within a few percent of a true Gaussian and
+ * costs the same for any sigma.
+ *
+ * @param pixels    The pixels to be blurred
+ * @param sigma     Standard deviation of the blur, in pixels
+ */
+void gaussian_blur (pixel_buffer &pixels, double sigma)
+{
+    if (sigma < 0.5)
+        return;
+
+    int lower = sqrt (12 * sigma * sigma / 3 + 1);
+    if (lower % 2 == 0)
+        lower--;
+
+    // The first boxes_lower passes use the lower size, the rest the next odd size up
+    int boxes_lower = round ((12 * sigma * sigma - 3.0 * lower * lower - 12.0 * lower - 9) / (-4.0 * lower - 4));
+
+    for (int i = 0; i < 3; i++)
+        box_blur (pixels, ((i < boxes_lower ? lower : lower + 2) - 1) / 2);
+}
+
+/**
+ * Apply a function to every pixel of a buffer, split into tiles across threads
+ *
+ * @param pixels    The pixels to be changed
+ * @param change    Function giving the new value of a pixel from its old value
+ */
+void map_pixels (pixel_buffer &pixels, function<unsigned int (unsigned int)> change)
+{
+    parallel_tiles (pixels.width, pixels.height, FILTER_TILE, [&](int tile_x, int tile_y, int tile_width, int tile_height)
+    {
+        for (int j = tile_y; j < tile_y + tile_height; j++)
+        {
+            unsigned int *row = &pixels.pixels[(size_t) j * pixels.width];
+
+            for (int i = tile_x; i < tile_x + tile_width; i++)
+                row[i] = change (row[i]);
+        }
+    });
+}
+
+/**
+ * Apply a lookup table to the red, green and blue of every pixel, leaving alpha alone
+ *
+ * @param pixels    The pixels to be changed
+ * @param table     New value for each of the 256 channel values
+ */
+void map_channels (pixel_buffer &pixels, const unsigned char *table)
+{
+    map_pixels (pixels, [table](unsigned int pixel)
+    {
+        return (pixel & 0xFF000000) | (table[(pixel >> 16) & 0xFF] << 16) | (table[(pixel >> 8) & 0xFF] << 8) | table[pixel & 0xFF];
+    });
+}
+
+/**
+ * Rotate the hue and scale the saturation of a pixel
+ *
+ * @param pixel         The pixel to be changed
+ * @param hue_shift     Degrees to rotate the hue by
+ * @param saturation    Amount to multiply the saturation by
+ *
+ * @returns             The changed pixel
+ */
+unsigned int shift_hue_saturation (unsigned int pixel, double hue_shift, double saturation)
+{
+    double r = ((pixel >> 16) & 0xFF) / 255.0;
+    double g = ((pixel >> 8) & 0xFF) / 255.0;
+    double b = (pixel & 0xFF) / 255.0;
+    double high = max (r, max (g, b));
+    double low = min (r, min (g, b));
+    double delta = high - low;
+    double hue = 0;
+
+    if (delta > 0)
+    {
+        if (high == r)
+            hue = fmod ((g - b) / delta + 6, 6);
+        else if (high == g)
+            hue = (b - r) / delta + 2;
+        else
+            hue = (r - g) / delta + 4;
+    }
+
+    double sat = high > 0 ? min (delta / high * saturation, 1.0) : 0;
+    hue = fmod (hue + hue_shift / 60 + 12, 6);
+
+    // Back to RGB from hue, saturation and the unchanged value
+    double chroma = high * sat;
+    double x = chroma * (1 - fabs (fmod (hue, 2) - 1));
+    double m = high - chroma;
+    double rgb[3];
+
+    switch ((int) hue)
+    {
+        case 0:  rgb[0] = chroma; rgb[1] = x; rgb[2] = 0; break;
+        case 1:  rgb[0] = x; rgb[1] = chroma; rgb[2] = 0; break;
+        case 2:  rgb[0] = 0; rgb[1] = chroma; rgb[2] = x; break;
+        case 3:  rgb[0] = 0; rgb[1] = x; rgb[2] = chroma; break;
+        case 4:  rgb[0] = x; rgb[1] = 0; rgb[2] = chroma; break;
+        default: rgb[0] = chroma; rgb[1] = 0; rgb[2] = x;
+    }
+
+    return (pixel & 0xFF000000) | ((unsigned int) ((rgb[0] + m) * 255 + 0.5) << 16)
+           | ((unsigned int) ((rgb[1] + m) * 255 + 0.5) << 8) | (unsigned int) ((rgb[2] + m) * 255 + 0.5);
+}
+
+/**
+ * Run a filter over a buffer of pixels. The two settings go from 0 to 1, and what they
+ * control depends on the filter. Sizes are multiplied by scale, so a reduced copy of an
+ * image can be filtered to preview the result.
+ *
+ * @param pixels    The pixels to be filtered
+ * @param type      The filter to run
+ * @param first     First setting: blur size, sharpen amount, brightness, hue or threshold level
+ * @param second    Second setting: sharpen size, contrast or saturation
+ * @param scale     Size of the buffer relative to the image it stands for
+ */
+void apply_filter (pixel_buffer &pixels, filter_type type, double first, double second, double scale)
+{
+    unsigned char table[256];
+
+    switch (type)
+    {
+        case FILTER_GAUSSIAN_BLUR:
+            gaussian_blur (pixels, first * MAX_BLUR_SIGMA * scale);
+            break;
+
+        case FILTER_BOX_BLUR:
+            box_blur (pixels, round (first * MAX_BOX_RADIUS * scale));
+            break;
+
+        case FILTER_SHARPEN:
+        {
+            // Unsharp mask, pushing each pixel away from a blurred copy of itself
+            pixel_buffer blurred = pixels;
+            double amount = first * 3;
+
+            gaussian_blur (blurred, (1 + second * 4) * scale);
+
+            parallel_tiles (pixels.width, pixels.height, FILTER_TILE, [&](int tile_x, int tile_y, int tile_width, int tile_height)
+            {
+                for (int j = tile_y; j < tile_y + tile_height; j++)
+                {
+                    for (int i = tile_x; i < tile_x + tile_width; i++)
+                    {
+                        size_t index = (size_t) j * pixels.width + i;
+                        unsigned int pixel = pixels.pixels[index];
+                        unsigned int blur = blurred.pixels[index];
+                        unsigned int result = pixel & 0xFF000000;
+
+                        for (int shift = 0; shift < 24; shift += 8)
+                        {
+                            int value = (pixel >> shift) & 0xFF;
+                            int sharpened = value + amount * (value - (int) ((blur >> shift) & 0xFF));
+                            result |= min (max (sharpened, 0), 255) << shift;
+                        }
+
+                        pixels.pixels[index] = result;
+                    }
+                }
+            });
+            break;
+        }
+
+        case FILTER_BRIGHTNESS_CONTRAST:
+        {
+            double brightness = (first * 2 - 1) * 128;
+            double contrast = pow (4, 1 - second * 2);
+
+            for (int i = 0; i < 256; i++)
+                table[i] = min (max ((i - 128) * contrast + 128 + brightness, 0.0), 255.0);
+            map_channels (pixels, table);
+            break;
+        }
+
+        case FILTER_HUE_SATURATION:
+        {
+            double hue_shift = (first * 2 - 1) * 180;
+            double saturation = (1 - second) * 2;
+
+            map_pixels (pixels, [hue_shift, saturation](unsigned int pixel) { return shift_hue_saturation (pixel, hue_shift, saturation); });
+            break;
+        }
+
+        case FILTER_INVERT:
+            for (int i = 0; i < 256; i++)
+                table[i] = 255 - i;
+            map_channels (pixels, table);
+            break;
+
+        case FILTER_THRESHOLD:
+        {
+            unsigned int level = first * 255;
+
+            map_pixels (pixels, [level](unsigned int pixel)
+            {
+                unsigned int luma = (((pixel >> 16) & 0xFF) * 77 + ((pixel >> 8) & 0xFF) * 150 + (pixel & 0xFF) * 29) >> 8;
+                return (pixel & 0xFF000000) | (luma >= level ? 0xFFFFFF : 0);
+            });
+            break;
+        }
+    }
+}
+
+/**
+ * Make a reduced copy of a buffer, averaging each square of pixels
+ *
+ * @param source    The pixels to be reduced
+ * @param factor    Width and height of the square of pixels each reduced pixel stands for
+ *
+ * @returns         The reduced pixels
+ */
+pixel_buffer shrink_pixels (const pixel_buffer &source, int factor)
+{
+    pixel_buffer result = new_pixel_buffer ((source.width + factor - 1) / factor, (source.height + factor - 1) / factor);
+
+    parallel_tiles (result.width, result.height, FILTER_TILE, [&](int tile_x, int tile_y, int tile_width, int tile_height)
+    {
+        for (int j = tile_y; j < tile_y + tile_height; j++)
+        {
+            for (int i = tile_x; i < tile_x + tile_width; i++)
+            {
+                unsigned int sums[4] = { 0, 0, 0, 0 };
+                int count = 0;
+
+                for (int y = j * factor; y < min ((j + 1) * factor, source.height); y++)
+                {
+                    for (int x = i * factor; x < min ((i + 1) * factor, source.width); x++)
+                    {
+                        unsigned int pixel = source.pixels[(size_t) y * source.width + x];
+                        sums[0] += pixel >> 24;
+                        sums[1] += (pixel >> 16) & 0xFF;
+                        sums[2] += (pixel >> 8) & 0xFF;
+                        sums[3] += pixel & 0xFF;
+                        count++;
+                    }
+                }
+
+                result.pixels[(size_t) j * result.width + i] = ((sums[0] / count) << 24) | ((sums[1] / count) << 16) | ((sums[2] / count) << 8) | (sums[3] / count);
+            }
+        }
+    });
+
+    return result;
+}
+
+/**
+ * Draw a filtered copy of an area over the image on the window
+ *
+ * @param program   Struct containing program data
+ * @param area      The area being filtered
+ * @param preview   The filtered pixels, which may be a reduced copy of the area
+ * @param type      The filter being adjusted
+ */
+void draw_filter_preview (program_data &program, rectangle area, const pixel_buffer &preview, filter_type type)
+{
+    bitmap preview_bitmap = create_bitmap ("filter_preview", preview.width, preview.height);
+    double scale_x = area.width / preview.width;
+    double scale_y = area.height / preview.height;
+
+    write_pixels (preview_bitmap, preview, 0, 0);
+
+    // Scaling is about the centre of the bitmap, so line the centres up
+    queue_bitmap (program.the_window, program.to_draw, 0, 0);
+    queue_bitmap (program.the_window, preview_bitmap, area.x + (area.width - preview.width) / 2, area.y + (area.height - preview.height) / 2,
+                  option_scale_bmp (scale_x, scale_y));
+    queue_rectangle (program.the_window, COLOR_GRAY, area.x, area.y, area.width, area.height);
+    queue_text (program.the_window, filter_name (type) + " - drag to adjust, Tab for next filter, Enter to apply, Esc to cancel",
+                COLOR_BLACK, 5, HEIGHT - 15);
+    flush_render (program.the_window);
+
+    free_bitmap (preview_bitmap);
+}
+
+/**
+ * Main module for filtering an area of the user image. While the mouse is dragged a reduced
+ * copy of the area is filtered, with the mouse position setting the filter, and when it is
+ * released the full area is filtered. Nothing changes on the image until Enter is pressed.
+ *
+ * @param program   Struct containing program data
+ * @param area      The area of the user image to be filtered
+ */
+void filter_tool (program_data &program, rectangle area)
+{
+    area.x = max (floor (area.x), 0.0);
+    area.y = max (floor (area.y), 0.0);
+    area.width = min (ceil (area.width), IMAGE_WIDTH - area.x);
+    area.height = min (ceil (area.height), HEIGHT - area.y);
+
+    if (area.width < 1 || area.height < 1)
+        return;
+
+    pixel_buffer original = read_pixels (program.to_draw, area.x, area.y, area.width, area.height);
+    int factor = max ((int) ceil (max (area.width, area.height) / PREVIEW_SIZE), 1);
+    pixel_buffer reduced = shrink_pixels (original, factor);
+    filter_type type = FILTER_GAUSSIAN_BLUR;
+    double first = 0.5, second = 0.5;
+    pixel_buffer result = original;
+
+    apply_filter (result, type, first, second, 1);
+    draw_filter_preview (program, area, result, type);
+
+    while (not quit_requested())
+    {
+        process_events();
+
+        if (key_typed (ESCAPE_KEY))
+            break;
+
+        if (key_typed (RETURN_KEY))
+        {
+            tool_command command = new_command (program);
+
+            command.mode = FILTER;
+            command.values = { area.x, area.y, area.width, area.height, (double) type, first, second };
+            write_pixels (program.to_draw, result, area.x, area.y);
+            record_command (program, command);
+            break;
+        }
+
+        if (key_typed (TAB_KEY))
+        {
+            type = (filter_type) ((type + 1) % FILTER_COUNT);
+            result = original;
+            apply_filter (result, type, first, second, 1);
+            draw_filter_preview (program, area, result, type);
+        }
+
+        if (mouse_down (LEFT_BUTTON))
+        {
+            while (mouse_down (LEFT_BUTTON))
+            {
+                process_events();
+
+                first = min (max (mouse_x() / (double) IMAGE_WIDTH, 0.0), 1.0);
+                second = min (max (mouse_y() / (double) HEIGHT, 0.0), 1.0);
+
+                pixel_buffer preview = reduced;
+                apply_filter (preview, type, first, second, 1.0 / factor);
+                draw_filter_preview (program, area, preview, type);
+            }
+
+            result = original;
+            apply_filter (result, type, first, second, 1);
+            draw_filter_preview (program, area, result, type);
+        }
+    }
+
+    queue_bitmap (program.the_window, program.to_draw, 0, 0);
+    flush_render (program.the_window);
+}
@@ -1,4 +1,17 @@
 #include "graphic_creator.h"
+#include <algorithm>
+
+// How close a color has to be to the clicked one for the fill tool to replace it everywhere
+#define DEFAULT_TOLERANCE 32
+#define TOLERANCE_STEP 8
+// How many times bigger than the image the vector layer is exported
+#define VECTOR_EXPORT_SCALE 4
+// Diameter of the smudge, blur and clone brushes, in pixels
+#define DEFAULT_BRUSH_SIZE 40
+#define BRUSH_SIZE_STEP 8
+#define MAX_BRUSH_SIZE 200
+
+using namespace std;
 
 /**
  * Process the active drawing mode
@@ -9,17 +22,17 @@ void process_mode (program_data &program)
 {
     switch (program.mode)
     {
-        case DRAW_REC: paint_rec_ell (program, draw_rectangle_on_window, draw_rectangle_on_bitmap);
+        case DRAW_REC: paint_rec_ell (program, queue_rectangle, draw_rectangle_on_bitmap);
                        break;
-        case FILL_REC: paint_rec_ell (program, fill_rectangle_on_window, fill_rectangle_on_bitmap);
+        case FILL_REC: paint_rec_ell (program, queue_fill_rectangle, fill_rectangle_on_bitmap);
                        break;
-        case DRAW_ELL: paint_rec_ell (program, draw_ellipse_on_window, draw_ellipse_on_bitmap);
+        case DRAW_ELL: paint_rec_ell (program, queue_ellipse, draw_ellipse_on_bitmap);
                        break;
-        case FILL_ELL: paint_rec_ell (program, fill_ellipse_on_window, fill_ellipse_on_bitmap);
+        case FILL_ELL: paint_rec_ell (program, queue_fill_ellipse, fill_ellipse_on_bitmap);
                        break;
-        case DRAW_TRI: paint_tri (program, draw_triangle_on_window, draw_triangle_on_bitmap);
+        case DRAW_TRI: paint_tri (program, queue_triangle, draw_triangle_on_bitmap);
                        break;
-        case FILL_TRI: paint_tri (program, fill_triangle_on_window, fill_triangle_on_bitmap);
+        case FILL_TRI: paint_tri (program, queue_fill_triangle, fill_triangle_on_bitmap);
                        break;
         case SPRAY:    paint_spray (program);
                        break;
@@ -30,6 +43,18 @@ void process_mode (program_data &program)
         case SELECT:   select_tool (program);
                        break;
         case FILL:     fill_tool (program);
+                       break;
+        case SMUDGE:
+        case BLUR_BRUSH:
+        case CLONE:    sampling_brush_tool (program);
+                       break;
+        // Filters and palette edits only tag recorded commands, they are never the active mode.
+        // Vector edits and styled fills tag commands too, and their tools are started by their
+        // own key and by the fill tool.
+        case FILTER:
+        case PALETTE:
+        case VECTOR:
+        case STYLED_FILL: break;
         }
 }
 
@@ -40,100 +65,149 @@ void process_mode (program_data &program)
  */
 void draw_title_screen (window &the_window)
 {
-    draw_bitmap_on_window (the_window, bitmap_named ("title_screen"), 0, 0);
-    refresh_window (the_window);
+    queue_bitmap (the_window, bitmap_named ("title_screen"), 0, 0);
+    flush_render (the_window);
     delay (3000);
 }
 
 /**
- * Draw sidebar menu on the window
+ * Get one of the colors in the color selection boxes on the sidebar
  *
- * @param the_window    The window to be drawn to
- * @param active_color  The current active color selected by the user
+ * @param index     Number of the box, counting across each row from the top left
+ *
+ * @returns         The color of the box
  */
-void draw_sidebar (window &the_window, color &active_color)
+color sidebar_palette_color (int index)
 {
-    color colors_used[] = {COLOR_BLACK, COLOR_WHITE, COLOR_GRAY, COLOR_DARK_GRAY, COLOR_AQUA, COLOR_LIGHT_BLUE, COLOR_BLUE, COLOR_DARK_BLUE, COLOR_BROWN,
+    static const color colors_used[] = {COLOR_BLACK, COLOR_WHITE, COLOR_GRAY, COLOR_DARK_GRAY, COLOR_AQUA, COLOR_LIGHT_BLUE, COLOR_BLUE, COLOR_DARK_BLUE, COLOR_BROWN,
                          COLOR_GREEN, COLOR_BRIGHT_GREEN, COLOR_DARK_GREEN, COLOR_LIGHT_YELLOW, COLOR_YELLOW, COLOR_YELLOW_GREEN, COLOR_GOLD, COLOR_ORANGE, COLOR_ORANGE_RED, COLOR_PURPLE,
                          COLOR_LAVENDER, COLOR_PINK, COLOR_HOT_PINK, COLOR_RED, COLOR_CRIMSON}; 
-    
-    // The first color to be drawn on the gradient block
-    color draw_gradient = active_color;
-    double saturation = saturation_of (draw_gradient);
-    double hue = hue_of (draw_gradient);
-    double brightness = brightness_of (draw_gradient);
+
+    return colors_used[index];
+}
+
+/**
+ * Get the color of one column of the saturation gradient on the sidebar. The first column
+ * is the active color, and each one after it is 0.02 less saturated.
+ *
+ * @param active_color  The active color the gradient was drawn for
+ * @param column        The column of the gradient, from 0 to 49
+ *
+ * @returns             The color of the column
+ */
+color sidebar_gradient_color (color active_color, int column)
+{
+    if (column == 0)
+        return active_color;
+
+    return hsb_color (hue_of (active_color), saturation_of (active_color) - 0.02 * (column - 1), brightness_of (active_color));
+}
+
+/**
+ * Draw sidebar menu on the window
+ *
+ * @param program    Struct containing program data
+ */
+void draw_sidebar (program_data &program)
+{
+    window &the_window = program.the_window;
+    color &active_color = program.active_color;
 
     // The y position of the first pair of icons
     int y_pos = 26;
 
     // Draw tool icons
-    draw_text_on_window (the_window, "TOOLS", COLOR_BLACK, "Bold Font", 22, 805, 10);
+    queue_text (the_window, "TOOLS", COLOR_BLACK, "Bold Font", 22, 805, 10);
 
-    draw_bitmap_on_window (the_window, bitmap_named ("eraser_icon"), 801, y_pos);
-    draw_bitmap_on_window (the_window, bitmap_named ("save_icon"), 827, y_pos);
+    queue_bitmap (the_window, bitmap_named ("eraser_icon"), 801, y_pos);
+    queue_bitmap (the_window, bitmap_named ("save_icon"), 827, y_pos);
 
     y_pos += 25;
 
-    draw_bitmap_on_window (the_window, bitmap_named ("select_icon"), 801, y_pos);
-    draw_bitmap_on_window (the_window, bitmap_named ("fill_icon"), 827, y_pos);
+    queue_bitmap (the_window, bitmap_named ("select_icon"), 801, y_pos);
+    queue_bitmap (the_window, bitmap_named ("fill_icon"), 827, y_pos);
 
     y_pos += 25;
 
     // Draw color saturation block
-    draw_text_on_window (the_window, "COLOR", COLOR_BLACK, "Bold Font", 22, 805, 80);
-    draw_text_on_window (the_window, "SAT.", COLOR_BLACK, "Bold Font", 22, 810, 90);
+    queue_text (the_window, "COLOR", COLOR_BLACK, "Bold Font", 22, 805, 80);
+    queue_text (the_window, "SAT.", COLOR_BLACK, "Bold Font", 22, 810, 90);
 
     y_pos += 25;
 
     for (int j = 0; j < 50; j++)
-    {
-        draw_line_on_window (the_window, draw_gradient, 801 + j, y_pos, 801 + j, y_pos + 50);  
-        draw_gradient = hsb_color (hue, saturation, brightness);        
-        saturation -= 0.02;
-    }
+        queue_line (the_window, sidebar_gradient_color (active_color, j), 801 + j, y_pos, 801 + j, y_pos + 50);  
 
     y_pos += 25 * 2;
 
     // Draw color selection boxes
     for (int j = 0; j < 24; j += 2)
     {
-        fill_rectangle_on_window (the_window, colors_used[j], 801, y_pos, 24, 24);                
-        fill_rectangle_on_window (the_window, colors_used[j+1], 826, y_pos, 24, 24);
+        queue_fill_rectangle (the_window, unpack_color (program.indexed.palette[j]), 801, y_pos, 24, 24);                
+        queue_fill_rectangle (the_window, unpack_color (program.indexed.palette[j+1]), 826, y_pos, 24, 24);
         y_pos += 25;
     }            
 
-    // Draw active color block
-    fill_rectangle_on_window (the_window, active_color, 801, y_pos, 51, 600 - y_pos);
+    // Draw active color block, with the second color used by gradients and patterns in its corner
+    queue_fill_rectangle (the_window, active_color, 801, y_pos, 51, 600 - y_pos);
+    queue_fill_rectangle (the_window, program.second_color, 826, 575, 25, 25);
+    queue_rectangle (the_window, COLOR_BLACK, 825, 574, 26, 26);
 
     // Draw sidebar outline
-    draw_line_on_window (the_window, COLOR_BLACK, 800, 0, 800, 600);
-    draw_line_on_window (the_window, COLOR_BLACK, 825, 25, 825, 75);
-    draw_line_on_window (the_window, COLOR_BLACK, 825, 150, 825, y_pos - 1);
-    draw_line_on_window (the_window, COLOR_BLACK, 850, 0, 850, 600);
+    queue_line (the_window, COLOR_BLACK, 800, 0, 800, 600);
+    queue_line (the_window, COLOR_BLACK, 825, 25, 825, 75);
+    queue_line (the_window, COLOR_BLACK, 825, 150, 825, y_pos - 1);
+    queue_line (the_window, COLOR_BLACK, 850, 0, 850, 600);
 
     for (int i = 0; i < 19; i++)
     {
         if (i != 5)
-            draw_line_on_window (the_window, COLOR_BLACK, 800, i*25, 850, i*25);
+            queue_line (the_window, COLOR_BLACK, 800, i*25, 850, i*25);
     }
 }
 
 /**
  * Create the set of data for use by the program
  *
+ * @param headless  True to leave out the window, so checks can run without showing one
+ *
  * @returns     The initialised program_data struct
  */
-program_data new_program_data()
+program_data new_program_data (bool headless)
 {
     program_data result;
 
     result.active_color = COLOR_BLACK;
-    result.the_window = open_window ("Image Editor", WINDOW_WIDTH, HEIGHT);
+    result.second_color = COLOR_WHITE;
+    result.style = FILL_FLAT;
+    result.tolerance = DEFAULT_TOLERANCE;
+    result.brush.size = DEFAULT_BRUSH_SIZE;
+    result.brush.has_source = false;
+    result.brush.has_offset = false;
+    result.import = nullptr;
+    result.share = nullptr;
+    result.the_window = headless ? nullptr : open_window ("Image Editor", WINDOW_WIDTH, HEIGHT);
     result.to_draw = create_bitmap ("to_draw", IMAGE_WIDTH, HEIGHT);
 
     clear_bitmap (result.to_draw, COLOR_WHITE);
-    clear_window (result.the_window, COLOR_WHITE);
-    draw_sidebar (result.the_window, result.active_color);
+    init_document (result.document);
+    init_canvas_cache (result.canvas);
+    init_indexed_canvas (result.indexed);
+    init_vector_layer (result.vectors);
+    init_input (result);
+    init_frames (result);
+    init_history_browser (result);
+    open_journal (result);
+
+    // Start a fresh history unless one was recovered from the journal
+    if (result.history.checkpoints.size() == 0)
+        init_history (result);
+
+    if (not headless)
+    {
+        queue_clear (result.the_window, COLOR_WHITE);
+        draw_sidebar (result);
+    }
 
     return result;
 }
@@ -145,7 +219,14 @@ program_data new_program_data()
  */
 void process_input (program_data &program)
 {
-    if (mouse_x() > 799)
+    // The image can't be drawn on while a file is still being opened into it
+    if (program.import != nullptr)
+    {
+        if (key_typed (ESCAPE_KEY))
+            cancel_import (program);
+    }
+
+    else if (mouse_x() > 799)
         process_sidebar (program);
 
     else if (mouse_clicked (RIGHT_BUTTON))
@@ -157,75 +238,84 @@ void process_input (program_data &program)
     else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (Y_KEY)))
         redo_changes (program);
 
-    else if (mouse_down (LEFT_BUTTON))
-        process_mode (program);
-}
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (H_KEY)))
+        history_panel (program);
 
-/**
- * Undo the last action done by user
- *
- * @param program    Struct containing program data
- */
-void undo_changes (program_data &program)
-{
-    if (program.undo.size() > 0)
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (S_KEY)))
+        save_document (program);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (O_KEY)))
+        open_document (program);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (I_KEY)))
+        start_import (program, "");
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (M_KEY)))
+        set_indexed_mode (program, not program.indexed.enabled);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (L_KEY)))
+        set_vector_mode (program, not program.vectors.enabled);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (E_KEY)) && program.vectors.enabled)
+        export_vector_layer (program, VECTOR_EXPORT_SCALE);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && mouse_down (LEFT_BUTTON) && program.vectors.enabled)
+        vector_tool (program);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (B_KEY)))
+        set_canvas_share (program, program.share == nullptr);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (D_KEY)))
+        toggle_render_debug (program.the_window);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (N_KEY)))
+        add_frame (program);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (BACKSPACE_KEY)))
+        delete_frame (program);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (K_KEY)))
+        toggle_onion_skin (program);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (P_KEY)))
+        play_animation (program);
+
+    else if (key_typed (PAGE_UP_KEY) || key_typed (PAGE_DOWN_KEY))
+        step_frame (program, key_typed (PAGE_DOWN_KEY) ? 1 : -1);
+
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (F_KEY)))
+        filter_tool (program, rectangle_from (0, 0, IMAGE_WIDTH, HEIGHT));
+
+    else if (program.mode == FILL && key_typed (TAB_KEY))
     {
-        bitmap temp = create_bitmap ("temp", 800, 600);
-        draw_bitmap_on_bitmap (temp, program.to_draw, 0, 0);
-        program.redo.push_back (temp);
+        program.style = next_fill_style (program.style);
+        write_line ("Fill style " + fill_style_name (program.style));
+    }
 
-        draw_bitmap_on_bitmap (program.to_draw, program.undo.back(), 0, 0); 
-        program.undo.erase (program.undo.end() - 1);
-    }    
-}
+    else if (program.mode == FILL && (key_typed (UP_KEY) || key_typed (DOWN_KEY)))
+    {
+        program.tolerance = min (max (program.tolerance + (key_typed (UP_KEY) ? TOLERANCE_STEP : -TOLERANCE_STEP), 0), 255);
+        write_line ("Replace color tolerance " + to_string (program.tolerance));
+    }
 
-/**
- * Redo last undone action by user
- *
- * @param program    Struct containing program data
- */
-void redo_changes (program_data &program)
-{
-    if (program.redo.size() > 0)
+    // Goes from smudge to blur brush to clone stamp, and back to smudge
+    else if ((key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && (key_typed (R_KEY)))
     {
-        add_to_undo (program);
-        draw_bitmap_on_bitmap (program.to_draw, program.redo.back(), 0, 0);
-        program.redo.erase (program.redo.end() - 1);
-    }    
-}
+        program.mode = program.mode == SMUDGE ? BLUR_BRUSH : program.mode == BLUR_BRUSH ? CLONE : SMUDGE;
+        write_line (brush_name (program.mode) + ", size " + to_string (program.brush.size));
+    }
 
-/**
- * Add current drawn image to the undo vector
- *
- * @param program    Struct containing program data
- */
-void add_to_undo (program_data &program)
-{
-    bitmap temp = create_bitmap ("temp", 800, 600);
-    draw_bitmap_on_bitmap (temp, program.to_draw, 0, 0);
-    program.undo.push_back (temp);
-    trim_undo (program.undo);
-}
+    else if ((program.mode == SMUDGE || program.mode == BLUR_BRUSH || program.mode == CLONE) && (key_typed (UP_KEY) || key_typed (DOWN_KEY)))
+    {
+        program.brush.size = min (max (program.brush.size + (key_typed (UP_KEY) ? BRUSH_SIZE_STEP : -BRUSH_SIZE_STEP), BRUSH_SIZE_STEP), MAX_BRUSH_SIZE);
+        write_line ("Brush size " + to_string (program.brush.size));
+    }
 
-/**
- * Trim undo vector to keep within length 10
- *
- * @param undo  The vector of images to be checked and trimmed
- */
-void trim_undo (vector<bitmap> &undo)
-{
-    if (undo.size() > 10)
-        undo.erase (undo.begin());
-}
+    else if ((key_down (LEFT_ALT_KEY) || key_down (RIGHT_ALT_KEY)) && mouse_down (LEFT_BUTTON))
+        pick_canvas_color (program);
 
-/**
- * Empty redo vector
- *
- * @param redo  The vector of images to be erased
- */
-void wipe_redo (vector<bitmap> &redo)
-{
-    redo.clear();
+    else if (mouse_down (LEFT_BUTTON))
+        process_mode (program);
 }
 
 /**
@@ -260,24 +350,42 @@ void save_image (bitmap image)
 }
 
 /**
- * Stores selected color in program data for use by user
+ * Stores selected color in program data for use by user. Shift clicking a color box sets
+ * it to the active color instead, and right clicking sets the second color.
  *
- * @param the_window    The window to be drawn to
- * @param active_color  The current active color selected by the user
+ * @param program    Struct containing program data
  */
-void get_color (window &the_window, color &active_color)
+void get_color (program_data &program)
 {
-    point_2d mouse_loc;
+    // The gradient and boxes are at fixed places on the sidebar, so the color under the
+    // mouse is worked out from where it is rather than read back from the window
+    int column = min (max ((int) mouse_x() - 801, 0), 49);
+    int row = ((int) mouse_y() - 151) / 25;
+    int box = min (row, 11) * 2 + (mouse_x() < 826 ? 0 : 1);
 
     if (mouse_clicked (LEFT_BUTTON))
     {
-        mouse_loc.x = mouse_x();
-        mouse_loc.y = mouse_y();
+        if (mouse_y() < 151)
+            program.active_color = sidebar_gradient_color (program.active_color, column);
+        else if (key_down (LEFT_SHIFT_KEY) || key_down (RIGHT_SHIFT_KEY))
+            edit_palette (program, box, program.active_color);
+        else
+            program.active_color = unpack_color (program.indexed.palette[box]);
+
+        draw_sidebar (program);
+        flush_render (program.the_window);  
+    }
 
-        active_color = get_pixel (mouse_loc);
+    // Right clicking sets the second color instead
+    else if (mouse_clicked (RIGHT_BUTTON))
+    {
+        if (mouse_y() < 151)
+            program.second_color = sidebar_gradient_color (program.active_color, column);
+        else
+            program.second_color = unpack_color (program.indexed.palette[box]);
 
-        draw_sidebar (the_window, active_color);
-        refresh_window (the_window);  
+        draw_sidebar (program);
+        flush_render (program.the_window);
     }
 }
 
@@ -292,8 +400,11 @@ void process_sidebar (program_data &program)
     {
         process_events();
 
-        if ((mouse_y() > 100 && mouse_y() < 475))
-            get_color (program.the_window, program.active_color);
+        if ((mouse_y() > 100 && mouse_y() < 451))
+            get_color (program);
+
+        else if (mouse_y() >= 451 && mouse_clicked (LEFT_BUTTON))
+            color_wheel_picker (program);
 
         else if (mouse_y() < 50 && mouse_clicked (LEFT_BUTTON))
         {
@@ -1,9 +1,14 @@
 #include "splashkit.h"
 #include <vector>
+#include <functional>
+#include <deque>
+#include <memory>
 
 #define WINDOW_WIDTH 851
 #define IMAGE_WIDTH 800
 #define HEIGHT 600
+// Distance from the mouse the spray tool scatters pixels
+#define SPRAY_RADIUS 20
 
 enum mode_option
 {
@@ -18,18 +23,233 @@ enum mode_option
     DRAW_TRI,
     FILL_TRI,
     SELECT,
-    FILL   
+    FILL,
+    FILTER,
+    PALETTE,
+    VECTOR,
+    STYLED_FILL,
+    SMUDGE,
+    BLUR_BRUSH,
+    CLONE
 };
 
+enum filter_type
+{
+    FILTER_GAUSSIAN_BLUR,
+    FILTER_BOX_BLUR,
+    FILTER_SHARPEN,
+    FILTER_BRIGHTNESS_CONTRAST,
+    FILTER_HUE_SATURATION,
+    FILTER_INVERT,
+    FILTER_THRESHOLD
+};
+
+enum fill_style
+{
+    FILL_FLAT,
+    FILL_LINEAR,
+    FILL_RADIAL,
+    FILL_ANGULAR,
+    FILL_CHECKER,
+    FILL_STRIPES
+};
+
+enum journal_record_type
+{
+    JOURNAL_CHECKPOINT = 1,
+    JOURNAL_POP,
+    JOURNAL_COMMAND
+};
+
+// A tool operation, recorded with everything needed to draw it again exactly
+struct tool_command
+{
+    mode_option mode;
+    color draw_color;
+    unsigned int seed;
+    vector<point_2d> points;
+    vector<double> values;
+};
+
+// A full copy of the image after a given number of commands. Older checkpoints are only
+// kept in the undo journal, and their graphic is freed.
+struct history_checkpoint
+{
+    size_t command_index;
+    bitmap graphic;
+    size_t journal_offset;
+
+    // Used instead of graphic while the indexed canvas is enabled
+    vector<unsigned char> indices;
+    vector<unsigned int> palette;
+};
+
+struct command_history
+{
+    vector<tool_command> commands;
+    vector<tool_command> redo;
+    vector<history_checkpoint> checkpoints;
+};
+
+// A checkpoint waiting to be read back a few rows at a time before being written to the journal
+struct journal_pending
+{
+    size_t command_index;
+    bitmap source;
+    int next_row;
+    vector<unsigned int> data;
+};
+
+struct journal_writer;
+
+// Append-only on-disk copy of the command history and its checkpoints, used to recover
+// the image and history after a crash
+struct undo_journal
+{
+    journal_writer *writer;
+    size_t end;
+    std::deque<journal_pending> pending;
+};
+
+// Where one tile of a layer is stored in a document file
+struct document_tile
+{
+    unsigned long long offset;
+    unsigned int size;
+    unsigned int hash;
+};
+
+// The native document file the image was last opened from or saved to. Tiles are only
+// read back and rewritten on save if they were drawn on since.
+struct document_data
+{
+    string filename;
+    bool file_valid;
+    unsigned long long file_end;
+    unsigned long long live_bytes;
+    vector<document_tile> image_tiles;
+    vector<document_tile> base_tiles;
+    vector<bool> dirty;
+    bool base_dirty;
+    bool indexed;
+};
+
+// Packed 0xAARRGGBB pixels held in memory, for work that can't go through SplashKit draw calls
+struct pixel_buffer
+{
+    int width;
+    int height;
+    vector<unsigned int> pixels;
+};
+
+// Pixel loops shared by the tools, with a version for each instruction set, defined in pixel_kernels.cpp
+struct pixel_kernels
+{
+    const char *name;
+    int (*replace_row) (unsigned int *row, int count, unsigned int target, unsigned int replacement, int tolerance);
+    int (*match_length) (const unsigned int *row, int count, unsigned int target);
+    void (*fill_row) (unsigned int *row, int count, unsigned int value);
+    void (*blend_row) (unsigned int *dest, const unsigned int *source, const unsigned int *weights, int count);
+    void (*pack_row) (const color *colors, unsigned int *pixels, int count);
+    void (*ramp_row) (unsigned int *row, int count, const unsigned int *ramp, int position, int step);
+    void (*copy_area) (unsigned int *dest, int dest_stride, const unsigned int *source, int source_stride, int width, int height);
+};
+
+// Copy of the user image held in memory in square tiles, so pixels can be looked at without
+// reading them back from the image. Tiles drawn on since they were copied are stale, and
+// tiles drawn on since the shared canvas was last published are unpublished.
+struct canvas_cache
+{
+    pixel_buffer pixels;
+    vector<bool> stale;
+    vector<bool> unpublished;
+};
+
+// 8 bit copy of the user image where each pixel is an index into an editable palette. While
+// it is enabled the indices are the real image, and the user image bitmap is only drawn from them.
+struct indexed_canvas
+{
+    bool enabled;
+    vector<unsigned char> pixels;
+    vector<unsigned int> palette;
+    // Shapes are drawn here by SplashKit and read back, so their indices match the tools
+    bitmap scratch;
+};
+
+// Shapes and strokes drawn since the vector layer was turned on, kept as the commands that
+// drew them so they can be picked and moved, over a copy of the image from when it started.
+// Each cell of the grid lists the shapes whose bounds overlap it.
+struct vector_layer
+{
+    bool enabled;
+    bitmap base;
+    size_t first_command;
+    vector<tool_command> shapes;
+    vector<bool> deleted;
+    vector<vector<int>> grid;
+};
+
+// Size of the smudge, blur and clone brushes, and where the clone brush copies from. The
+// source stays the same distance from the brush for every stroke until it is chosen again.
+struct sampling_brush
+{
+    int size;
+    bool has_source;
+    point_2d source;
+    bool has_offset;
+    int offset_x;
+    int offset_y;
+};
+
+// Mouse state from one poll for events, with the time in milliseconds it was taken
+struct input_sample
+{
+    point_2d position;
+    bool left_down;
+    unsigned int time;
+};
+
+// When the active tool last sampled input and refreshed the window, defined in input.cpp
+struct input_timing;
+
+// Frames of an animation, stored as tiles shared between frames, defined in animation.cpp
+struct frame_store;
+
+// Thumbnails of points in the history for the history panel, defined in history_panel.cpp
+struct history_browser;
+
+// The user image published to shared memory for other programs, defined in canvas_share.cpp
+struct canvas_share;
+
+// A PNG or BMP file being opened in the background, defined in image_import.cpp
+struct image_import;
+
+// Work submitted to the shared job pool, defined in job_pool.cpp
+struct job;
+typedef std::shared_ptr<job> job_handle;
+
 struct program_data
 {
     window the_window;
     bitmap to_draw;
-    vector<bitmap> undo;
-    vector<bitmap> redo;
+    command_history history;
+    undo_journal journal;
+    document_data document;
+    canvas_cache canvas;
+    indexed_canvas indexed;
+    vector_layer vectors;
+    image_import *import;
+    input_timing *input;
+    frame_store *frames;
+    history_browser *browser;
+    canvas_share *share;
     mode_option mode;
     mode_option select[2];
     color active_color;
+    color second_color;
+    fill_style style;
+    int tolerance;
+    sampling_brush brush;
 };
 
 struct menu_item
@@ -45,6 +265,9 @@ struct select_tool_data
     bitmap graphic;
     double x;
     double y;
+    double scale_x;
+    double scale_y;
+    double angle;
 };
 
 
@@ -56,23 +279,154 @@ void paint_rec_ell (program_data &program, void (draw_rec_ell_to_win) (window, c
 void paint_tri (program_data &program, void (draw_tri_to_win) (window, color, double, double, double, double, double, double), 
                 void (draw_tri_to_bitmap) (bitmap, color, double, double, double, double, double, double));
 void select_tool (program_data &program);
+void draw_transformed_selection (window &the_window, select_tool_data &selection);
+bool transform_selection (program_data &program, select_tool_data &selection);
+void commit_selection (bitmap to_draw, select_tool_data &selection);
+rectangle selection_bounds (select_tool_data &selection);
 void fill_tool (program_data &program);
 
 void process_mode (program_data &program);
-program_data new_program_data();
+program_data new_program_data (bool headless);
 void process_input (program_data &program);
 void undo_changes (program_data &program);
 void redo_changes (program_data &program);
-void add_to_undo (program_data &program);
-void trim_undo (vector<bitmap> &undo);
-void wipe_redo (vector<bitmap> &redo);
+void jump_to_state (program_data &program, size_t state);
+void init_history (program_data &program);
+void record_command (program_data &program, tool_command &command);
+void apply_command (bitmap to_draw, const tool_command &command);
+void restore_history (program_data &program);
+void add_checkpoint (program_data &program);
+void trim_checkpoints (command_history &history);
+void drop_checkpoints_after (command_history &history, size_t command_count);
+tool_command new_command (program_data &program);
+rectangle command_bounds (const tool_command &command);
+vector<unsigned int> serialise_command (const tool_command &command);
+tool_command deserialise_command (const unsigned int *data, size_t length);
+void open_journal (program_data &program);
+void close_journal (undo_journal &journal);
+void journal_checkpoint (undo_journal &journal, bitmap source, size_t command_index);
+void journal_command (undo_journal &journal, const tool_command &command);
+void journal_pop (undo_journal &journal, size_t command_count);
+pixel_buffer journal_read (undo_journal &journal, size_t offset);
+void journal_pump (program_data &program);
+void journal_reset (undo_journal &journal);
+void init_document (document_data &document);
+void mark_dirty (document_data &document, rectangle area);
+void save_document (program_data &program);
+void open_document (program_data &program);
+void init_input (program_data &program);
+input_sample sample_input (program_data &program);
+bool frame_due (program_data &program);
+void present_frame (program_data &program);
+void init_frames (program_data &program);
+void add_frame (program_data &program);
+void delete_frame (program_data &program);
+void step_frame (program_data &program, int direction);
+void toggle_onion_skin (program_data &program);
+void draw_onion_skin (program_data &program);
+void play_animation (program_data &program);
+void init_history_browser (program_data &program);
+void forget_thumbnails (program_data &program, size_t first_state);
+void history_panel (program_data &program);
+void set_canvas_share (program_data &program, bool enabled);
+void publish_canvas (program_data &program);
+void start_import (program_data &program, string path);
+string read_image_file (string path, pixel_buffer &result);
+void cancel_import (program_data &program);
+void import_pump (program_data &program);
+unsigned int next_random (unsigned int &state);
+double random_unit (unsigned int &state);
+int extend_stroke (vector<point_2d> &points, point_2d to, double spacing);
+vector<point_2d> spray_pixels (double x, double y, unsigned int &state, double scale);
+void spray_particles (bitmap to_draw, color spray_color, double x, double y, unsigned int &state);
+bitmap draw_selection (bitmap &to_draw, double x, double y, double width, double height);
+void fill_area (bitmap to_draw, color fill_color, int x, int y);
+rectangle replace_color (pixel_buffer &pixels, unsigned int target, unsigned int replacement, int tolerance);
+string fill_style_name (fill_style style);
+fill_style next_fill_style (fill_style style);
+rectangle flood_bounds (const pixel_buffer &pixels, int x, int y);
+void styled_fill (pixel_buffer &pixels, int left, int top, const tool_command &command);
+void styled_fill_tool (program_data &program, rectangle selection);
+void filter_tool (program_data &program, rectangle area);
+void box_blur (pixel_buffer &pixels, int radius);
+string filter_name (filter_type type);
+void apply_filter (pixel_buffer &pixels, filter_type type, double first, double second, double scale);
+string brush_name (mode_option mode);
+rectangle brush_read_area (const tool_command &command);
+void brush_stroke (pixel_buffer &pixels, int left, int top, const tool_command &command);
+void sampling_brush_tool (program_data &program);
 void load_graphics();
-void get_color (color &select_color);
+void get_color (program_data &program);
+color sidebar_gradient_color (color active_color, int column);
+color sidebar_palette_color (int index);
+void color_wheel_picker (program_data &program);
+void pick_canvas_color (program_data &program);
+void init_indexed_canvas (indexed_canvas &canvas);
+void set_indexed_mode (program_data &program, bool enabled);
+int nearest_index (const indexed_canvas &canvas, unsigned int pixel);
+void apply_indexed_command (indexed_canvas &canvas, const tool_command &command);
+rectangle index_replace (indexed_canvas &canvas, unsigned char index, int x, int y, int tolerance);
+void present_indexed (program_data &program, rectangle area);
+void edit_palette (program_data &program, int entry, color new_color);
+void init_vector_layer (vector_layer &layer);
+void set_vector_mode (program_data &program, bool enabled);
+void flatten_vector_layer (program_data &program);
+void vector_record (program_data &program, const tool_command &command);
+void rebuild_vector_layer (program_data &program);
+int shape_at (const vector_layer &layer, point_2d p);
+pixel_buffer vector_edit_pixels (const tool_command &command);
+void vector_tool (program_data &program);
+void export_vector_layer (program_data &program, double scale);
 void process_sidebar (program_data &program);
-void draw_sidebar (window &the_window, color &active_color);
+void draw_sidebar (program_data &program);
 void draw_title_screen (window &the_window);
+int run_regression (bool record);
 
 void draw_menu(program_data &program, vector<menu_item>(create_menu)(double, double, mode_option), void (process_menu)(program_data&, vector<menu_item>&, int));
 void process_sub_menu (program_data &program, vector<menu_item> &menu, int width);
 void process_paint_menu (program_data &program, vector<menu_item> &menu, int width);
 vector<menu_item> create_paint_menu (double x, double y, mode_option mode);
+
+void queue_clear (window the_window, color clear_color);
+void queue_bitmap (window the_window, bitmap graphic, double x, double y);
+void queue_bitmap (window the_window, bitmap graphic, double x, double y, drawing_options options);
+void queue_rectangle (window the_window, color draw_color, double x, double y, double width, double height);
+void queue_fill_rectangle (window the_window, color draw_color, double x, double y, double width, double height);
+void queue_ellipse (window the_window, color draw_color, double x, double y, double width, double height);
+void queue_fill_ellipse (window the_window, color draw_color, double x, double y, double width, double height);
+void queue_circle (window the_window, color draw_color, double x, double y, double radius);
+void queue_fill_circle (window the_window, color draw_color, double x, double y, double radius);
+void queue_triangle (window the_window, color draw_color, double x1, double y1, double x2, double y2, double x3, double y3);
+void queue_fill_triangle (window the_window, color draw_color, double x1, double y1, double x2, double y2, double x3, double y3);
+void queue_line (window the_window, color draw_color, double x1, double y1, double x2, double y2);
+void queue_text (window the_window, string text, color draw_color, string font, int font_size, double x, double y);
+void queue_text (window the_window, string text, color draw_color, double x, double y);
+void flush_render (window the_window);
+void toggle_render_debug (window the_window);
+
+const pixel_kernels &kernels();
+vector<const pixel_kernels *> supported_kernels();
+void benchmark_kernels();
+unsigned int pack_color (color c);
+color unpack_color (unsigned int pixel);
+unsigned int hash_bytes (const unsigned char *data, size_t length);
+pixel_buffer new_pixel_buffer (int width, int height);
+pixel_buffer read_pixels (bitmap source, int x, int y, int width, int height);
+pixel_buffer copy_pixels (const pixel_buffer &source, int x, int y, int width, int height);
+pixel_buffer downsample_pixels (const pixel_buffer &source, int factor);
+void write_pixels (bitmap dest, const pixel_buffer &buffer, int x, int y);
+void init_canvas_cache (canvas_cache &cache);
+void mark_stale (canvas_cache &cache, rectangle area);
+vector<rectangle> take_unpublished (canvas_cache &cache);
+unsigned int canvas_pixel (program_data &program, int x, int y);
+const pixel_buffer &canvas_pixels (program_data &program);
+rectangle touched_bounds (const vector<char> &flags, int tiles_x, int tile_size, int width, int height);
+void parallel_tiles (int width, int height, int tile_size, std::function<void (int, int, int, int)> work);
+
+job_handle submit_job (std::function<void ()> work, const vector<job_handle> &after);
+void cancel_job (job_handle cancelled);
+bool job_cancelled();
+bool job_finished (job_handle current);
+void wait_for_job (job_handle current);
+void parallel_for (int count, std::function<void (int)> work);
+void stop_jobs();
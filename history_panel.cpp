@@ -0,0 +1,451 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <map>
+
+// Thumbnails are the user image shrunk by this much each way
+#define THUMBNAIL_SCALE 10
+#define THUMBNAIL_WIDTH (IMAGE_WIDTH / THUMBNAIL_SCALE)
+#define THUMBNAIL_HEIGHT (HEIGHT / THUMBNAIL_SCALE)
+// Most thumbnails kept at once, the ones furthest from the rows on screen are freed first
+#define THUMBNAIL_CACHE 160
+// Largest share of the in-memory copy of the image that may be stale for a thumbnail of the
+// current image to be made from it, rather than by shrinking the bitmap
+#define MAX_STALE_SHARE 0.25
+// Panel listing the history, down the right of the image
+#define PANEL_X 560
+#define PANEL_WIDTH 240
+#define ROW_HEIGHT 66
+#define VISIBLE_ROWS (HEIGHT / ROW_HEIGHT)
+#define NO_STATE ((size_t) -1)
+
+using namespace std;
+
+/*  A point in the history, or state, is the number of commands drawn to reach it, and counts
+    on through the redo list, so a state keeps its number while commands are undone and redone.
+    Thumbnails are only made for states while the panel is showing them. The current image
+    is shrunk by a background job from the in-memory copy of the image. Other states are
+    drawn again onto a scratch bitmap from the nearest checkpoint and shrunk by the renderer,
+    one each frame, going on from the state already on the scratch bitmap when it can. */
+
+struct history_thumbnail
+{
+    bitmap graphic;
+
+    // The job shrinking the image and the pixels it writes, until they are drawn onto graphic
+    job_handle job;
+    shared_ptr<pixel_buffer> pixels;
+};
+
+struct history_browser
+{
+    map<size_t, history_thumbnail> thumbnails;
+    bitmap scratch;
+    size_t scratch_state;
+    size_t top;
+};
+
+/**
+ * Set up the history browser with no thumbnails
+ *
+ * @param program   Struct containing program data
+ */
+void init_history_browser (program_data &program)
+{
+    program.browser = new history_browser;
+    program.browser->scratch = create_bitmap ("history_scratch", IMAGE_WIDTH, HEIGHT);
+    program.browser->scratch_state = NO_STATE;
+    program.browser->top = 0;
+}
+
+/**
+ * Free a thumbnail, stopping the job making it if it is still running
+ *
+ * @param thumbnail     The thumbnail to be freed
+ */
+void free_thumbnail (history_thumbnail &thumbnail)
+{
+    if (thumbnail.job != nullptr)
+        cancel_job (thumbnail.job);
+    free_bitmap (thumbnail.graphic);
+}
+
+/**
+ * Throw away the thumbnails of states from a given one on, when the commands that led to
+ * them have gone from the history
+ *
+ * @param program       Struct containing program data
+ * @param first_state   The first state that has gone
+ */
+void forget_thumbnails (program_data &program, size_t first_state)
+{
+    history_browser &browser = *program.browser;
+    auto first = browser.thumbnails.lower_bound (first_state);
+
+    for (auto it = first; it != browser.thumbnails.end(); it++)
+        free_thumbnail (it->second);
+    browser.thumbnails.erase (first, browser.thumbnails.end());
+
+    if (browser.scratch_state != NO_STATE && browser.scratch_state >= first_state)
+        browser.scratch_state = NO_STATE;
+}
+
+/**
+ * Get the command that leads to a state from the one before it
+ *
+ * @param history   The command history
+ * @param state     The state, which must be after the first
+ *
+ * @returns         The command
+ */
+const tool_command &command_before (const command_history &history, size_t state)
+{
+    if (state <= history.commands.size())
+        return history.commands[state - 1];
+
+    return history.redo[history.redo.size() - (state - history.commands.size())];
+}
+
+/**
+ * Get the name of a state to show in the panel, from the command that led to it
+ *
+ * @param history   The command history
+ * @param state     The state
+ *
+ * @returns         The name of the state
+ */
+string state_name (const command_history &history, size_t state)
+{
+    if (state == history.checkpoints.front().command_index)
+        return "Start";
+
+    const tool_command &command = command_before (history, state);
+
+    switch (command.mode)
+    {
+        case ERASER:        return "Eraser";
+        case PEN:           return "Pen";
+        case SPRAY:         return "Spray";
+        case DRAW_REC:      return "Rectangle";
+        case FILL_REC:      return "Filled rectangle";
+        case DRAW_ELL:      return "Ellipse";
+        case FILL_ELL:      return "Filled ellipse";
+        case DRAW_TRI:      return "Triangle";
+        case FILL_TRI:      return "Filled triangle";
+        case SELECT:        return "Move selection";
+        case FILL:          return command.values.size() > 0 ? "Replace color" : "Fill";
+        case FILTER:        return filter_name ((filter_type) command.values[4]);
+        case PALETTE:       return "Palette";
+        case VECTOR:        return "Edit shape";
+        case STYLED_FILL:   return fill_style_name ((fill_style) command.values[0]) + " fill";
+        case SMUDGE:
+        case BLUR_BRUSH:
+        case CLONE:         return brush_name (command.mode);
+        case NONE:          break;
+    }
+
+    return "";
+}
+
+/**
+ * Add an empty thumbnail for a state, freeing the thumbnails furthest from the rows on
+ * screen if there are too many
+ *
+ * @param browser   The history browser
+ * @param state     The state
+ *
+ * @returns         The new thumbnail
+ */
+history_thumbnail &add_thumbnail (history_browser &browser, size_t state)
+{
+    while (browser.thumbnails.size() >= THUMBNAIL_CACHE)
+    {
+        auto first = browser.thumbnails.begin();
+        auto last = prev (browser.thumbnails.end());
+        auto furthest = browser.top - min (first->first, browser.top) > max (last->first, browser.top) - browser.top ? first : last;
+
+        free_thumbnail (furthest->second);
+        browser.thumbnails.erase (furthest);
+    }
+
+    history_thumbnail &result = browser.thumbnails[state];
+    result.graphic = create_bitmap ("history_thumbnail", THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT);
+    clear_bitmap (result.graphic, COLOR_WHITE);
+
+    return result;
+}
+
+/**
+ * Draw a bitmap of the whole image shrunk down onto a thumbnail
+ *
+ * @param thumbnail     The thumbnail
+ * @param source        Bitmap of the image
+ */
+void shrink_onto_thumbnail (history_thumbnail &thumbnail, bitmap source)
+{
+    // Bitmaps are scaled about their centre
+    draw_bitmap_on_bitmap (thumbnail.graphic, source, (THUMBNAIL_WIDTH - IMAGE_WIDTH) / 2.0, (THUMBNAIL_HEIGHT - HEIGHT) / 2.0,
+                           option_scale_bmp (1.0 / THUMBNAIL_SCALE, 1.0 / THUMBNAIL_SCALE));
+}
+
+/**
+ * Make the thumbnail of the current image. It is shrunk from the in-memory copy in the
+ * background, unless bringing the copy up to date would read back much of the image.
+ *
+ * @param program   Struct containing program data
+ */
+void capture_thumbnail (program_data &program)
+{
+    history_browser &browser = *program.browser;
+    const vector<bool> &stale = program.canvas.stale;
+    history_thumbnail &thumbnail = add_thumbnail (browser, program.history.commands.size());
+
+    if (count (stale.begin(), stale.end(), true) > stale.size() * MAX_STALE_SHARE)
+    {
+        shrink_onto_thumbnail (thumbnail, program.to_draw);
+        return;
+    }
+
+    shared_ptr<pixel_buffer> source = make_shared<pixel_buffer> (canvas_pixels (program));
+    shared_ptr<pixel_buffer> result = make_shared<pixel_buffer>();
+
+    thumbnail.pixels = result;
+    thumbnail.job = submit_job ([source, result]()
+    {
+        *result = downsample_pixels (*source, THUMBNAIL_SCALE);
+    }, {});
+}
+
+/**
+ * Make the thumbnail of a state other than the current one, by drawing the state on the
+ * scratch bitmap and shrinking it
+ *
+ * @param program   Struct containing program data
+ * @param state     The state
+ */
+void render_thumbnail (program_data &program, size_t state)
+{
+    history_browser &browser = *program.browser;
+    command_history &history = program.history;
+    int start = history.checkpoints.size() - 1;
+
+    // Checkpoints still waiting to be written to the journal may have no bitmap yet either
+    while (start > 0 && (history.checkpoints[start].command_index > state ||
+           (history.checkpoints[start].graphic == nullptr && history.checkpoints[start].journal_offset == 0)))
+        start--;
+
+    history_checkpoint &checkpoint = history.checkpoints[start];
+
+    // Carry on from the scratch bitmap if it is nearer than the checkpoint
+    if (browser.scratch_state == NO_STATE || browser.scratch_state > state || browser.scratch_state < checkpoint.command_index)
+    {
+        if (checkpoint.graphic != nullptr)
+            draw_bitmap_on_bitmap (browser.scratch, checkpoint.graphic, 0, 0);
+        else
+        {
+            clear_bitmap (browser.scratch, COLOR_WHITE);
+            write_pixels (browser.scratch, journal_read (program.journal, checkpoint.journal_offset), 0, 0);
+        }
+        browser.scratch_state = checkpoint.command_index;
+    }
+
+    while (browser.scratch_state < state)
+        apply_command (browser.scratch, command_before (history, ++browser.scratch_state));
+
+    shrink_onto_thumbnail (add_thumbnail (browser, state), browser.scratch);
+}
+
+/**
+ * Draw the pixels of thumbnails whose background jobs have finished onto their bitmaps
+ *
+ * @param browser   The history browser
+ *
+ * @returns         True if any thumbnail was finished
+ */
+bool finish_thumbnails (history_browser &browser)
+{
+    bool result = false;
+
+    for (auto &entry : browser.thumbnails)
+    {
+        history_thumbnail &thumbnail = entry.second;
+
+        if (thumbnail.job == nullptr || not job_finished (thumbnail.job))
+            continue;
+
+        write_pixels (thumbnail.graphic, *thumbnail.pixels, 0, 0);
+        thumbnail.job = nullptr;
+        thumbnail.pixels = nullptr;
+        result = true;
+    }
+
+    return result;
+}
+
+/**
+ * Make the next thumbnail the panel is missing. The current image comes first, then the
+ * rows on screen from the top.
+ *
+ * @param program   Struct containing program data
+ *
+ * @returns         True if a thumbnail was made
+ */
+bool next_thumbnail (program_data &program)
+{
+    history_browser &browser = *program.browser;
+    command_history &history = program.history;
+    size_t last = min (browser.top + VISIBLE_ROWS, history.commands.size() + history.redo.size() + 1);
+
+    if (browser.thumbnails.count (history.commands.size()) == 0)
+    {
+        capture_thumbnail (program);
+        return true;
+    }
+
+    for (size_t state = browser.top; state < last; state++)
+        if (browser.thumbnails.count (state) == 0)
+        {
+            render_thumbnail (program, state);
+            return true;
+        }
+
+    return false;
+}
+
+/**
+ * Draw the history panel over the image, with a row for each state on screen
+ *
+ * @param program   Struct containing program data
+ */
+void draw_history_panel (program_data &program)
+{
+    history_browser &browser = *program.browser;
+    command_history &history = program.history;
+    size_t first = history.checkpoints.front().command_index;
+    size_t count = history.commands.size() + history.redo.size() + 1 - first;
+
+    queue_bitmap (program.the_window, program.to_draw, 0, 0);
+    queue_fill_rectangle (program.the_window, COLOR_WHITE, PANEL_X, 0, PANEL_WIDTH, HEIGHT);
+    queue_rectangle (program.the_window, COLOR_BLACK, PANEL_X, 0, PANEL_WIDTH, HEIGHT);
+
+    for (size_t state = browser.top; state < browser.top + VISIBLE_ROWS && state < first + count; state++)
+    {
+        double y = (state - browser.top) * ROW_HEIGHT;
+        auto thumbnail = browser.thumbnails.find (state);
+
+        if (state == history.commands.size())
+            queue_fill_rectangle (program.the_window, COLOR_LIGHT_BLUE, PANEL_X + 1, y + 1, PANEL_WIDTH - 2, ROW_HEIGHT - 2);
+
+        if (thumbnail != browser.thumbnails.end() && thumbnail->second.job == nullptr)
+            queue_bitmap (program.the_window, thumbnail->second.graphic, PANEL_X + 3, y + 3);
+        else
+            queue_fill_rectangle (program.the_window, COLOR_LIGHT_GRAY, PANEL_X + 3, y + 3, THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT);
+        queue_rectangle (program.the_window, COLOR_GRAY, PANEL_X + 3, y + 3, THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT);
+
+        // Undone states are grayed out until something else is drawn over them
+        color text_color = state > history.commands.size() ? COLOR_GRAY : COLOR_BLACK;
+        queue_text (program.the_window, to_string (state), text_color, PANEL_X + THUMBNAIL_WIDTH + 10, y + 15);
+        queue_text (program.the_window, state_name (history, state), text_color, PANEL_X + THUMBNAIL_WIDTH + 10, y + 35);
+    }
+
+    // Where the rows on screen are in the whole history
+    if (count > VISIBLE_ROWS)
+        queue_fill_rectangle (program.the_window, COLOR_GRAY, PANEL_X + PANEL_WIDTH - 5, (double) (browser.top - first) / count * HEIGHT,
+                              3, (double) VISIBLE_ROWS / count * HEIGHT);
+
+    draw_sidebar (program);
+    flush_render (program.the_window);
+}
+
+/**
+ * Scroll the panel so a state is on screen, keeping the rows inside the history
+ *
+ * @param program   Struct containing program data
+ * @param state     The state to be shown
+ */
+void scroll_to_state (program_data &program, size_t state)
+{
+    history_browser &browser = *program.browser;
+    command_history &history = program.history;
+    size_t first = history.checkpoints.front().command_index;
+    size_t last = history.commands.size() + history.redo.size();
+
+    if (state < browser.top)
+        browser.top = state;
+    else if (state >= browser.top + VISIBLE_ROWS)
+        browser.top = state - VISIBLE_ROWS + 1;
+
+    browser.top = max (min (browser.top, last + 1 - min ((size_t) VISIBLE_ROWS, last + 1 - first)), first);
+}
+
+/**
+ * Show the history as a list of states with thumbnails, and move to the state clicked on.
+ * Up and Down step through the history, and the mouse wheel scrolls. The panel closes when
+ * the mouse is pressed outside it, or Enter, Escape or Ctrl+H is pressed.
+ *
+ * @param program   Struct containing program data
+ */
+void history_panel (program_data &program)
+{
+    history_browser &browser = *program.browser;
+    command_history &history = program.history;
+    bool changed = true;
+
+    scroll_to_state (program, history.commands.size());
+
+    // Events are processed first, so the Ctrl+H that opened the panel doesn't close it
+    while (not quit_requested())
+    {
+        process_events();
+
+        if (key_typed (ESCAPE_KEY) || key_typed (RETURN_KEY) || key_typed (H_KEY))
+            break;
+
+        if (mouse_clicked (LEFT_BUTTON))
+        {
+            if (mouse_x() < PANEL_X || mouse_x() >= PANEL_X + PANEL_WIDTH)
+                break;
+
+            size_t state = browser.top + (size_t) mouse_y() / ROW_HEIGHT;
+            if (state != history.commands.size())
+            {
+                jump_to_state (program, state);
+                changed = true;
+            }
+        }
+
+        else if (key_typed (UP_KEY) || key_typed (DOWN_KEY))
+        {
+            if (key_typed (UP_KEY))
+                undo_changes (program);
+            else
+                redo_changes (program);
+            scroll_to_state (program, history.commands.size());
+            changed = true;
+        }
+
+        else if (mouse_wheel_scroll().y != 0)
+        {
+            size_t top = browser.top;
+            scroll_to_state (program, mouse_wheel_scroll().y > 0 ? browser.top - min (browser.top, (size_t) 1) : browser.top + VISIBLE_ROWS);
+            changed = changed || browser.top != top;
+        }
+
+        journal_pump (program);
+        changed = finish_thumbnails (browser) || changed;
+
+        // Only one thumbnail is made a frame, so scrolling through a long history stays smooth
+        changed = next_thumbnail (program) || changed;
+
+        if (changed)
+            draw_history_panel (program);
+        changed = false;
+    }
+
+    // Wait for the click that closed the panel to finish, so it doesn't start drawing
+    while (mouse_down (LEFT_BUTTON))
+        process_events();
+
+    queue_bitmap (program.the_window, program.to_draw, 0, 0);
+    draw_sidebar (program);
+    flush_render (program.the_window);
+}
@@ -0,0 +1,866 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#define IMPORT_FILE "User_import.png"
+#define PREVIEW_BLOCK 8
+#define REFINE_ROWS_PER_FRAME 30
+#define INFLATE_WINDOW 32768
+
+using namespace std;
+
+/*  Images are decoded by a job on the job pool one row at a time, straight from the file, and
+    box filtered down to the size of the image as they go. Only the downscaled sums and the
+    current and previous rows are ever held in memory, never the whole decoded image.
+    Each frame, import_pump draws any newly finished rows: first as coarse blocks, so the
+    whole image appears quickly, then again at full detail. */
+
+struct image_import
+{
+    string path;
+    int source_width;
+    int source_height;
+    int width;
+    int height;
+    vector<unsigned int> sums;
+    vector<int> column_count;
+    vector<int> row_count;
+    vector<int> rows_added;
+    vector<unsigned int> result;
+
+    // Shared with the decode job. The size and buffers above are only read by the main
+    // thread once size_ready has been seen under the lock.
+    mutex lock;
+    bool size_ready;
+    vector<int> finished_rows;
+    bool decoded;
+    bool failed;
+    string error;
+    job_handle worker;
+
+    // Only used by import_pump
+    vector<bool> row_ready;
+    vector<bool> band_previewed;
+    int next_refine_row;
+};
+
+/**
+ * Set up the downscaling for an image of a known size, fitting it inside the user image.
+ * Called by the decode job once the image header has been read.
+ *
+ * @param import    The import in progress
+ * @param width     Width of the image file in pixels
+ * @param height    Height of the image file in pixels
+ */
+void import_set_size (image_import &import, int width, int height)
+{
+    double scale = min (1.0, min ((double) IMAGE_WIDTH / width, (double) HEIGHT / height));
+
+    import.source_width = width;
+    import.source_height = height;
+    import.width = max (1, (int) (width * scale));
+    import.height = max (1, (int) (height * scale));
+    import.sums.assign ((size_t) import.width * import.height * 4, 0);
+    import.result.assign ((size_t) import.width * import.height, 0);
+    import.column_count.assign (import.width, 0);
+    import.row_count.assign (import.height, 0);
+    import.rows_added.assign (import.height, 0);
+
+    for (int x = 0; x < width; x++)
+        import.column_count[(long long) x * import.width / width]++;
+    for (int y = 0; y < height; y++)
+        import.row_count[(long long) y * import.height / height]++;
+
+    lock_guard<mutex> guard (import.lock);
+    import.size_ready = true;
+}
+
+/**
+ * Add a decoded row of the image file to the downscaled sums. Once every file row that
+ * covers a downscaled row has been added, that row is averaged, put over white, and handed
+ * to the main thread.
+ *
+ * @param import    The import in progress
+ * @param y         Row number in the image file
+ * @param row       The row as packed 0xAARRGGBB pixels
+ */
+void import_add_row (image_import &import, int y, const unsigned int *row)
+{
+    int dest_y = (long long) y * import.height / import.source_height;
+    unsigned int *sums = &import.sums[(size_t) dest_y * import.width * 4];
+
+    for (int x = 0; x < import.source_width; x++)
+    {
+        unsigned int *sum = sums + (long long) x * import.width / import.source_width * 4;
+        unsigned int pixel = row[x];
+
+        sum[0] += pixel >> 24;
+        sum[1] += (pixel >> 16) & 0xFF;
+        sum[2] += (pixel >> 8) & 0xFF;
+        sum[3] += pixel & 0xFF;
+    }
+
+    if (++import.rows_added[dest_y] < import.row_count[dest_y])
+        return;
+
+    for (int x = 0; x < import.width; x++)
+    {
+        unsigned int *sum = sums + x * 4;
+        unsigned int count = import.column_count[x] * import.row_count[dest_y];
+        unsigned int a = sum[0] / count;
+        unsigned int r = (sum[1] * a + 255 * (255 - a) * count) / (count * 255);
+        unsigned int g = (sum[2] * a + 255 * (255 - a) * count) / (count * 255);
+        unsigned int b = (sum[3] * a + 255 * (255 - a) * count) / (count * 255);
+
+        import.result[(size_t) dest_y * import.width + x] = 0xFF000000 | (r << 16) | (g << 8) | b;
+    }
+
+    lock_guard<mutex> guard (import.lock);
+    import.finished_rows.push_back (dest_y);
+}
+
+/**
+ * Read a little endian number from a byte array
+ */
+unsigned int read_le (const unsigned char *data, int bytes)
+{
+    unsigned int result = 0;
+
+    for (int i = bytes - 1; i >= 0; i--)
+        result = (result << 8) | data[i];
+
+    return result;
+}
+
+/**
+ * Read a big endian 32 bit number from a byte array
+ */
+unsigned int read_be (const unsigned char *data)
+{
+    return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+/**
+ * Decode an uncompressed 24 or 32 bit BMP file one row at a time
+ *
+ * @param import    The import in progress
+ * @param file      The open file
+ *
+ * @returns         An error message, or an empty string on success
+ */
+string decode_bmp (image_import &import, FILE *file)
+{
+    unsigned char header[54];
+
+    if (fread (header, 1, sizeof (header), file) != sizeof (header) || header[0] != 'B' || header[1] != 'M')
+        return "not a BMP file";
+
+    unsigned int offset = read_le (header + 10, 4);
+    int width = (int) read_le (header + 18, 4);
+    int height = (int) read_le (header + 22, 4);
+    int bits = read_le (header + 28, 2);
+    int compression = read_le (header + 30, 4);
+    bool top_down = height < 0;
+
+    height = abs (height);
+
+    if (width <= 0 || height == 0 || (bits != 24 && bits != 32) || (compression != 0 && compression != 3))
+        return "only uncompressed 24 and 32 bit BMP files can be opened";
+
+    import_set_size (import, width, height);
+
+    size_t stride = ((size_t) width * bits / 8 + 3) & ~(size_t) 3;
+    vector<unsigned char> bytes (stride);
+    vector<unsigned int> row (width);
+
+    fseek (file, offset, SEEK_SET);
+
+    // Rows are stored bottom up unless the height is negative
+    for (int i = 0; i < height && not job_cancelled(); i++)
+    {
+        if (fread (bytes.data(), 1, stride, file) != stride)
+            return "BMP file is truncated";
+
+        for (int x = 0; x < width; x++)
+        {
+            const unsigned char *p = &bytes[x * bits / 8];
+            unsigned int alpha = bits == 32 && compression == 3 ? p[3] : 0xFF;
+            row[x] = (alpha << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+        }
+
+        import_add_row (import, top_down ? i : height - 1 - i, row.data());
+    }
+
+    return "";
+}
+
+// Reads the zlib stream spread across the IDAT chunks of a PNG file, a bit at a time
+struct png_stream
+{
+    FILE *file;
+    unsigned int chunk_left;
+    unsigned int bit_buffer;
+    int bit_count;
+    bool ended;
+};
+
+/**
+ * Get the next byte of compressed data, moving on to the next IDAT chunk when needed
+ */
+int png_next_byte (png_stream &s)
+{
+    unsigned char chunk[8];
+
+    while (s.chunk_left == 0)
+    {
+        // Skip the CRC of the previous chunk, then read the next chunk header
+        if (fseek (s.file, 4, SEEK_CUR) != 0 || fread (chunk, 1, 8, s.file) != 8 || memcmp (chunk + 4, "IDAT", 4) != 0)
+        {
+            s.ended = true;
+            return 0;
+        }
+        s.chunk_left = read_be (chunk);
+    }
+
+    s.chunk_left--;
+    int c = fgetc (s.file);
+    if (c == EOF)
+    {
+        s.ended = true;
+        return 0;
+    }
+
+    return c;
+}
+
+/**
+ * Read a number of bits from the compressed data, least significant first
+ */
+int png_bits (png_stream &s, int count)
+{
+    while (s.bit_count < count)
+    {
+        s.bit_buffer |= png_next_byte (s) << s.bit_count;
+        s.bit_count += 8;
+    }
+
+    int result = s.bit_buffer & ((1 << count) - 1);
+    s.bit_buffer >>= count;
+    s.bit_count -= count;
+
+    return result;
+}
+
+// Canonical Huffman code, as the number of codes of each length and the symbols in code order
+struct huffman_code
+{
+    short count[16];
+    short symbol[288];
+};
+
+/**
+ * Build a canonical Huffman code from a list of code lengths
+ */
+void build_huffman (huffman_code &code, const short *lengths, int n)
+{
+    short offsets[16];
+
+    memset (code.count, 0, sizeof (code.count));
+    for (int i = 0; i < n; i++)
+        code.count[lengths[i]]++;
+    code.count[0] = 0;
+
+    offsets[1] = 0;
+    for (int len = 1; len < 15; len++)
+        offsets[len + 1] = offsets[len] + code.count[len];
+
+    for (int i = 0; i < n; i++)
+        if (lengths[i] != 0)
+            code.symbol[offsets[lengths[i]]++] = i;
+}
+
+/**
+ * Decode one symbol using a Huffman code
+ */
+int decode_symbol (png_stream &s, const huffman_code &code)
+{
+    int value = 0, first = 0, index = 0;
+
+    for (int len = 1; len < 16; len++)
+    {
+        value |= png_bits (s, 1);
+        int count = code.count[len];
+
+        if (value - count < first)
+            return code.symbol[index + (value - first)];
+
+        index += count;
+        first = (first + count) << 1;
+        value <<= 1;
+    }
+
+    return -1;
+}
+
+// Receives decompressed bytes and turns them back into rows of pixels
+struct png_rows
+{
+    image_import *import;
+    int color_type;
+    int depth;
+    int channels;
+    int bytes_per_pixel;
+    size_t stride;
+    vector<unsigned char> current;
+    vector<unsigned char> previous;
+    vector<unsigned int> palette;
+    vector<unsigned int> pixels;
+    size_t filled;
+    int y;
+};
+
+/**
+ * Paeth predictor used by PNG filter type 4
+ */
+int paeth (int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs (p - a), pb = abs (p - b), pc = abs (p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+/**
+ * Get one sample of the current row, scaled to 8 bits
+ */
+unsigned int png_sample (png_rows &rows, int index)
+{
+    const unsigned char *data = &rows.current[1];
+
+    if (rows.depth == 8)
+        return data[index];
+    if (rows.depth == 16)
+        return data[index * 2];
+
+    int bit = index * rows.depth;
+    unsigned int value = (data[bit / 8] >> (8 - rows.depth - bit % 8)) & ((1 << rows.depth) - 1);
+
+    // Palette indices are used as they are, grey levels are stretched to 8 bits
+    return rows.color_type == 3 ? value : value * 255 / ((1 << rows.depth) - 1);
+}
+
+/**
+ * Undo the filter on a finished row, convert it to pixels and add it to the import
+ */
+void png_finish_row (png_rows &rows)
+{
+    unsigned char *row = &rows.current[1];
+    const unsigned char *above = &rows.previous[1];
+    int filter = rows.current[0];
+    int bpp = rows.bytes_per_pixel;
+    size_t length = rows.stride - 1;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        int left = i >= (size_t) bpp ? row[i - bpp] : 0;
+        int up = above[i];
+        int corner = i >= (size_t) bpp ? above[i - bpp] : 0;
+
+        switch (filter)
+        {
+            case 1: row[i] += left; break;
+            case 2: row[i] += up; break;
+            case 3: row[i] += (left + up) / 2; break;
+            case 4: row[i] += paeth (left, up, corner); break;
+        }
+    }
+
+    for (int x = 0; x < rows.import->source_width; x++)
+    {
+        unsigned int r, g, b, a = 0xFF;
+        int c = x * rows.channels;
+
+        switch (rows.color_type)
+        {
+            case 0: r = g = b = png_sample (rows, c); break;
+            case 2: r = png_sample (rows, c); g = png_sample (rows, c + 1); b = png_sample (rows, c + 2); break;
+            case 3: rows.pixels[x] = rows.palette[png_sample (rows, c) & 0xFF]; continue;
+            case 4: r = g = b = png_sample (rows, c); a = png_sample (rows, c + 1); break;
+            default: r = png_sample (rows, c); g = png_sample (rows, c + 1); b = png_sample (rows, c + 2); a = png_sample (rows, c + 3);
+        }
+
+        rows.pixels[x] = (a << 24) | (r << 16) | (g << 8) | b;
+    }
+
+    import_add_row (*rows.import, rows.y++, rows.pixels.data());
+    rows.current.swap (rows.previous);
+    rows.filled = 0;
+}
+
+/**
+ * Pass decompressed bytes on to be assembled into rows
+ */
+void png_output (png_rows &rows, unsigned char byte)
+{
+    if (rows.y >= rows.import->source_height)
+        return;
+
+    rows.current[rows.filled++] = byte;
+
+    if (rows.filled == rows.stride)
+        png_finish_row (rows);
+}
+
+/**
+ * Inflate the zlib stream of a PNG file, passing each byte out as it is decompressed.
+ * Only the 32KB window of previous output is kept.
+ *
+ * @param s         The compressed data
+ * @param rows      Where the decompressed bytes go
+ *
+ * @returns         An error message, or an empty string on success
+ */
+string inflate_png (png_stream &s, png_rows &rows)
+{
+    static const short length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const short length_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const short distance_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const short distance_extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    static const short code_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    vector<unsigned char> window (INFLATE_WINDOW);
+    size_t out = 0;
+    huffman_code literals, distances;
+    short lengths[320];
+    bool last = false;
+
+    // Skip the two byte zlib header
+    png_bits (s, 16);
+
+    while (not last && not s.ended && not job_cancelled())
+    {
+        last = png_bits (s, 1);
+        int type = png_bits (s, 2);
+
+        if (type == 0)
+        {
+            // Stored block, aligned to a byte boundary
+            s.bit_buffer = 0;
+            s.bit_count = 0;
+            int length = png_bits (s, 16);
+            png_bits (s, 16);
+
+            for (int i = 0; i < length; i++)
+            {
+                unsigned char byte = png_bits (s, 8);
+                window[out++ % INFLATE_WINDOW] = byte;
+                png_output (rows, byte);
+            }
+            continue;
+        }
+
+        if (type == 1)
+        {
+            for (int i = 0; i < 288; i++)
+                lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+            build_huffman (literals, lengths, 288);
+
+            for (int i = 0; i < 30; i++)
+                lengths[i] = 5;
+            build_huffman (distances, lengths, 30);
+        }
+
+        else if (type == 2)
+        {
+            int literal_count = png_bits (s, 5) + 257;
+            int distance_count = png_bits (s, 5) + 1;
+            int code_count = png_bits (s, 4) + 4;
+            huffman_code code_lengths;
+
+            memset (lengths, 0, sizeof (lengths));
+            for (int i = 0; i < code_count; i++)
+                lengths[code_order[i]] = png_bits (s, 3);
+            build_huffman (code_lengths, lengths, 19);
+
+            for (int i = 0; i < literal_count + distance_count;)
+            {
+                int symbol = decode_symbol (s, code_lengths);
+                int repeat, value = 0;
+
+                if (symbol < 0)
+                    return "PNG data is damaged";
+
+                if (symbol < 16)
+                {
+                    lengths[i++] = symbol;
+                    continue;
+                }
+
+                if (symbol == 16)
+                {
+                    if (i == 0)
+                        return "PNG data is damaged";
+                    value = lengths[i - 1];
+                    repeat = 3 + png_bits (s, 2);
+                }
+                else if (symbol == 17)
+                    repeat = 3 + png_bits (s, 3);
+                else
+                    repeat = 11 + png_bits (s, 7);
+
+                if (i + repeat > literal_count + distance_count)
+                    return "PNG data is damaged";
+                while (repeat-- > 0)
+                    lengths[i++] = value;
+            }
+
+            build_huffman (literals, lengths, literal_count);
+            build_huffman (distances, lengths + literal_count, distance_count);
+        }
+
+        else
+            return "PNG data is damaged";
+
+        while (not s.ended)
+        {
+            int symbol = decode_symbol (s, literals);
+
+            if (symbol < 0 || symbol > 285)
+                return "PNG data is damaged";
+
+            if (symbol < 256)
+            {
+                window[out++ % INFLATE_WINDOW] = symbol;
+                png_output (rows, symbol);
+                continue;
+            }
+
+            if (symbol == 256)
+                break;
+
+            symbol -= 257;
+            int length = length_base[symbol] + png_bits (s, length_extra[symbol]);
+            int distance_symbol = decode_symbol (s, distances);
+
+            if (distance_symbol < 0 || distance_symbol > 29)
+                return "PNG data is damaged";
+
+            size_t distance = distance_base[distance_symbol] + png_bits (s, distance_extra[distance_symbol]);
+            if (distance > out)
+                return "PNG data is damaged";
+
+            for (int i = 0; i < length; i++)
+            {
+                unsigned char byte = window[(out - distance) % INFLATE_WINDOW];
+                window[out++ % INFLATE_WINDOW] = byte;
+                png_output (rows, byte);
+            }
+        }
+    }
+
+    if (rows.y < rows.import->source_height && not job_cancelled())
+        return "PNG file is truncated";
+
+    return "";
+}
+
+/**
+ * Decode a non-interlaced PNG file one row at a time
+ *
+ * @param import    The import in progress
+ * @param file      The open file
+ *
+ * @returns         An error message, or an empty string on success
+ */
+string decode_png (image_import &import, FILE *file)
+{
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+    unsigned char header[8];
+    unsigned char ihdr[13];
+    png_rows rows;
+    png_stream stream;
+
+    if (fread (header, 1, 8, file) != 8 || memcmp (header, signature, 8) != 0)
+        return "not a PNG file";
+
+    if (fread (header, 1, 8, file) != 8 || memcmp (header + 4, "IHDR", 4) != 0 || fread (ihdr, 1, 13, file) != 13)
+        return "PNG file is damaged";
+
+    int width = read_be (ihdr);
+    int height = read_be (ihdr + 4);
+    rows.depth = ihdr[8];
+    rows.color_type = ihdr[9];
+
+    if (width <= 0 || height <= 0 || ihdr[12] != 0)
+        return "interlaced PNG files can't be opened";
+
+    switch (rows.color_type)
+    {
+        case 0: rows.channels = 1; break;
+        case 2: rows.channels = 3; break;
+        case 3: rows.channels = 1; break;
+        case 4: rows.channels = 2; break;
+        case 6: rows.channels = 4; break;
+        default: return "PNG file is damaged";
+    }
+
+    import_set_size (import, width, height);
+
+    rows.import = &import;
+    rows.bytes_per_pixel = max (1, rows.channels * rows.depth / 8);
+    rows.stride = 1 + ((size_t) width * rows.channels * rows.depth + 7) / 8;
+    rows.current.assign (rows.stride, 0);
+    rows.previous.assign (rows.stride, 0);
+    rows.pixels.assign (width, 0);
+    rows.palette.assign (256, 0xFF000000);
+    rows.filled = 0;
+    rows.y = 0;
+
+    // Read chunks up to the first IDAT, picking up the palette and its transparency
+    fseek (file, 4, SEEK_CUR);
+    while (fread (header, 1, 8, file) == 8)
+    {
+        unsigned int length = read_be (header);
+
+        if (memcmp (header + 4, "IDAT", 4) == 0)
+        {
+            stream.file = file;
+            stream.chunk_left = length;
+            stream.bit_buffer = 0;
+            stream.bit_count = 0;
+            stream.ended = false;
+
+            return inflate_png (stream, rows);
+        }
+
+        vector<unsigned char> chunk (length);
+        if (fread (chunk.data(), 1, length, file) != length)
+            break;
+
+        if (memcmp (header + 4, "PLTE", 4) == 0)
+            for (unsigned int i = 0; i < length / 3 && i < 256; i++)
+                rows.palette[i] = 0xFF000000 | (chunk[i * 3] << 16) | (chunk[i * 3 + 1] << 8) | chunk[i * 3 + 2];
+
+        else if (memcmp (header + 4, "tRNS", 4) == 0 && rows.color_type == 3)
+            for (unsigned int i = 0; i < length && i < 256; i++)
+                rows.palette[i] = (rows.palette[i] & 0xFFFFFF) | (chunk[i] << 24);
+
+        fseek (file, 4, SEEK_CUR);
+    }
+
+    return "PNG file has no image data";
+}
+
+/**
+ * Decode job for an import. Decoding stops early once the job is cancelled.
+ *
+ * @param import    The import in progress
+ */
+void import_worker (image_import *import)
+{
+    FILE *file = fopen (import->path.c_str(), "rb");
+    string error = "could not open file";
+    unsigned char magic[2] = { 0, 0 };
+
+    if (file != nullptr)
+    {
+        fread (magic, 1, 2, file);
+        rewind (file);
+
+        if (magic[0] == 'B' && magic[1] == 'M')
+            error = decode_bmp (*import, file);
+        else
+            error = decode_png (*import, file);
+
+        fclose (file);
+    }
+
+    lock_guard<mutex> guard (import->lock);
+    import->decoded = true;
+    import->failed = error != "";
+    import->error = error;
+}
+
+/**
+ * Read a whole PNG or BMP file into memory straight away, rather than drawing it in the
+ * background. Files bigger than the user image are scaled down to fit, as with an import.
+ *
+ * @param path      The file to be read
+ * @param result    Set to the pixels of the file, over white
+ *
+ * @returns         An error message, or an empty string on success
+ */
+string read_image_file (string path, pixel_buffer &result)
+{
+    image_import import;
+
+    import.path = path;
+    import.width = 0;
+    import.height = 0;
+    import_worker (&import);
+
+    if (import.failed)
+        return import.error;
+
+    result.width = import.width;
+    result.height = import.height;
+    result.pixels.swap (import.result);
+
+    return "";
+}
+
+/**
+ * Start opening a PNG or BMP file in place of the current image. The file is decoded in the
+ * background, and drawn over the following frames by import_pump.
+ *
+ * @param program   Struct containing program data
+ * @param path      The file to be opened, or an empty string for the default import file
+ */
+void start_import (program_data &program, string path)
+{
+    if (program.import != nullptr)
+        cancel_import (program);
+
+    image_import *import = new image_import;
+
+    import->path = path == "" ? IMPORT_FILE : path;
+    import->width = 0;
+    import->height = 0;
+    import->size_ready = false;
+    import->decoded = false;
+    import->failed = false;
+    import->next_refine_row = 0;
+    import->worker = submit_job ([import]() { import_worker (import); }, {});
+
+    program.import = import;
+    clear_bitmap (program.to_draw, COLOR_WHITE);
+}
+
+/**
+ * Stop an import in progress, leaving whatever has been drawn so far
+ *
+ * @param program   Struct containing program data
+ */
+void cancel_import (program_data &program)
+{
+    image_import *import = program.import;
+
+    if (import == nullptr)
+        return;
+
+    cancel_job (import->worker);
+    wait_for_job (import->worker);
+    delete import;
+    program.import = nullptr;
+
+    // The image no longer matches the history, so start a new one from what is there
+    journal_reset (program.journal);
+    init_history (program);
+    init_document (program.document);
+    init_canvas_cache (program.canvas);
+}
+
+/**
+ * Draw newly decoded rows of an import. Each band of rows is first drawn as coarse blocks
+ * as soon as it is finished, then redrawn at full detail a few rows per frame, so drawing
+ * never holds up the rest of the program.
+ *
+ * @param program   Struct containing program data
+ */
+void import_pump (program_data &program)
+{
+    image_import *import = program.import;
+    vector<int> finished;
+    bool size_ready, decoded, failed;
+    string error;
+
+    if (import == nullptr)
+        return;
+
+    {
+        lock_guard<mutex> guard (import->lock);
+        finished.swap (import->finished_rows);
+        size_ready = import->size_ready;
+        decoded = import->decoded;
+        failed = import->failed;
+        error = import->error;
+    }
+
+    if (failed)
+    {
+        write_line ("Could not open " + import->path + ": " + error);
+        cancel_import (program);
+        return;
+    }
+
+    if (not size_ready)
+        return;
+
+    int band_count = (import->height + PREVIEW_BLOCK - 1) / PREVIEW_BLOCK;
+    if (import->row_ready.size() == 0)
+    {
+        import->row_ready.assign (import->height, false);
+        import->band_previewed.assign (band_count, false);
+    }
+
+    for (int row : finished)
+        import->row_ready[row] = true;
+
+    // Coarse preview of every band whose rows are all decoded
+    for (int band = 0; band < band_count; band++)
+    {
+        int top = band * PREVIEW_BLOCK;
+        int bottom = min (top + PREVIEW_BLOCK, import->height);
+
+        if (import->band_previewed[band] || not all_of (import->row_ready.begin() + top, import->row_ready.begin() + bottom, [](bool b) { return b; }))
+            continue;
+
+        for (int left = 0; left < import->width; left += PREVIEW_BLOCK)
+        {
+            int right = min (left + PREVIEW_BLOCK, import->width);
+            unsigned int sums[3] = { 0, 0, 0 };
+
+            for (int y = top; y < bottom; y++)
+            {
+                for (int x = left; x < right; x++)
+                {
+                    unsigned int pixel = import->result[(size_t) y * import->width + x];
+                    sums[0] += (pixel >> 16) & 0xFF;
+                    sums[1] += (pixel >> 8) & 0xFF;
+                    sums[2] += pixel & 0xFF;
+                }
+            }
+
+            int count = (bottom - top) * (right - left);
+            fill_rectangle_on_bitmap (program.to_draw, rgba_color (sums[0] / count, sums[1] / count, sums[2] / count, 255), left, top, right - left, bottom - top);
+        }
+
+        import->band_previewed[band] = true;
+    }
+
+    // Full detail, in order from the top, a few rows per frame
+    pixel_buffer rows = new_pixel_buffer (import->width, 0);
+    int start = import->next_refine_row;
+
+    while (import->next_refine_row < import->height && import->next_refine_row - start < REFINE_ROWS_PER_FRAME
+           && import->band_previewed[import->next_refine_row / PREVIEW_BLOCK])
+        import->next_refine_row++;
+
+    if (import->next_refine_row > start)
+    {
+        rows.height = import->next_refine_row - start;
+        rows.pixels.assign (import->result.begin() + (size_t) start * import->width, import->result.begin() + (size_t) import->next_refine_row * import->width);
+        write_pixels (program.to_draw, rows, 0, start);
+    }
+
+    if (decoded && import->next_refine_row == import->height)
+    {
+        write_line ("Opened " + import->path);
+        cancel_import (program);
+    }
+}
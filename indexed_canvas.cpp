@@ -0,0 +1,479 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#define PALETTE_SIZE 24
+#define PI 3.14159
+#define INDEX_TILE 64
+
+using namespace std;
+
+/*  While the indexed canvas is enabled, every command is drawn into the 8 bit index buffer
+    here as well as by the tools, and the area it covers is then redrawn on the user image
+    from the indices. Checkpoints keep indices instead of bitmaps, so the image and its
+    history take a quarter of the memory, and fills compare indices rather than colors.
+    Outlines, ellipses, triangles and pen strokes take their pixels from SplashKit's own
+    drawing of the command, read back over the area it covers, so the redraw never moves
+    their edges. */
+
+/**
+ * Set up the indexed canvas, disabled, with the sidebar colors as its palette
+ *
+ * @param canvas    The indexed canvas
+ */
+void init_indexed_canvas (indexed_canvas &canvas)
+{
+    canvas.enabled = false;
+    canvas.scratch = nullptr;
+    canvas.pixels.clear();
+    canvas.palette.clear();
+
+    for (int i = 0; i < PALETTE_SIZE; i++)
+        canvas.palette.push_back (pack_color (sidebar_palette_color (i)));
+}
+
+/**
+ * Find the palette entry closest to a color
+ *
+ * @param canvas    The indexed canvas
+ * @param pixel     The color as a packed 0xAARRGGBB value
+ *
+ * @returns         The index of the closest palette entry
+ */
+int nearest_index (const indexed_canvas &canvas, unsigned int pixel)
+{
+    int result = 0;
+    int best = 1 << 30;
+
+    for (size_t i = 0; i < canvas.palette.size(); i++)
+    {
+        int dr = (int) ((pixel >> 16) & 0xFF) - (int) ((canvas.palette[i] >> 16) & 0xFF);
+        int dg = (int) ((pixel >> 8) & 0xFF) - (int) ((canvas.palette[i] >> 8) & 0xFF);
+        int db = (int) (pixel & 0xFF) - (int) (canvas.palette[i] & 0xFF);
+        int distance = dr * dr + dg * dg + db * db;
+
+        if (distance < best)
+        {
+            best = distance;
+            result = i;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Set one index, ignoring positions off the image
+ */
+void set_index (indexed_canvas &canvas, int x, int y, unsigned char index)
+{
+    if (x >= 0 && y >= 0 && x < IMAGE_WIDTH && y < HEIGHT)
+        canvas.pixels[y * IMAGE_WIDTH + x] = index;
+}
+
+/**
+ * Fill a rectangle of indices. The width and height may be negative, as they are when a
+ * shape is dragged up or left.
+ *
+ * @param canvas    The indexed canvas
+ * @param index     The palette index to fill with
+ * @param x         x position of the rectangle
+ * @param y         y position of the rectangle
+ * @param width     Width of the rectangle
+ * @param height    Height of the rectangle
+ */
+void index_rectangle (indexed_canvas &canvas, unsigned char index, double x, double y, double width, double height)
+{
+    int left = max ((int) floor (min (x, x + width)), 0);
+    int top = max ((int) floor (min (y, y + height)), 0);
+    int right = min ((int) floor (max (x, x + width)), IMAGE_WIDTH);
+    int bottom = min ((int) floor (max (y, y + height)), HEIGHT);
+
+    for (int j = top; j < bottom && left < right; j++)
+        fill (canvas.pixels.begin() + j * IMAGE_WIDTH + left, canvas.pixels.begin() + j * IMAGE_WIDTH + right, index);
+}
+
+/**
+ * Set the indices of the pixels a shape or pen stroke covers. The command is drawn by
+ * SplashKit on a transparent scratch bitmap and the area it covers is read back, so the
+ * indices match exactly what the tools draw on the user image.
+ *
+ * @param canvas    The indexed canvas
+ * @param index     The palette index to draw with
+ * @param command   The command to be drawn
+ */
+void index_drawn (indexed_canvas &canvas, unsigned char index, const tool_command &command)
+{
+    rectangle area = command_bounds (command);
+    int left = max ((int) floor (area.x), 0);
+    int top = max ((int) floor (area.y), 0);
+    int right = min ((int) ceil (area.x + area.width), IMAGE_WIDTH);
+    int bottom = min ((int) ceil (area.y + area.height), HEIGHT);
+
+    if (right <= left || bottom <= top)
+        return;
+
+    if (canvas.scratch == nullptr)
+        canvas.scratch = create_bitmap ("index_scratch", IMAGE_WIDTH, HEIGHT);
+
+    clear_bitmap (canvas.scratch, rgba_color (0, 0, 0, 0));
+    apply_command (canvas.scratch, command);
+    pixel_buffer drawn = read_pixels (canvas.scratch, left, top, right - left, bottom - top);
+
+    for (int j = 0; j < drawn.height; j++)
+        for (int i = 0; i < drawn.width; i++)
+            if (drawn.pixels[j * drawn.width + i] >> 24 != 0)
+                canvas.pixels[(top + j) * IMAGE_WIDTH + left + i] = index;
+}
+
+/**
+ * Replace every pixel whose palette color is within a tolerance of the color at a point.
+ * Which entries match is worked out once, so the scan only looks each index up in a table.
+ *
+ * @param canvas        The indexed canvas
+ * @param index         The palette index to replace with
+ * @param x             x position of the pixel whose color is replaced
+ * @param y             y position of the pixel whose color is replaced
+ * @param tolerance     Largest difference in any channel, from 0 to 255, that still matches
+ *
+ * @returns             Bounds of the tiles that had pixels replaced, with no size if none did
+ */
+rectangle index_replace (indexed_canvas &canvas, unsigned char index, int x, int y, int tolerance)
+{
+    int tiles_x = (IMAGE_WIDTH + INDEX_TILE - 1) / INDEX_TILE;
+    int tiles_y = (HEIGHT + INDEX_TILE - 1) / INDEX_TILE;
+    vector<char> touched (tiles_x * tiles_y, 0);
+    unsigned char replaced[256] = { 0 };
+
+    if (x < 0 || y < 0 || x >= IMAGE_WIDTH || y >= HEIGHT)
+        return rectangle_from (0, 0, 0, 0);
+
+    unsigned int target = canvas.palette[canvas.pixels[y * IMAGE_WIDTH + x]];
+    for (size_t i = 0; i < canvas.palette.size(); i++)
+    {
+        unsigned int entry = canvas.palette[i];
+        int difference = max (max (abs ((int) ((entry >> 16) & 0xff) - (int) ((target >> 16) & 0xff)),
+                                   abs ((int) ((entry >> 8) & 0xff) - (int) ((target >> 8) & 0xff))),
+                              abs ((int) (entry & 0xff) - (int) (target & 0xff)));
+        replaced[i] = difference <= tolerance;
+    }
+
+    parallel_tiles (IMAGE_WIDTH, HEIGHT, INDEX_TILE, [&] (int left, int top, int width, int height)
+    {
+        int matches = 0;
+
+        for (int j = top; j < top + height; j++)
+        {
+            unsigned char *row = &canvas.pixels[j * IMAGE_WIDTH + left];
+
+            for (int i = 0; i < width; i++)
+            {
+                int match = replaced[row[i]];
+                row[i] = match ? index : row[i];
+                matches += match;
+            }
+        }
+
+        touched[(top / INDEX_TILE) * tiles_x + left / INDEX_TILE] = matches > 0;
+    });
+
+    return touched_bounds (touched, tiles_x, INDEX_TILE, IMAGE_WIDTH, HEIGHT);
+}
+
+/**
+ * Replace the contiguous area of one index around a point with another index
+ *
+ * @param canvas    The indexed canvas
+ * @param index     The palette index to fill with
+ * @param x         x position to start filling from
+ * @param y         y position to start filling from
+ */
+void index_fill (indexed_canvas &canvas, unsigned char index, int x, int y)
+{
+    if (x < 0 || y < 0 || x >= IMAGE_WIDTH || y >= HEIGHT)
+        return;
+
+    vector<unsigned char> &pixels = canvas.pixels;
+    unsigned char target = pixels[y * IMAGE_WIDTH + x];
+    vector<point_2d> stack;
+
+    if (target == index)
+        return;
+
+    stack.push_back (point_2d { (double) x, (double) y });
+
+    while (stack.size() > 0)
+    {
+        int row = stack.back().y;
+        int left = stack.back().x, right = left;
+        unsigned char *line = &pixels[row * IMAGE_WIDTH];
+        stack.pop_back();
+
+        if (line[left] != target)
+            continue;
+
+        while (left > 0 && line[left - 1] == target)
+            left--;
+        while (right < IMAGE_WIDTH - 1 && line[right + 1] == target)
+            right++;
+
+        fill (line + left, line + right + 1, index);
+
+        // Queue one point for each run of the target index in the rows above and below
+        for (int next_row = row - 1; next_row <= row + 1; next_row += 2)
+        {
+            if (next_row < 0 || next_row >= HEIGHT)
+                continue;
+
+            const unsigned char *next = &pixels[next_row * IMAGE_WIDTH];
+            for (int i = left; i <= right; i++)
+                if (next[i] == target && (i == left || next[i - 1] != target))
+                    stack.push_back (point_2d { (double) i, (double) next_row });
+        }
+    }
+}
+
+/**
+ * Move, scale and rotate an area of indices the way the select tool does, taking the
+ * nearest index rather than blending, since indices can't be mixed
+ *
+ * @param canvas    The indexed canvas
+ * @param v         The select command values
+ */
+void index_selection (indexed_canvas &canvas, const vector<double> &v)
+{
+    int source_x = floor (v[0]), source_y = floor (v[1]);
+    int width = v[2], height = v[3];
+    unsigned char white = nearest_index (canvas, pack_color (COLOR_WHITE));
+    vector<int> source (max (width * height, 0), -1);
+
+    if (width <= 0 || height <= 0)
+        return;
+
+    // Cut the area out, leaving white behind, as draw_selection does
+    for (int j = 0; j < height; j++)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            int x = source_x + i, y = source_y + j;
+
+            if (x >= 0 && y >= 0 && x < IMAGE_WIDTH && y < HEIGHT)
+            {
+                source[j * width + i] = canvas.pixels[y * IMAGE_WIDTH + x];
+                canvas.pixels[y * IMAGE_WIDTH + x] = white;
+            }
+        }
+    }
+
+    double centre_x = v[4] + width / 2.0, centre_y = v[5] + height / 2.0;
+    double cos_a = cos (v[8] * PI / 180), sin_a = sin (v[8] * PI / 180);
+    double half_width = fabs (width * v[6] * cos_a) / 2 + fabs (height * v[7] * sin_a) / 2;
+    double half_height = fabs (width * v[6] * sin_a) / 2 + fabs (height * v[7] * cos_a) / 2;
+
+    for (int y = max ((int) floor (centre_y - half_height), 0); y < min ((int) ceil (centre_y + half_height), HEIGHT); y++)
+    {
+        for (int x = max ((int) floor (centre_x - half_width), 0); x < min ((int) ceil (centre_x + half_width), IMAGE_WIDTH); x++)
+        {
+            double dx = x + 0.5 - centre_x, dy = y + 0.5 - centre_y;
+            int u = floor ((dx * cos_a + dy * sin_a) / v[6] + width / 2.0);
+            int w = floor ((dy * cos_a - dx * sin_a) / v[7] + height / 2.0);
+
+            if (u >= 0 && w >= 0 && u < width && w < height && source[w * width + u] >= 0)
+                canvas.pixels[y * IMAGE_WIDTH + x] = source[w * width + u];
+        }
+    }
+}
+
+/**
+ * Draw a recorded command into the indexed canvas. Given the same indices and palette, this
+ * always gives the same result.
+ *
+ * @param canvas    The indexed canvas
+ * @param command   The command to be drawn
+ */
+void apply_indexed_command (indexed_canvas &canvas, const tool_command &command)
+{
+    const vector<point_2d> &p = command.points;
+    const vector<double> &v = command.values;
+    unsigned char index = nearest_index (canvas, pack_color (command.draw_color));
+    unsigned int state = command.seed;
+
+    switch (command.mode)
+    {
+        case ERASER:   index = nearest_index (canvas, pack_color (COLOR_WHITE));
+                       for (point_2d point : p)
+                           index_rectangle (canvas, index, point.x, point.y, 10, 10);
+                       break;
+        case PEN:      index_drawn (canvas, index, command);
+                       break;
+        case SPRAY:    for (point_2d point : p)
+                           for (point_2d pixel : spray_pixels (point.x, point.y, state, 1))
+                               set_index (canvas, pixel.x, pixel.y, index);
+                       break;
+        case DRAW_REC: index_drawn (canvas, index, command);
+                       break;
+        case FILL_REC: index_rectangle (canvas, index, v[0], v[1], v[2], v[3]);
+                       break;
+        // Outlines, ellipses and triangles are rasterised by SplashKit, since its edges can't be
+        // matched reliably here
+        case DRAW_ELL:
+        case FILL_ELL:
+        case DRAW_TRI:
+        case FILL_TRI: index_drawn (canvas, index, command);
+                       break;
+        case SELECT:   index_selection (canvas, v);
+                       break;
+        case FILL:     // Replacing all also has a tolerance and the area it changed
+                       if (v.size() > 0)
+                           index_replace (canvas, index, p[0].x, p[0].y, v[0]);
+                       else
+                           index_fill (canvas, index, floor (p[0].x), floor (p[0].y));
+                       break;
+        case FILTER:
+        case STYLED_FILL:
+        case SMUDGE:
+        case BLUR_BRUSH:
+        case CLONE:
+        {
+            // Filters, gradients and sampling brushes work on colors, so expand the area and take
+            // the nearest entry afterwards
+            int offset = command.mode == FILTER ? 0 : 2;
+            rectangle area = command.mode == FILTER || command.mode == STYLED_FILL ?
+                             rectangle_from (v[offset], v[offset + 1], v[offset + 2], v[offset + 3]) : brush_read_area (command);
+            int x = area.x, y = area.y;
+            pixel_buffer pixels = new_pixel_buffer (area.width, area.height);
+
+            for (int j = 0; j < pixels.height; j++)
+                for (int i = 0; i < pixels.width; i++)
+                    pixels.pixels[j * pixels.width + i] = canvas.palette[canvas.pixels[(y + j) * IMAGE_WIDTH + x + i]];
+
+            if (command.mode == FILTER)
+                apply_filter (pixels, (filter_type) v[4], v[5], v[6], 1);
+            else if (command.mode == STYLED_FILL)
+                styled_fill (pixels, x, y, command);
+            else
+                brush_stroke (pixels, x, y, command);
+
+            parallel_tiles (pixels.width, pixels.height, INDEX_TILE, [&](int tile_x, int tile_y, int tile_width, int tile_height)
+            {
+                for (int j = tile_y; j < tile_y + tile_height; j++)
+                    for (int i = tile_x; i < tile_x + tile_width; i++)
+                        canvas.pixels[(y + j) * IMAGE_WIDTH + x + i] = nearest_index (canvas, pixels.pixels[j * pixels.width + i]);
+            });
+            break;
+        }
+        case VECTOR:
+        {
+            // The vector layer redrew the area in color, so take the nearest entries
+            pixel_buffer pixels = vector_edit_pixels (command);
+
+            for (int j = 0; j < pixels.height; j++)
+                for (int i = 0; i < pixels.width; i++)
+                    set_index (canvas, v[4] + i, v[5] + j, nearest_index (canvas, pixels.pixels[j * pixels.width + i]));
+            break;
+        }
+        case PALETTE:  // values are the palette entry and its new packed color
+                       canvas.palette[(int) v[0]] = (unsigned int) v[1];
+                       break;
+        case NONE:     break;
+    }
+}
+
+/**
+ * Redraw an area of the user image from the indexed canvas
+ *
+ * @param program   Struct containing program data
+ * @param area      The area to be redrawn
+ */
+void present_indexed (program_data &program, rectangle area)
+{
+    indexed_canvas &canvas = program.indexed;
+    int left = max ((int) floor (area.x), 0);
+    int top = max ((int) floor (area.y), 0);
+    int right = min ((int) ceil (area.x + area.width), IMAGE_WIDTH);
+    int bottom = min ((int) ceil (area.y + area.height), HEIGHT);
+
+    if (right <= left || bottom <= top)
+        return;
+
+    pixel_buffer pixels = new_pixel_buffer (right - left, bottom - top);
+
+    for (int j = 0; j < pixels.height; j++)
+        for (int i = 0; i < pixels.width; i++)
+            pixels.pixels[j * pixels.width + i] = canvas.palette[canvas.pixels[(top + j) * IMAGE_WIDTH + left + i]];
+
+    write_pixels (program.to_draw, pixels, left, top);
+}
+
+/**
+ * Turn the indexed canvas on or off. Turning it on maps every pixel of the image to the
+ * nearest palette entry. The history can't be replayed across the change, so a new one
+ * is started from the image as it is.
+ *
+ * @param program   Struct containing program data
+ * @param enabled   True to use the indexed canvas
+ */
+void set_indexed_mode (program_data &program, bool enabled)
+{
+    indexed_canvas &canvas = program.indexed;
+    rectangle whole = { 0, 0, IMAGE_WIDTH, HEIGHT };
+
+    if (canvas.enabled == enabled)
+        return;
+
+    // The vector layer redraws shapes in color, so it can't be kept while the canvas is indexed
+    if (enabled && program.vectors.enabled)
+        set_vector_mode (program, false);
+
+    if (enabled)
+    {
+        pixel_buffer pixels = read_pixels (program.to_draw, 0, 0, IMAGE_WIDTH, HEIGHT);
+
+        canvas.pixels.assign (IMAGE_WIDTH * HEIGHT, 0);
+        parallel_tiles (IMAGE_WIDTH, HEIGHT, INDEX_TILE, [&](int tile_x, int tile_y, int tile_width, int tile_height)
+        {
+            for (int j = tile_y; j < tile_y + tile_height; j++)
+                for (int i = tile_x; i < tile_x + tile_width; i++)
+                    canvas.pixels[j * IMAGE_WIDTH + i] = nearest_index (canvas, pixels.pixels[j * IMAGE_WIDTH + i]);
+        });
+
+        canvas.enabled = true;
+        present_indexed (program, whole);
+    }
+    else
+    {
+        canvas.enabled = false;
+        vector<unsigned char>().swap (canvas.pixels);
+    }
+
+    journal_reset (program.journal);
+    init_history (program);
+    mark_dirty (program.document, whole);
+    init_canvas_cache (program.canvas);
+
+    write_line (enabled ? "Indexed color mode on" : "Indexed color mode off");
+}
+
+/**
+ * Change a palette entry. With the indexed canvas enabled this recolors every pixel using
+ * that entry, as a command that can be undone. Otherwise only the sidebar box changes.
+ *
+ * @param program   Struct containing program data
+ * @param entry     The palette entry to be changed
+ * @param new_color The new color of the entry
+ */
+void edit_palette (program_data &program, int entry, color new_color)
+{
+    if (not program.indexed.enabled)
+    {
+        program.indexed.palette[entry] = pack_color (new_color);
+        return;
+    }
+
+    tool_command command = new_command (program);
+
+    command.mode = PALETTE;
+    command.values = { (double) entry, (double) pack_color (new_color) };
+    record_command (program, command);
+}
@@ -0,0 +1,86 @@
+#include "graphic_creator.h"
+
+// Milliseconds between refreshes of the window while a tool is in use
+#define FRAME_INTERVAL 16
+
+using namespace std;
+
+/*  Tools poll input about once a millisecond but only refresh the window once a frame, so
+    most polls aren't held up by drawing to the window. Each poll gives the tool one
+    timestamped sample, which it draws before checking whether a frame is due. SplashKit
+    events can only be polled on the thread that opened the window, so sampling happens
+    on that thread too, between frames, and a slow frame still delays the next poll. The
+    points missed meanwhile are filled in along the stroke by extend_stroke. */
+
+struct input_timing
+{
+    unsigned int last_sample;
+    unsigned int last_frame;
+};
+
+/**
+ * Set up the timing of input samples and frames
+ *
+ * @param program   Struct containing program data
+ */
+void init_input (program_data &program)
+{
+    program.input = new input_timing;
+    program.input->last_sample = 0;
+    program.input->last_frame = 0;
+}
+
+/**
+ * Poll for events and take the mouse state. If a sample was already taken this millisecond
+ * it waits for the next one first, so a tool loop doesn't spin.
+ *
+ * @param program   Struct containing program data
+ *
+ * @returns         The sample
+ */
+input_sample sample_input (program_data &program)
+{
+    input_timing &timing = *program.input;
+    input_sample sample;
+
+    if (current_ticks() == timing.last_sample)
+        delay (1);
+
+    process_events();
+
+    sample.position = mouse_position();
+    sample.left_down = mouse_down (LEFT_BUTTON);
+    sample.time = current_ticks();
+    timing.last_sample = sample.time;
+
+    return sample;
+}
+
+/**
+ * Check whether it is time for a tool to refresh the window again
+ *
+ * @param program   Struct containing program data
+ *
+ * @returns         True if a frame is due
+ */
+bool frame_due (program_data &program)
+{
+    return current_ticks() - program.input->last_frame >= FRAME_INTERVAL;
+}
+
+/**
+ * Copy the user image to the window and refresh it, if a frame is due. Tools call this
+ * after every sample, so the window is only drawn once for all the samples of a frame.
+ *
+ * @param program   Struct containing program data
+ */
+void present_frame (program_data &program)
+{
+    if (not frame_due (program))
+        return;
+
+    program.input->last_frame = current_ticks();
+    queue_bitmap (program.the_window, program.to_draw, 0, 0);
+    draw_onion_skin (program);
+    flush_render (program.the_window);
+}
@@ -0,0 +1,378 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+/*  One pool of worker threads runs all background and parallel work. Each worker has its
+    own queue: it takes the newest job from the back of its own queue, and when that is
+    empty it steals the oldest job from the front of another worker's queue. A job only
+    goes on a queue once every job it was submitted after has finished. */
+
+struct job
+{
+    function<void ()> work;
+    atomic<int> waiting_for;
+    atomic<bool> cancelled;
+
+    // Guards finished and dependents
+    mutex lock;
+    bool finished;
+    vector<job_handle> dependents;
+};
+
+struct job_queue
+{
+    mutex lock;
+    deque<job_handle> jobs;
+};
+
+struct job_pool
+{
+    vector<thread> workers;
+    vector<job_queue> queues;
+    atomic<int> queued;
+    atomic<unsigned int> next_queue;
+    mutex sleep_lock;
+    condition_variable wake;
+    condition_variable job_done;
+    bool stopping;
+};
+
+static job_pool *pool = nullptr;
+static once_flag pool_started;
+
+// Which queue belongs to the current thread, and the job it is running
+static thread_local int worker_index = -1;
+static thread_local job *running_job = nullptr;
+
+void job_worker_loop (int index);
+
+/**
+ * Get the job pool, starting its workers the first time. The thread that submits work
+ * helps out while waiting for it, so there is one worker less than there are cores.
+ *
+ * @returns     The job pool
+ */
+job_pool &job_pool_instance()
+{
+    call_once (pool_started, []()
+    {
+        int count = max ((int) thread::hardware_concurrency() - 1, 1);
+
+        pool = new job_pool;
+        pool->queues = vector<job_queue> (count);
+        pool->queued = 0;
+        pool->next_queue = 0;
+        pool->stopping = false;
+
+        for (int i = 0; i < count; i++)
+            pool->workers.push_back (thread (job_worker_loop, i));
+    });
+
+    return *pool;
+}
+
+/**
+ * Put a job whose dependencies have all finished on a queue. Jobs submitted by a worker
+ * go on its own queue, and others are spread across the workers in turn.
+ *
+ * @param ready     The job to be queued
+ */
+void queue_job (job_handle ready)
+{
+    job_pool &jobs = job_pool_instance();
+    int index = worker_index >= 0 ? worker_index : jobs.next_queue++ % jobs.queues.size();
+
+    {
+        lock_guard<mutex> guard (jobs.queues[index].lock);
+        jobs.queues[index].jobs.push_back (ready);
+    }
+
+    jobs.queued++;
+
+    // Take the sleep lock so a worker can't miss the wake between checking and sleeping
+    lock_guard<mutex> guard (jobs.sleep_lock);
+    jobs.wake.notify_one();
+}
+
+/**
+ * Take a job off the queues. Own queue first, newest job first, then the oldest job from
+ * each other queue in turn.
+ *
+ * @param index     Queue belonging to the calling worker
+ *
+ * @returns         The job, or nullptr if every queue was empty
+ */
+job_handle take_job (int index)
+{
+    job_pool &jobs = job_pool_instance();
+    int count = jobs.queues.size();
+
+    for (int i = 0; i < count; i++)
+    {
+        job_queue &queue = jobs.queues[(index + i) % count];
+        lock_guard<mutex> guard (queue.lock);
+
+        if (queue.jobs.empty())
+            continue;
+
+        job_handle result;
+        if (i == 0)
+        {
+            result = queue.jobs.back();
+            queue.jobs.pop_back();
+        }
+        else
+        {
+            result = queue.jobs.front();
+            queue.jobs.pop_front();
+        }
+
+        jobs.queued--;
+        return result;
+    }
+
+    return nullptr;
+}
+
+/**
+ * Run a job, unless it was cancelled before it started, then queue any jobs that were only
+ * waiting for it. Cancelling a job also cancels everything submitted after it.
+ *
+ * @param current   The job to be run
+ */
+void run_job (job_handle current)
+{
+    job *outer = running_job;
+    vector<job_handle> dependents;
+
+    if (not current->cancelled)
+    {
+        running_job = current.get();
+        current->work();
+        running_job = outer;
+    }
+
+    {
+        lock_guard<mutex> guard (current->lock);
+        current->finished = true;
+        dependents.swap (current->dependents);
+    }
+
+    for (job_handle &dependent : dependents)
+    {
+        if (current->cancelled)
+            dependent->cancelled = true;
+
+        if (--dependent->waiting_for == 0)
+            queue_job (dependent);
+    }
+
+    job_pool &jobs = job_pool_instance();
+    lock_guard<mutex> guard (jobs.sleep_lock);
+    jobs.job_done.notify_all();
+}
+
+/**
+ * Worker thread. Runs jobs until the pool is stopped, sleeping while there are none.
+ *
+ * @param index     Queue belonging to this worker
+ */
+void job_worker_loop (int index)
+{
+    job_pool &jobs = *pool;
+
+    worker_index = index;
+
+    while (true)
+    {
+        job_handle next = take_job (index);
+
+        if (next != nullptr)
+        {
+            run_job (next);
+            continue;
+        }
+
+        unique_lock<mutex> guard (jobs.sleep_lock);
+        jobs.wake.wait (guard, [&]() { return jobs.stopping || jobs.queued > 0; });
+
+        if (jobs.stopping)
+            break;
+    }
+}
+
+/**
+ * Submit work to the job pool
+ *
+ * @param work      Function to be run on a worker
+ * @param after     Jobs that must finish before this one starts
+ *
+ * @returns         Handle for waiting on or cancelling the job
+ */
+job_handle submit_job (function<void ()> work, const vector<job_handle> &after)
+{
+    job_handle result = make_shared<job>();
+
+    result->work = work;
+    result->cancelled = false;
+    result->finished = false;
+
+    // Counts one extra until every dependency is registered, so none can queue it early
+    result->waiting_for = 1;
+
+    for (const job_handle &dependency : after)
+    {
+        lock_guard<mutex> guard (dependency->lock);
+
+        if (dependency->finished)
+        {
+            if (dependency->cancelled)
+                result->cancelled = true;
+            continue;
+        }
+
+        result->waiting_for++;
+        dependency->dependents.push_back (result);
+    }
+
+    if (--result->waiting_for == 0)
+        queue_job (result);
+
+    return result;
+}
+
+/**
+ * Cancel a job. A job that hasn't started yet is skipped, and a running job stops early
+ * if it checks job_cancelled.
+ *
+ * @param cancelled     The job to be cancelled
+ */
+void cancel_job (job_handle cancelled)
+{
+    if (cancelled != nullptr)
+        cancelled->cancelled = true;
+}
+
+/**
+ * Check whether the job the calling thread is running has been cancelled, for long jobs
+ * to stop early
+ *
+ * @returns     True if the current job has been cancelled
+ */
+bool job_cancelled()
+{
+    return running_job != nullptr && running_job->cancelled;
+}
+
+/**
+ * Check whether a job has finished, or been skipped after being cancelled
+ *
+ * @param current   The job to be checked
+ *
+ * @returns         True if the job has finished
+ */
+bool job_finished (job_handle current)
+{
+    lock_guard<mutex> guard (current->lock);
+    return current->finished;
+}
+
+/**
+ * Remove a particular job from whichever queue it is on, so a waiting thread can run it
+ * itself
+ *
+ * @param wanted    The job to be removed
+ *
+ * @returns         True if the job was queued and has been removed
+ */
+bool take_queued_job (job_handle wanted)
+{
+    job_pool &jobs = job_pool_instance();
+
+    for (job_queue &queue : jobs.queues)
+    {
+        lock_guard<mutex> guard (queue.lock);
+        auto found = find (queue.jobs.begin(), queue.jobs.end(), wanted);
+
+        if (found != queue.jobs.end())
+        {
+            queue.jobs.erase (found);
+            jobs.queued--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Wait for a job to finish. If it hasn't started yet the waiting thread runs it itself.
+ * Other queued jobs are left alone, so the window is never held up by unrelated long work.
+ *
+ * @param current   The job to be waited for
+ */
+void wait_for_job (job_handle current)
+{
+    job_pool &jobs = job_pool_instance();
+
+    if (take_queued_job (current))
+    {
+        run_job (current);
+        return;
+    }
+
+    unique_lock<mutex> guard (jobs.sleep_lock);
+    while (not job_finished (current))
+        jobs.job_done.wait_for (guard, chrono::milliseconds (1));
+}
+
+/**
+ * Call a function once for each number from 0 up to a count, spread across the job pool.
+ * The calling thread takes numbers too, so it returns once all of them are done.
+ *
+ * @param count     How many times the function is called
+ * @param work      Function called with each number
+ */
+void parallel_for (int count, function<void (int)> work)
+{
+    job_pool &jobs = job_pool_instance();
+    atomic<int> next (0);
+    vector<job_handle> helpers;
+
+    auto run_range = [&]()
+    {
+        for (int i = next++; i < count; i = next++)
+            work (i);
+    };
+
+    for (int i = 1; i < min ((int) jobs.queues.size() + 1, count); i++)
+        helpers.push_back (submit_job (run_range, {}));
+
+    run_range();
+
+    for (job_handle &helper : helpers)
+        wait_for_job (helper);
+}
+
+/**
+ * Stop the job pool, once the work already queued has finished
+ */
+void stop_jobs()
+{
+    if (pool == nullptr)
+        return;
+
+    {
+        lock_guard<mutex> guard (pool->sleep_lock);
+        pool->stopping = true;
+        pool->wake.notify_all();
+    }
+
+    for (thread &worker : pool->workers)
+        worker.join();
+}
@@ -12,9 +12,9 @@
  */
 void redraw_screen (window &the_window, bitmap &to_draw, vector<menu_item> &menu)
 {
-    draw_bitmap_on_window (the_window, to_draw, 0, 0);
+    queue_bitmap (the_window, to_draw, 0, 0);
     for (menu_item item: menu)
-        draw_bitmap_on_window (the_window, item.graphic, item.x, item.y);
+        queue_bitmap (the_window, item.graphic, item.x, item.y);
 }
 
 /**
@@ -27,7 +27,7 @@ void redraw_screen (window &the_window, bitmap &to_draw, vector<menu_item> &menu
 void draw_highlight (window &the_window, bitmap highlight, menu_item button)
 {
     draw_bitmap_on_bitmap (highlight, button.graphic, 4, 4);   
-    draw_bitmap_on_window (the_window, highlight, button.x - 3, button.y - 1);
+    queue_bitmap (the_window, highlight, button.x - 3, button.y - 1);
 }
 
 /**
@@ -180,7 +180,7 @@ void process_sub_menu (program_data &program, vector<menu_item> &menu, int radiu
         else if (mouse_clicked (LEFT_BUTTON))
             break;  
         
-        refresh_window (program.the_window);
+        flush_render (program.the_window);
     }
 }
 
@@ -262,7 +262,7 @@ void process_paint_menu (program_data &program, vector<menu_item> &menu, int rad
         else if (mouse_clicked (LEFT_BUTTON))
             break;
 
-        refresh_window (program.the_window);
+        flush_render (program.the_window);
     }
 }
 
@@ -291,13 +291,13 @@ void draw_menu(program_data &program, vector<menu_item>(create_menu)(double, dou
 
     while (separation < 5)
     {
-        draw_bitmap (program.to_draw, 0, 0);
+        queue_bitmap (program.the_window, program.to_draw, 0, 0);
         for (int i = 0; i < menu.size(); i++)
         {
-            draw_bitmap (menu[i].graphic, menu[i].x, menu[i].y);
+            queue_bitmap (program.the_window, menu[i].graphic, menu[i].x, menu[i].y);
             update_bitmap_pos (menu[i], i, menu.size());
         }     
-        refresh_window(program.the_window);
+        flush_render(program.the_window);
 
         // If the first 2 bitmaps in the menu are no longer colliding, increment the separation var
         if (not bitmap_collision (menu[0].graphic, menu[0].x, menu[0].y,
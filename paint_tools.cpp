@@ -1,13 +1,46 @@
 #include "graphic_creator.h"
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
 #include <list>
 
 #define SPRAY_PARTICLES 30
-#define RADIUS 20
+#define SPRAY_INTERVAL 16
+#define PEN_SPACING 2
+#define ERASER_SPACING 5
+#define REPLACE_TILE 64
 #define PI 3.14159
 
 using namespace std;
 
+/**
+ * Add points along a stroke up to a new position, at most a given distance apart, so a fast
+ * stroke is still drawn without gaps
+ *
+ * @param points    Points of the stroke so far, which the new points are added to
+ * @param to        The new position
+ * @param spacing   Largest distance between points
+ *
+ * @returns         How many points were added, 0 if the position hasn't changed
+ */
+int extend_stroke (vector<point_2d> &points, point_2d to, double spacing)
+{
+    if (points.size() == 0)
+    {
+        points.push_back (to);
+        return 1;
+    }
+
+    point_2d from = points.back();
+    double distance = sqrt ((to.x - from.x) * (to.x - from.x) + (to.y - from.y) * (to.y - from.y));
+    int steps = ceil (distance / spacing);
+
+    for (int i = 1; i <= steps; i++)
+        points.push_back (point_2d { from.x + (to.x - from.x) * i / steps, from.y + (to.y - from.y) * i / steps });
+
+    return steps;
+}
+
 /**
  * Eraser draw mode. Draws a white 10x10 square at the mouse location while left mouse is down.
  *
@@ -15,16 +48,22 @@ using namespace std;
  */
 void paint_eraser (program_data &program)
 {
-    add_to_undo (program);
-    wipe_redo (program.redo);
+    tool_command command = new_command (program);
+    bool drawing = true;
 
-    while (mouse_down (LEFT_BUTTON))
+    while (drawing)
     {
-        process_events();
-        fill_rectangle_on_bitmap (program.to_draw, COLOR_WHITE, mouse_x(), mouse_y(), 10, 10);
-        draw_bitmap_on_window (program.the_window, program.to_draw, 0, 0);
-        refresh_window (program.the_window);
+        input_sample sample = sample_input (program);
+        int added = extend_stroke (command.points, sample.position, ERASER_SPACING);
+
+        for (size_t i = command.points.size() - added; i < command.points.size(); i++)
+            fill_rectangle_on_bitmap (program.to_draw, COLOR_WHITE, command.points[i].x, command.points[i].y, 10, 10);
+        drawing = sample.left_down;
+
+        present_frame (program);
     }    
+
+    record_command (program, command);
 }
 
 /**
@@ -34,19 +73,64 @@ void paint_eraser (program_data &program)
  */
 void paint_pen (program_data &program)
 {
-    add_to_undo (program);
-    wipe_redo (program.redo);
+    tool_command command = new_command (program);
+    bool drawing = true;
 
-    while (mouse_down (LEFT_BUTTON))
+    while (drawing)
     {
-        process_events();
-        
-        fill_ellipse_on_bitmap (program.to_draw, program.active_color, mouse_x(), mouse_y(), 4, 4);
-        draw_bitmap_on_window (program.the_window, program.to_draw, 0, 0);
+        input_sample sample = sample_input (program);
+        int added = extend_stroke (command.points, sample.position, PEN_SPACING);
 
-        refresh_window (program.the_window);
+        for (size_t i = command.points.size() - added; i < command.points.size(); i++)
+            fill_ellipse_on_bitmap (program.to_draw, program.active_color, command.points[i].x, command.points[i].y, 4, 4);
+        drawing = sample.left_down;
+
+        present_frame (program);
     }
     
+    record_command (program, command);
+}
+
+/**
+ * Pick the 30 pixels one spray lands on, at random points within a radius of 20 of a given
+ * point. The random numbers come from a seeded generator, so the same state gives the same
+ * pixels. Every way of drawing a spray goes through here, so they all draw the same pixels.
+ *
+ * @param x         x position of the centre of the spray
+ * @param y         y position of the centre of the spray
+ * @param state     The random generator state
+ * @param scale     Size each pixel is drawn at, when drawing bigger than the image
+ *
+ * @returns         Top left corner of each pixel, multiplied by the scale
+ */
+vector<point_2d> spray_pixels (double x, double y, unsigned int &state, double scale)
+{
+    vector<point_2d> result;
+
+    for (int i = 0; i < SPRAY_PARTICLES; i++)
+    {
+        double angle = random_unit (state) * PI * 2;
+        double rad = random_unit (state) * SPRAY_RADIUS;
+
+        result.push_back (point_2d { floor (x + rad * cos (angle)) * scale, floor (y + rad * sin (angle)) * scale });
+    }
+
+    return result;
+}
+
+/**
+ * Draw one spray on a bitmap
+ *
+ * @param to_draw       The bitmap to be drawn to
+ * @param spray_color   The color of the pixels
+ * @param x             x position of the centre of the spray
+ * @param y             y position of the centre of the spray
+ * @param state         The random generator state
+ */
+void spray_particles (bitmap to_draw, color spray_color, double x, double y, unsigned int &state)
+{
+    for (point_2d pixel : spray_pixels (x, y, state, 1))
+        draw_pixel_on_bitmap (to_draw, spray_color, pixel.x, pixel.y);
 }
 
 /**
@@ -56,32 +140,32 @@ void paint_pen (program_data &program)
  */
 void paint_spray (program_data &program)
 {
-    double angle;
-    double rad;
-    double draw_x;
-    double draw_y;
+    tool_command command = new_command (program);
+    bool drawing = true;
+    unsigned int next_spray = 0;
+    unsigned int state;
 
-    add_to_undo (program);
-    wipe_redo (program.redo);
-    
-    while (mouse_down (LEFT_BUTTON))
+    // The seed is kept with the command, so that the spray can be replayed exactly
+    command.seed = rnd (1 << 30) + 1;
+    state = command.seed;
+
+    // Sprays once per interval of sample time, however often the mouse is sampled
+    while (drawing)
     {
-        process_events();
-    
-        draw_bitmap_on_window (program.the_window, program.to_draw, 0, 0);
+        input_sample sample = sample_input (program);
 
-        // Draw 30 pixels on the bitmap at random points within a radius of 20 of the mouse cursor
-        for (int i = 0; i < SPRAY_PARTICLES; i++)
+        if (sample.time >= next_spray)
         {
-            angle = rnd() * PI * 2;
-            rad = rnd() * RADIUS;
-            draw_x = mouse_x() + rad * cos (angle);
-            draw_y = mouse_y() + rad * sin (angle);
-       
-            draw_pixel_on_bitmap (program.to_draw, program.active_color, draw_x, draw_y);
+            command.points.push_back (sample.position);
+            spray_particles (program.to_draw, program.active_color, sample.position.x, sample.position.y, state);
+            next_spray = sample.time + SPRAY_INTERVAL;
         }
-        refresh_screen();
+        drawing = sample.left_down;
+
+        present_frame (program);
     }
+
+    record_command (program, command);
 }
 
 /**
@@ -94,12 +178,10 @@ void paint_spray (program_data &program)
 void paint_rec_ell (program_data &program, void (draw_rec_ell_to_win) (window, color, double, double, double, double), 
                     void (draw_rec_ell_to_bitmap) (bitmap, color, double, double, double, double))
 {
-    double width, height;
+    double width = 0, height = 0;
     double x = mouse_x();
     double y = mouse_y();
-
-    add_to_undo (program);
-    wipe_redo (program.redo);
+    tool_command command = new_command (program);
 
     /*  Draw the current user image to the window, draw a rectangle/ellipse on the window
         whose size is defined by interaction via the mouse, then refresh the window. Looping this 
@@ -109,7 +191,7 @@ void paint_rec_ell (program_data &program, void (draw_rec_ell_to_win) (window, c
     {
         process_events();    
 
-        draw_bitmap_on_window (program.the_window, program.to_draw, 0, 0);
+        queue_bitmap (program.the_window, program.to_draw, 0, 0);
            
         width = mouse_x() - x;
         height = mouse_y() - y;
@@ -120,10 +202,13 @@ void paint_rec_ell (program_data &program, void (draw_rec_ell_to_win) (window, c
         else
             draw_rec_ell_to_win (program.the_window, program.active_color, x, y, 800-x, height);
 
-        refresh_window(program.the_window);
+        flush_render(program.the_window);
     }
 
     draw_rec_ell_to_bitmap (program.to_draw, program.active_color, x, y, width, height);
+
+    command.values = { x, y, width, height };
+    record_command (program, command);
 }
 
 /**
@@ -138,11 +223,8 @@ void paint_tri (program_data &program, void (draw_tri_to_win) (window, color, do
 {
     double x = mouse_x();
     double y = mouse_y();
-
-    bitmap temp = create_bitmap ("temp", 800, 600);
-
-    add_to_undo (program);
-    wipe_redo (program.redo);
+    point_2d corners[3];
+    tool_command command = new_command (program);
 
     /*  Draw the current user image to the window, draw a triangle on the window
         whose size is defined by interaction via the mouse, then refresh the window. Looping this 
@@ -152,30 +234,43 @@ void paint_tri (program_data &program, void (draw_tri_to_win) (window, color, do
     {
         process_events();    
         
-        draw_bitmap_on_bitmap (temp, program.to_draw, 0, 0);
-        draw_bitmap_on_window (program.the_window, program.to_draw, 0, 0);
+        queue_bitmap (program.the_window, program.to_draw, 0, 0);
+
+        corners[1].x = x;
+        corners[1].y = y;
 
         // Ensure triangle does not overlap sidebar
         if (mouse_x() < 800 && x-(mouse_x()-x) < 800)
         {
-            draw_tri_to_win (program.the_window, program.active_color, x-(mouse_x()-x), mouse_y(), x, y, mouse_x(), mouse_y());
-            draw_tri_to_bitmap (temp, program.active_color, x-(mouse_x()-x), mouse_y(), x, y, mouse_x(), mouse_y());
+            corners[0].x = x-(mouse_x()-x);
+            corners[2].x = mouse_x();
         }
 
         else if (x-(mouse_x()-x) < 800)
         {
-            draw_tri_to_win (program.the_window, program.active_color, x-(mouse_x()-x), mouse_y(), x, y, 799, mouse_y());
-            draw_tri_to_bitmap (temp, program.active_color, x-(mouse_x()-x), mouse_y(), x, y, 799, mouse_y());
+            corners[0].x = x-(mouse_x()-x);
+            corners[2].x = 799;
         }
         else
         {
-            draw_tri_to_win (program.the_window, program.active_color, 799, mouse_y(), x, y, x-(799-x), mouse_y());
-            draw_tri_to_bitmap (temp, program.active_color, 799, mouse_y(), x, y, x-(799-x), mouse_y());
+            corners[0].x = 799;
+            corners[2].x = x-(799-x);
         }
-        refresh_window(program.the_window);
+        corners[0].y = mouse_y();
+        corners[2].y = mouse_y();
+
+        draw_tri_to_win (program.the_window, program.active_color, corners[0].x, corners[0].y, corners[1].x, corners[1].y, corners[2].x, corners[2].y);
+        flush_render(program.the_window);
+
+        command.points.assign (corners, corners + 3);
     }
 
-    draw_bitmap_on_bitmap (program.to_draw, temp, 0, 0);
+    // Nothing is drawn if the mouse was released straight away
+    if (command.points.size() == 3)
+    {
+        draw_tri_to_bitmap (program.to_draw, program.active_color, corners[0].x, corners[0].y, corners[1].x, corners[1].y, corners[2].x, corners[2].y);
+        record_command (program, command);
+    }
 }
 
 /**
@@ -211,12 +306,15 @@ bitmap draw_selection (bitmap &to_draw, double x, double y, double width, double
  * @param program    Struct containing program data
  *
  * @returns          A struct containing the selected area as a bitmap, and the coordinates relative to the main image.
+ *                   The bitmap is null if the area has no width or height.
  */          
 select_tool_data select_area (program_data &program)
 {
     double x, y;
     select_tool_data result;
     double width, height;
+
+    result.graphic = nullptr;
     
     while (! mouse_down (LEFT_BUTTON))
         process_events();
@@ -228,18 +326,18 @@ select_tool_data select_area (program_data &program)
     {
         process_events();    
     
-        draw_bitmap_on_window (program.the_window, program.to_draw, 0, 0);
+        queue_bitmap (program.the_window, program.to_draw, 0, 0);
                
         width = mouse_x() - x;
         height = mouse_y() - y;
     
         // Ensure shape drawn does not overlap sidebar
         if (mouse_x() < 800)
-            draw_rectangle_on_window (program.the_window, program.active_color, x, y, width, height);
+            queue_rectangle (program.the_window, program.active_color, x, y, width, height);
         else
-            draw_rectangle_on_window (program.the_window, program.active_color, x, y, 800-x, height);
+            queue_rectangle (program.the_window, program.active_color, x, y, 800-x, height);
     
-        refresh_window(program.the_window);
+        flush_render(program.the_window);
     }
     
     if (mouse_x() > x && mouse_y() > y)
@@ -276,81 +374,97 @@ select_tool_data select_area (program_data &program)
         result.y = mouse_y();
     } 
 
-    draw_bitmap_on_window (program.the_window, program.to_draw, 0, 0);
-    draw_bitmap_on_window (program.the_window, result.graphic, result.x, result.y);
-    refresh_window (program.the_window);
+    result.scale_x = 1;
+    result.scale_y = 1;
+    result.angle = 0;
+
+    queue_bitmap (program.the_window, program.to_draw, 0, 0);
+    if (result.graphic != nullptr)
+        queue_bitmap (program.the_window, result.graphic, result.x, result.y);
+    flush_render (program.the_window);
 
     return result;
 }
 
 /**
- * Main module for the selection and moving of an area of the user image.
+ * Main module for the selection, moving, scaling and rotating of an area of the user image.
+ * The selected area stays active until the user clicks outside of it.
  *
  * @param program    Struct containing program data
  */
 void select_tool (program_data &program)
 {
-    add_to_undo (program);
-    wipe_redo (program.redo);
-
     select_tool_data selection;
-    double last_x, last_y;
+    tool_command command = new_command (program);
+    rectangle bounds;
+    bool filter = false, styled_fill = false;
 
-    // Get area of image to be moved
-    selection = select_area (program);    
-    
-    // Wait for the user to interact
-    while (! mouse_down (LEFT_BUTTON))
-        process_events();
-    
-    last_x = mouse_x();
-    last_y = mouse_y();
+    // Get area of image to be moved, doing nothing if the drag had no width or height
+    selection = select_area (program);
+    if (selection.graphic == nullptr)
+        return;
 
-    // Move selected area over the main image while left mouse is held down
-    while (mouse_down (LEFT_BUTTON))
+    command.values = { selection.x, selection.y, (double) bitmap_width (selection.graphic), (double) bitmap_height (selection.graphic) };
+    
+    do
     {
-        process_events();
-
-        selection.x += mouse_x() - last_x;
-        selection.y += mouse_y() - last_y;
+        queue_bitmap (program.the_window, program.to_draw, 0, 0);
+        draw_transformed_selection (program.the_window, selection);
+        flush_render (program.the_window);
 
-        last_x = mouse_x();
-        last_y = mouse_y();
+        // Wait for the user to interact, or to ask for the selection to be filtered or filled
+        while (! mouse_down (LEFT_BUTTON) && ! filter && ! styled_fill)
+        {
+            process_events();
+            filter = (key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && key_typed (F_KEY);
+            styled_fill = (key_down (LEFT_CTRL_KEY) || key_down (RIGHT_CTRL_KEY)) && key_typed (G_KEY);
+        }
+    }
+    while (! filter && ! styled_fill && transform_selection (program, selection));
 
-        draw_bitmap_on_window (program.the_window, program.to_draw, 0, 0);
-        draw_bitmap_on_window (program.the_window, selection.graphic, selection.x, selection.y);
-        draw_sidebar (program.the_window, program.active_color);
+    command.values.insert (command.values.end(), { selection.x, selection.y, selection.scale_x, selection.scale_y, selection.angle });
+    bounds = selection_bounds (selection);
+    commit_selection (program.to_draw, selection);
+    record_command (program, command);
 
-        refresh_window (program.the_window);
+    if (filter)
+        filter_tool (program, bounds);
 
+    // Clip to the image, since a transformed selection can hang over the edge
+    if (styled_fill)
+    {
+        double right = min (bounds.x + bounds.width, (double) IMAGE_WIDTH), bottom = min (bounds.y + bounds.height, (double) HEIGHT);
+        bounds.x = max (floor (bounds.x), 0.0);
+        bounds.y = max (floor (bounds.y), 0.0);
+        styled_fill_tool (program, rectangle_from (bounds.x, bounds.y, floor (right) - bounds.x, floor (bottom) - bounds.y));
     }
-    draw_bitmap_on_bitmap (program.to_draw, selection.graphic, selection.x, selection.y);    
 }
 
 /**
  * Fills an enclosed area on the user image with a selected color. 
  *
- * @param program    Struct containing program data
- * @param target     Target color being replaced
+ * @param to_draw       The main user image
+ * @param fill_color    The color to fill the area with
+ * @param x             x position to start filling from
+ * @param y             y position to start filling from
  */
-void fill_area (program_data &program, color target)
+void fill_area (bitmap to_draw, color fill_color, int x, int y)
 {
-    int x = mouse_x();
-    int y = mouse_y();
     list<point_2d> queue;
     point_2d temp, left, right;
-    color current_pixel = get_pixel (program.to_draw, x, y);
+    color target = get_pixel (to_draw, x, y);
+    color current_pixel;
     double target_blue = blue_of (target);
     double target_red = red_of (target);
     double target_green = green_of (target);
 
-    // If the color at the mouse cursor is the same as the replacement color, return
-    if (blue_of (current_pixel) != target_blue
-        && red_of (current_pixel) != target_red
-        && green_of (current_pixel) != target_green)
+    // If the color at the start position is the same as the replacement color, return
+    if (blue_of (fill_color) == target_blue
+        && red_of (fill_color) == target_red
+        && green_of (fill_color) == target_green)
         return;
 
-    // Store mouse position as first position in the queue
+    // Store start position as first position in the queue
     temp.x = x;
     temp.y = y;
     queue.push_back (temp);
@@ -361,35 +475,35 @@ void fill_area (program_data &program, color target)
         right = n;
 
         // Move left until a pixel of non-target color is hit
-        current_pixel = get_pixel (program.to_draw, left.x, left.y);
+        current_pixel = get_pixel (to_draw, left.x, left.y);
         while (blue_of (current_pixel) == target_blue
                && red_of (current_pixel) == target_red
                && green_of (current_pixel) == target_green
                && left.x >= 0)
         {
             left.x--;
-            current_pixel = get_pixel (program.to_draw, left.x, left.y);
+            current_pixel = get_pixel (to_draw, left.x, left.y);
         }
 
         // Move right until a pixel of non-target color is hit
-        current_pixel = get_pixel (program.to_draw, right.x, right.y);
+        current_pixel = get_pixel (to_draw, right.x, right.y);
         while (blue_of (current_pixel) == target_blue
                && red_of (current_pixel) == target_red
                && green_of (current_pixel) == target_green
                && right.x < 800)
         {
             right.x++;
-            current_pixel = get_pixel (program.to_draw, right.x, right.y);
+            current_pixel = get_pixel (to_draw, right.x, right.y);
         }        
 
         // Move from left marker to right marker
         for (int i = left.x+1; i < right.x; i++)
         {       
             // Replace current pixel with selected color
-            draw_pixel_on_bitmap (program.to_draw, program.active_color, i, n.y);   
+            draw_pixel_on_bitmap (to_draw, fill_color, i, n.y);   
 
             // If the pixel above is of the target color, add that pixel to the queue
-            current_pixel = get_pixel (program.to_draw, i, n.y-1);
+            current_pixel = get_pixel (to_draw, i, n.y-1);
             if (blue_of (current_pixel) == target_blue
                 && red_of (current_pixel) == target_red
                 && green_of (current_pixel) == target_green)
@@ -400,7 +514,7 @@ void fill_area (program_data &program, color target)
             }
 
             // If the pixel below is of the target color, add that pixel to the queue
-            current_pixel = get_pixel (program.to_draw, i, n.y+1);
+            current_pixel = get_pixel (to_draw, i, n.y+1);
             if (blue_of (current_pixel) == target_blue
                 && red_of (current_pixel) == target_red
                 && green_of (current_pixel) == target_green)
@@ -414,15 +528,90 @@ void fill_area (program_data &program, color target)
 }
 
 /**
- * Main module for the fill tool
+ * Replace every pixel whose red, green and blue are each within a tolerance of a target
+ * color. The buffer is scanned in tiles across all threads, and each row is compared without
+ * branching so the compiler can vectorise it.
+ *
+ * @param pixels        The pixels to be changed
+ * @param target        The packed color to be replaced
+ * @param replacement   The packed color to replace it with
+ * @param tolerance     Largest difference in any channel, from 0 to 255, that still matches
+ *
+ * @returns             Bounds of the tiles that had pixels replaced, with no size if none did
+ */
+rectangle replace_color (pixel_buffer &pixels, unsigned int target, unsigned int replacement, int tolerance)
+{
+    int tiles_x = (pixels.width + REPLACE_TILE - 1) / REPLACE_TILE;
+    int tiles_y = (pixels.height + REPLACE_TILE - 1) / REPLACE_TILE;
+    vector<char> touched (tiles_x * tiles_y, 0);
+
+    parallel_tiles (pixels.width, pixels.height, REPLACE_TILE, [&] (int x, int y, int width, int height)
+    {
+        int matches = 0;
+
+        for (int j = y; j < y + height; j++)
+            matches += kernels().replace_row (&pixels.pixels[(size_t) j * pixels.width + x], width, target, replacement, tolerance);
+
+        touched[(y / REPLACE_TILE) * tiles_x + x / REPLACE_TILE] = matches > 0;
+    });
+
+    return touched_bounds (touched, tiles_x, REPLACE_TILE, pixels.width, pixels.height);
+}
+
+/**
+ * Main module for the fill tool. Shift clicking replaces every pixel close to the clicked
+ * color across the whole image, rather than only the area around the mouse. Fill styles
+ * other than flat are drawn by styled_fill_tool.
  *
  * @param program    Struct containing program data
  */
 void fill_tool (program_data &program)
 {
-    color target = get_pixel (program.to_draw, mouse_x(), mouse_y());
+    tool_command command = new_command (program);
+    bool replace_all = key_down (LEFT_SHIFT_KEY) || key_down (RIGHT_SHIFT_KEY);
+
+    if (not replace_all && program.style != FILL_FLAT)
+    {
+        styled_fill_tool (program, rectangle_from (0, 0, 0, 0));
+        return;
+    }
+
+    command.points.push_back (mouse_position());
 
-    fill_area (program, target);   
-    draw_bitmap_on_window (program.the_window, program.to_draw, 0, 0);
-    refresh_window (program.the_window); 
-}
\ No newline at end of file
+    if (replace_all)
+    {
+        // Record the tolerance and the tiles that changed, so undo only replays that area
+        rectangle area;
+        int x = min (max ((int) command.points[0].x, 0), IMAGE_WIDTH - 1);
+        int y = min (max ((int) command.points[0].y, 0), HEIGHT - 1);
+
+        if (program.indexed.enabled)
+        {
+            // The indexed canvas is filled when the command is recorded, so find the area on a copy
+            indexed_canvas copy = program.indexed;
+            area = index_replace (copy, nearest_index (copy, pack_color (program.active_color)), x, y, program.tolerance);
+        }
+        else
+        {
+            // Work on the in-memory copy of the image, so only tiles drawn on since are read back
+            pixel_buffer pixels = canvas_pixels (program);
+            area = replace_color (pixels, pixels.pixels[y * IMAGE_WIDTH + x], pack_color (program.active_color), program.tolerance);
+
+            write_pixels (program.to_draw, copy_pixels (pixels, area.x, area.y, area.width, area.height), area.x, area.y);
+        }
+
+        command.points[0] = point_2d { (double) x, (double) y };
+        command.values = { (double) program.tolerance, area.x, area.y, area.width, area.height };
+
+        // Nothing matched, so there is nothing to undo
+        if (area.width == 0)
+            return;
+    }
+
+    // The indexed canvas fills its indices when the command is recorded
+    else if (not program.indexed.enabled)
+        fill_area (program.to_draw, program.active_color, command.points[0].x, command.points[0].y);   
+    record_command (program, command);
+    queue_bitmap (program.the_window, program.to_draw, 0, 0);
+    flush_render (program.the_window); 
+}
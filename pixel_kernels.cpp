@@ -0,0 +1,540 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+// Set to the name of a kernel set to use it instead of the best one the CPU supports
+#define KERNELS_VARIABLE "GRAPHIC_CREATOR_KERNELS"
+// Times each kernel is run over a whole image when benchmarking
+#define BENCHMARK_ROUNDS 50
+
+using namespace std;
+
+/*  Each kernel is written once plainly and once for each instruction set, and the best set
+    the CPU supports is chosen the first time kernels() is called, so one build runs on any
+    x86 machine and uses AVX2 where it can. The vector versions work on 4 or 8 pixels at a
+    time and leave whatever is left over at the end of a row to the plain version. Every
+    version gives exactly the same result as the plain one, which run_regression checks.
+    Copying areas is left to memcpy in every set, since the C library already picks the
+    best copy for the CPU it runs on. */
+
+/**
+ * Replace every pixel of a row close to a color, comparing red, green and blue
+ *
+ * @param row           The pixels to be changed
+ * @param count         Number of pixels in the row
+ * @param target        The packed color to be replaced
+ * @param replacement   The packed color to replace it with
+ * @param tolerance     Largest difference in any channel that still matches
+ *
+ * @returns             Number of pixels replaced
+ */
+int replace_row_scalar (unsigned int *row, int count, unsigned int target, unsigned int replacement, int tolerance)
+{
+    int target_red = (target >> 16) & 0xff, target_green = (target >> 8) & 0xff, target_blue = target & 0xff;
+    int matches = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        unsigned int pixel = row[i];
+        int difference = max (max (abs ((int) ((pixel >> 16) & 0xff) - target_red), abs ((int) ((pixel >> 8) & 0xff) - target_green)),
+                              abs ((int) (pixel & 0xff) - target_blue));
+        int match = difference <= tolerance;
+
+        row[i] = match ? replacement : pixel;
+        matches += match;
+    }
+
+    return matches;
+}
+
+/**
+ * Count the pixels at the start of a row that are exactly a color, ignoring alpha
+ *
+ * @param row       The pixels to be checked
+ * @param count     Number of pixels in the row
+ * @param target    The packed color
+ *
+ * @returns         Number of pixels before the first that doesn't match
+ */
+int match_length_scalar (const unsigned int *row, int count, unsigned int target)
+{
+    int i = 0;
+
+    while (i < count && ((row[i] ^ target) & 0xFFFFFF) == 0)
+        i++;
+
+    return i;
+}
+
+/**
+ * Set every pixel of a row to one value
+ *
+ * @param row       The pixels to be set
+ * @param count     Number of pixels in the row
+ * @param value     The packed color
+ */
+void fill_row_scalar (unsigned int *row, int count, unsigned int value)
+{
+    for (int i = 0; i < count; i++)
+        row[i] = value;
+}
+
+/**
+ * Blend a row of pixels towards a row of source pixels. Red and blue, then alpha and green,
+ * are blended two channels at a time in one multiply each.
+ *
+ * @param dest      The pixels to be blended, which are changed
+ * @param source    The pixels to blend towards
+ * @param weights   How far to blend each pixel, out of 256
+ * @param count     Number of pixels in the row
+ */
+void blend_row_scalar (unsigned int *dest, const unsigned int *source, const unsigned int *weights, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        unsigned int d = dest[i], s = source[i], w = weights[i], keep = 256 - w;
+        unsigned int red_blue = (((d & 0xFF00FF) * keep + (s & 0xFF00FF) * w) >> 8) & 0xFF00FF;
+        unsigned int alpha_green = (((d >> 8) & 0xFF00FF) * keep + ((s >> 8) & 0xFF00FF) * w) & 0xFF00FF00;
+
+        dest[i] = red_blue | alpha_green;
+    }
+}
+
+/**
+ * Pack a row of SplashKit colors into pixels, the same as pack_color
+ *
+ * @param colors    The colors to be packed
+ * @param pixels    Where the packed pixels go
+ * @param count     Number of colors
+ */
+void pack_row_scalar (const color *colors, unsigned int *pixels, int count)
+{
+    for (int i = 0; i < count; i++)
+        pixels[i] = pack_color (colors[i]);
+}
+
+/**
+ * Set a row of pixels from a 256 color ramp, at positions that go up by a fixed step along
+ * the row. Positions are fixed point with 16 bits after the point, and are clamped to the
+ * ends of the ramp.
+ *
+ * @param row       The pixels to be set
+ * @param count     Number of pixels in the row
+ * @param ramp      The 256 colors of the ramp
+ * @param position  Position in the ramp of the first pixel
+ * @param step      Change in position from one pixel to the next
+ */
+void ramp_row_scalar (unsigned int *row, int count, const unsigned int *ramp, int position, int step)
+{
+    for (int i = 0; i < count; i++, position += step)
+        row[i] = ramp[min (max (position >> 16, 0), 255)];
+}
+
+/**
+ * Copy an area of pixels between two buffers
+ *
+ * @param dest          The first pixel of the area to copy to
+ * @param dest_stride   Number of pixels from one row of dest to the next
+ * @param source        The first pixel of the area to copy from
+ * @param source_stride Number of pixels from one row of source to the next
+ * @param width         Width of the area
+ * @param height        Height of the area
+ */
+void copy_area_rows (unsigned int *dest, int dest_stride, const unsigned int *source, int source_stride, int width, int height)
+{
+    for (int j = 0; j < height; j++)
+        memcpy (dest + (size_t) j * dest_stride, source + (size_t) j * source_stride, width * sizeof (unsigned int));
+}
+
+#ifdef X86_KERNELS
+
+__attribute__ ((target ("sse2")))
+int replace_row_sse2 (unsigned int *row, int count, unsigned int target, unsigned int replacement, int tolerance)
+{
+    if (tolerance < 0)
+        return 0;
+
+    __m128i targets = _mm_set1_epi32 (target);
+    __m128i replacements = _mm_set1_epi32 (replacement);
+    __m128i limits = _mm_set1_epi32 (0x010101 * min (tolerance, 255));
+    __m128i channels = _mm_set1_epi32 (0xFFFFFF);
+    int matches = 0, i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128 ((const __m128i *) (row + i));
+        __m128i difference = _mm_or_si128 (_mm_subs_epu8 (pixels, targets), _mm_subs_epu8 (targets, pixels));
+
+        // Any channel over the tolerance leaves something after the tolerance is taken off
+        __m128i match = _mm_cmpeq_epi32 (_mm_subs_epu8 (_mm_and_si128 (difference, channels), limits), _mm_setzero_si128());
+
+        _mm_storeu_si128 ((__m128i *) (row + i), _mm_or_si128 (_mm_and_si128 (match, replacements), _mm_andnot_si128 (match, pixels)));
+        matches += __builtin_popcount (_mm_movemask_ps (_mm_castsi128_ps (match)));
+    }
+
+    return matches + replace_row_scalar (row + i, count - i, target, replacement, tolerance);
+}
+
+__attribute__ ((target ("sse2")))
+int match_length_sse2 (const unsigned int *row, int count, unsigned int target)
+{
+    __m128i targets = _mm_set1_epi32 (target & 0xFFFFFF);
+    __m128i channels = _mm_set1_epi32 (0xFFFFFF);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i same = _mm_cmpeq_epi32 (_mm_and_si128 (_mm_loadu_si128 ((const __m128i *) (row + i)), channels), targets);
+        int bits = _mm_movemask_ps (_mm_castsi128_ps (same));
+
+        if (bits != 0xF)
+            return i + __builtin_ctz (~bits);
+    }
+
+    return i + match_length_scalar (row + i, count - i, target);
+}
+
+__attribute__ ((target ("sse2")))
+void fill_row_sse2 (unsigned int *row, int count, unsigned int value)
+{
+    __m128i values = _mm_set1_epi32 (value);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_si128 ((__m128i *) (row + i), values);
+
+    fill_row_scalar (row + i, count - i, value);
+}
+
+__attribute__ ((target ("sse2")))
+void blend_row_sse2 (unsigned int *dest, const unsigned int *source, const unsigned int *weights, int count)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i whole = _mm_set1_epi16 (256);
+    int i = 0;
+
+    // Channels are widened to 16 bits, where neither product nor their sum can overflow
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i d = _mm_loadu_si128 ((const __m128i *) (dest + i));
+        __m128i s = _mm_loadu_si128 ((const __m128i *) (source + i));
+        __m128i w = _mm_loadu_si128 ((const __m128i *) (weights + i));
+
+        // Spread each weight over the four channels of its pixel
+        w = _mm_packs_epi32 (w, w);
+        w = _mm_unpacklo_epi16 (w, w);
+        __m128i w_low = _mm_unpacklo_epi32 (w, w), w_high = _mm_unpackhi_epi32 (w, w);
+
+        __m128i low = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpacklo_epi8 (d, zero), _mm_sub_epi16 (whole, w_low)),
+                                     _mm_mullo_epi16 (_mm_unpacklo_epi8 (s, zero), w_low));
+        __m128i high = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpackhi_epi8 (d, zero), _mm_sub_epi16 (whole, w_high)),
+                                      _mm_mullo_epi16 (_mm_unpackhi_epi8 (s, zero), w_high));
+
+        _mm_storeu_si128 ((__m128i *) (dest + i), _mm_packus_epi16 (_mm_srli_epi16 (low, 8), _mm_srli_epi16 (high, 8)));
+    }
+
+    blend_row_scalar (dest + i, source + i, weights + i, count - i);
+}
+
+__attribute__ ((target ("sse2")))
+void pack_row_sse2 (const color *colors, unsigned int *pixels, int count)
+{
+    __m128 scale = _mm_set1_ps (255);
+    __m128d half = _mm_set1_pd (0.5);
+
+    // pack_color multiplies as floats and rounds as doubles, so this does too
+    for (int i = 0; i < count; i++)
+    {
+        __m128 c = _mm_loadu_ps (&colors[i].r);
+        c = _mm_mul_ps (_mm_shuffle_ps (c, c, _MM_SHUFFLE (3, 0, 1, 2)), scale);
+
+        __m128i blue_green = _mm_cvttpd_epi32 (_mm_add_pd (_mm_cvtps_pd (c), half));
+        __m128i red_alpha = _mm_cvttpd_epi32 (_mm_add_pd (_mm_cvtps_pd (_mm_movehl_ps (c, c)), half));
+        __m128i channels = _mm_unpacklo_epi64 (blue_green, red_alpha);
+
+        channels = _mm_packs_epi32 (channels, channels);
+        pixels[i] = _mm_cvtsi128_si32 (_mm_packus_epi16 (channels, channels));
+    }
+}
+
+__attribute__ ((target ("sse2")))
+void ramp_row_sse2 (unsigned int *row, int count, const unsigned int *ramp, int position, int step)
+{
+    __m128i positions = _mm_add_epi32 (_mm_set1_epi32 (position), _mm_set_epi32 (3 * step, 2 * step, step, 0));
+    __m128i steps = _mm_set1_epi32 (4 * step);
+    __m128i last = _mm_set1_epi32 (255);
+    int i = 0;
+
+    // SSE2 has no gather, so only the positions are worked out four at a time
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i index = _mm_srai_epi32 (positions, 16);
+        __m128i over = _mm_cmpgt_epi32 (index, last);
+        alignas (16) int indices[4];
+
+        index = _mm_andnot_si128 (_mm_cmplt_epi32 (index, _mm_setzero_si128()), index);
+        index = _mm_or_si128 (_mm_andnot_si128 (over, index), _mm_and_si128 (over, last));
+        _mm_store_si128 ((__m128i *) indices, index);
+
+        row[i] = ramp[indices[0]];
+        row[i + 1] = ramp[indices[1]];
+        row[i + 2] = ramp[indices[2]];
+        row[i + 3] = ramp[indices[3]];
+        positions = _mm_add_epi32 (positions, steps);
+    }
+
+    ramp_row_scalar (row + i, count - i, ramp, position + i * step, step);
+}
+
+__attribute__ ((target ("avx2")))
+int replace_row_avx2 (unsigned int *row, int count, unsigned int target, unsigned int replacement, int tolerance)
+{
+    if (tolerance < 0)
+        return 0;
+
+    __m256i targets = _mm256_set1_epi32 (target);
+    __m256i replacements = _mm256_set1_epi32 (replacement);
+    __m256i limits = _mm256_set1_epi32 (0x010101 * min (tolerance, 255));
+    __m256i channels = _mm256_set1_epi32 (0xFFFFFF);
+    int matches = 0, i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i pixels = _mm256_loadu_si256 ((const __m256i *) (row + i));
+        __m256i difference = _mm256_or_si256 (_mm256_subs_epu8 (pixels, targets), _mm256_subs_epu8 (targets, pixels));
+        __m256i match = _mm256_cmpeq_epi32 (_mm256_subs_epu8 (_mm256_and_si256 (difference, channels), limits), _mm256_setzero_si256());
+
+        _mm256_storeu_si256 ((__m256i *) (row + i), _mm256_blendv_epi8 (pixels, replacements, match));
+        matches += __builtin_popcount (_mm256_movemask_ps (_mm256_castsi256_ps (match)));
+    }
+
+    return matches + replace_row_sse2 (row + i, count - i, target, replacement, tolerance);
+}
+
+__attribute__ ((target ("avx2")))
+int match_length_avx2 (const unsigned int *row, int count, unsigned int target)
+{
+    __m256i targets = _mm256_set1_epi32 (target & 0xFFFFFF);
+    __m256i channels = _mm256_set1_epi32 (0xFFFFFF);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i same = _mm256_cmpeq_epi32 (_mm256_and_si256 (_mm256_loadu_si256 ((const __m256i *) (row + i)), channels), targets);
+        int bits = _mm256_movemask_ps (_mm256_castsi256_ps (same));
+
+        if (bits != 0xFF)
+            return i + __builtin_ctz (~bits);
+    }
+
+    return i + match_length_sse2 (row + i, count - i, target);
+}
+
+__attribute__ ((target ("avx2")))
+void fill_row_avx2 (unsigned int *row, int count, unsigned int value)
+{
+    __m256i values = _mm256_set1_epi32 (value);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_si256 ((__m256i *) (row + i), values);
+
+    fill_row_sse2 (row + i, count - i, value);
+}
+
+__attribute__ ((target ("avx2")))
+void blend_row_avx2 (unsigned int *dest, const unsigned int *source, const unsigned int *weights, int count)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i whole = _mm256_set1_epi16 (256);
+    int i = 0;
+
+    // The same steps as the SSE2 version, which all stay within each 128 bit half
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256 ((const __m256i *) (dest + i));
+        __m256i s = _mm256_loadu_si256 ((const __m256i *) (source + i));
+        __m256i w = _mm256_loadu_si256 ((const __m256i *) (weights + i));
+
+        w = _mm256_packs_epi32 (w, w);
+        w = _mm256_unpacklo_epi16 (w, w);
+        __m256i w_low = _mm256_unpacklo_epi32 (w, w), w_high = _mm256_unpackhi_epi32 (w, w);
+
+        __m256i low = _mm256_add_epi16 (_mm256_mullo_epi16 (_mm256_unpacklo_epi8 (d, zero), _mm256_sub_epi16 (whole, w_low)),
+                                        _mm256_mullo_epi16 (_mm256_unpacklo_epi8 (s, zero), w_low));
+        __m256i high = _mm256_add_epi16 (_mm256_mullo_epi16 (_mm256_unpackhi_epi8 (d, zero), _mm256_sub_epi16 (whole, w_high)),
+                                         _mm256_mullo_epi16 (_mm256_unpackhi_epi8 (s, zero), w_high));
+
+        _mm256_storeu_si256 ((__m256i *) (dest + i), _mm256_packus_epi16 (_mm256_srli_epi16 (low, 8), _mm256_srli_epi16 (high, 8)));
+    }
+
+    blend_row_sse2 (dest + i, source + i, weights + i, count - i);
+}
+
+__attribute__ ((target ("avx2")))
+void pack_row_avx2 (const color *colors, unsigned int *pixels, int count)
+{
+    __m256 scale = _mm256_set1_ps (255);
+    __m256d half = _mm256_set1_pd (0.5);
+    int i = 0;
+
+    for (; i + 2 <= count; i += 2)
+    {
+        __m256 c = _mm256_loadu_ps (&colors[i].r);
+        c = _mm256_mul_ps (_mm256_permute_ps (c, _MM_SHUFFLE (3, 0, 1, 2)), scale);
+
+        __m128i first = _mm256_cvttpd_epi32 (_mm256_add_pd (_mm256_cvtps_pd (_mm256_castps256_ps128 (c)), half));
+        __m128i second = _mm256_cvttpd_epi32 (_mm256_add_pd (_mm256_cvtps_pd (_mm256_extractf128_ps (c, 1)), half));
+        __m128i channels = _mm_packs_epi32 (first, second);
+
+        _mm_storel_epi64 ((__m128i *) (pixels + i), _mm_packus_epi16 (channels, channels));
+    }
+
+    pack_row_sse2 (colors + i, pixels + i, count - i);
+}
+
+__attribute__ ((target ("avx2")))
+void ramp_row_avx2 (unsigned int *row, int count, const unsigned int *ramp, int position, int step)
+{
+    __m256i positions = _mm256_add_epi32 (_mm256_set1_epi32 (position), _mm256_mullo_epi32 (_mm256_set_epi32 (7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_epi32 (step)));
+    __m256i steps = _mm256_set1_epi32 (8 * step);
+    __m256i first = _mm256_setzero_si256(), last = _mm256_set1_epi32 (255);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i index = _mm256_min_epi32 (_mm256_max_epi32 (_mm256_srai_epi32 (positions, 16), first), last);
+
+        _mm256_storeu_si256 ((__m256i *) (row + i), _mm256_i32gather_epi32 ((const int *) ramp, index, 4));
+        positions = _mm256_add_epi32 (positions, steps);
+    }
+
+    ramp_row_sse2 (row + i, count - i, ramp, position + i * step, step);
+}
+
+#endif
+
+static const pixel_kernels scalar_kernels = { "scalar", replace_row_scalar, match_length_scalar, fill_row_scalar,
+                                              blend_row_scalar, pack_row_scalar, ramp_row_scalar, copy_area_rows };
+#ifdef X86_KERNELS
+static const pixel_kernels sse2_kernels = { "sse2", replace_row_sse2, match_length_sse2, fill_row_sse2,
+                                            blend_row_sse2, pack_row_sse2, ramp_row_sse2, copy_area_rows };
+static const pixel_kernels avx2_kernels = { "avx2", replace_row_avx2, match_length_avx2, fill_row_avx2,
+                                            blend_row_avx2, pack_row_avx2, ramp_row_avx2, copy_area_rows };
+#endif
+
+/**
+ * Get every set of kernels this CPU can run, from the plain set to the fastest
+ *
+ * @returns     The kernel sets
+ */
+vector<const pixel_kernels *> supported_kernels()
+{
+    vector<const pixel_kernels *> result = { &scalar_kernels };
+
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports ("sse2"))
+        result.push_back (&sse2_kernels);
+    if (__builtin_cpu_supports ("avx2"))
+        result.push_back (&avx2_kernels);
+#endif
+
+    return result;
+}
+
+/**
+ * Choose the fastest set of kernels, or the one named by GRAPHIC_CREATOR_KERNELS if the
+ * CPU supports it
+ *
+ * @returns     The kernel set
+ */
+const pixel_kernels *choose_kernels()
+{
+    vector<const pixel_kernels *> supported = supported_kernels();
+    const char *wanted = getenv (KERNELS_VARIABLE);
+
+    if (wanted != nullptr)
+    {
+        for (const pixel_kernels *set : supported)
+            if (string (set->name) == wanted)
+                return set;
+
+        write_line (string (wanted) + " kernels are not supported here, using " + supported.back()->name);
+    }
+
+    return supported.back();
+}
+
+/**
+ * Get the set of kernels chosen for this CPU
+ *
+ * @returns     The kernel set
+ */
+const pixel_kernels &kernels()
+{
+    static const pixel_kernels *chosen = choose_kernels();
+
+    return *chosen;
+}
+
+/**
+ * Time each kernel of every supported set over a whole image, and print the time per pixel
+ */
+void benchmark_kernels()
+{
+    size_t count = (size_t) IMAGE_WIDTH * HEIGHT;
+    vector<unsigned int> pixels (count), source (count), weights (count);
+    vector<color> colors (count);
+    unsigned int state = 1;
+    volatile int sink = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        pixels[i] = 0xFF000000 | (next_random (state) & 0x0F0F0F);
+        source[i] = next_random (state);
+        weights[i] = next_random (state) % 257;
+        colors[i] = unpack_color (source[i]);
+    }
+
+    // Each kernel is run a row at a time, as the tools run them. Filling first leaves rows
+    // that match_length has to run the whole way along.
+    vector<pair<string, function<void (const pixel_kernels &)>>> tests =
+    {
+        { "fill_row    ", [&](const pixel_kernels &set) { for (int y = 0; y < HEIGHT; y++) set.fill_row (&pixels[y * IMAGE_WIDTH], IMAGE_WIDTH, 0xFF000000); } },
+        { "match_length", [&](const pixel_kernels &set) { for (int y = 0; y < HEIGHT; y++) sink += set.match_length (&pixels[y * IMAGE_WIDTH], IMAGE_WIDTH, 0xFF000000); } },
+        { "replace_row ", [&](const pixel_kernels &set) { for (int y = 0; y < HEIGHT; y++) sink += set.replace_row (&pixels[y * IMAGE_WIDTH], IMAGE_WIDTH, 0xFF000000, 0xFF000000, 8); } },
+        { "blend_row   ", [&](const pixel_kernels &set) { for (int y = 0; y < HEIGHT; y++) set.blend_row (&pixels[y * IMAGE_WIDTH], &source[y * IMAGE_WIDTH], &weights[y * IMAGE_WIDTH], IMAGE_WIDTH); } },
+        { "pack_row    ", [&](const pixel_kernels &set) { for (int y = 0; y < HEIGHT; y++) set.pack_row (&colors[y * IMAGE_WIDTH], &pixels[y * IMAGE_WIDTH], IMAGE_WIDTH); } },
+        { "ramp_row    ", [&](const pixel_kernels &set) { for (int y = 0; y < HEIGHT; y++) set.ramp_row (&pixels[y * IMAGE_WIDTH], IMAGE_WIDTH, source.data(), y << 8, 5000); } },
+        { "copy_area   ", [&](const pixel_kernels &set) { set.copy_area (pixels.data(), IMAGE_WIDTH, source.data(), IMAGE_WIDTH, IMAGE_WIDTH, HEIGHT); } }
+    };
+
+    write_line ("Using " + string (kernels().name) + " kernels. Nanoseconds per pixel:");
+
+    for (auto &test : tests)
+    {
+        string line = test.first;
+
+        for (const pixel_kernels *set : supported_kernels())
+        {
+            auto start = chrono::steady_clock::now();
+            for (int round = 0; round < BENCHMARK_ROUNDS; round++)
+                test.second (*set);
+            double nanoseconds = chrono::duration<double, nano> (chrono::steady_clock::now() - start).count() / BENCHMARK_ROUNDS / count;
+
+            char text[32];
+            snprintf (text, sizeof (text), "  %s %6.3f", set->name, nanoseconds);
+            line += text;
+        }
+
+        write_line (line);
+    }
+}
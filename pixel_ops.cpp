@@ -0,0 +1,382 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cmath>
+
+#define CACHE_TILE 32
+
+using namespace std;
+
+/**
+ * Pack a SplashKit color into a single 0xAARRGGBB pixel value
+ *
+ * @param c     The color to be packed
+ *
+ * @returns     The packed pixel
+ */
+unsigned int pack_color (color c)
+{
+    unsigned int a = c.a * 255 + 0.5;
+    unsigned int r = c.r * 255 + 0.5;
+    unsigned int g = c.g * 255 + 0.5;
+    unsigned int b = c.b * 255 + 0.5;
+
+    return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+/**
+ * Unpack a 0xAARRGGBB pixel value into a SplashKit color
+ *
+ * @param pixel     The packed pixel
+ *
+ * @returns         The matching color
+ */
+color unpack_color (unsigned int pixel)
+{
+    return rgba_color ((pixel >> 16) & 0xFF, (pixel >> 8) & 0xFF, pixel & 0xFF, pixel >> 24);
+}
+
+/**
+ * FNV-1a hash of a block of memory, used to check stored data for changes and corruption
+ *
+ * @param data      The data to be hashed
+ * @param length    Number of bytes of data
+ *
+ * @returns         The hash
+ */
+unsigned int hash_bytes (const unsigned char *data, size_t length)
+{
+    unsigned int hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+
+    return hash;
+}
+
+/**
+ * Create a pixel buffer with every pixel fully transparent
+ *
+ * @param width     Width of the buffer in pixels
+ * @param height    Height of the buffer in pixels
+ *
+ * @returns         The initialised pixel buffer
+ */
+pixel_buffer new_pixel_buffer (int width, int height)
+{
+    pixel_buffer result;
+
+    result.width = max (width, 0);
+    result.height = max (height, 0);
+    result.pixels.assign ((size_t) result.width * result.height, 0);
+
+    return result;
+}
+
+/**
+ * Copy an area of a bitmap into memory. This reads back every pixel, so it should be done
+ * once per operation rather than once per frame.
+ *
+ * @param source    The bitmap to read from
+ * @param x         x position of the area
+ * @param y         y position of the area
+ * @param width     Width of the area
+ * @param height    Height of the area
+ *
+ * @returns         The pixels of the area
+ */
+pixel_buffer read_pixels (bitmap source, int x, int y, int width, int height)
+{
+    pixel_buffer result = new_pixel_buffer (width, height);
+    vector<color> colors (result.width);
+
+    for (int j = 0; j < result.height; j++)
+    {
+        for (int i = 0; i < result.width; i++)
+            colors[i] = get_pixel (source, x + i, y + j);
+        kernels().pack_row (colors.data(), &result.pixels[(size_t) j * result.width], result.width);
+    }
+
+    return result;
+}
+
+/**
+ * Copy an area of a pixel buffer into a new buffer
+ *
+ * @param source    The pixels to be copied from
+ * @param x         x position of the area
+ * @param y         y position of the area
+ * @param width     Width of the area
+ * @param height    Height of the area
+ *
+ * @returns         The pixels of the area
+ */
+pixel_buffer copy_pixels (const pixel_buffer &source, int x, int y, int width, int height)
+{
+    pixel_buffer result = new_pixel_buffer (width, height);
+
+    kernels().copy_area (result.pixels.data(), result.width, &source.pixels[(size_t) y * source.width + x], source.width,
+                         result.width, result.height);
+
+    return result;
+}
+
+/**
+ * Shrink a pixel buffer by averaging each square block of pixels into one. Edge blocks that
+ * don't fit whole are dropped.
+ *
+ * @param source    The pixels to be shrunk
+ * @param factor    Width and height of each block
+ *
+ * @returns         The shrunk pixels
+ */
+pixel_buffer downsample_pixels (const pixel_buffer &source, int factor)
+{
+    pixel_buffer result = new_pixel_buffer (source.width / factor, source.height / factor);
+    unsigned int count = factor * factor;
+
+    for (int y = 0; y < result.height; y++)
+    {
+        for (int x = 0; x < result.width; x++)
+        {
+            unsigned int total[4] = { 0, 0, 0, 0 };
+
+            for (int j = 0; j < factor; j++)
+            {
+                const unsigned int *row = &source.pixels[(size_t) (y * factor + j) * source.width + x * factor];
+
+                for (int i = 0; i < factor; i++)
+                    for (int channel = 0; channel < 4; channel++)
+                        total[channel] += (row[i] >> (channel * 8)) & 0xFF;
+            }
+
+            unsigned int pixel = 0;
+            for (int channel = 0; channel < 4; channel++)
+                pixel |= ((total[channel] + count / 2) / count) << (channel * 8);
+            result.pixels[(size_t) y * result.width + x] = pixel;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Draw a pixel buffer onto a bitmap. Runs of identical pixels along a row are drawn as a
+ * single 1 pixel high rectangle, and fully transparent pixels are skipped.
+ *
+ * @param dest      The bitmap to be drawn to
+ * @param buffer    The pixels to be drawn
+ * @param x         x position to draw the buffer at
+ * @param y         y position to draw the buffer at
+ */
+void write_pixels (bitmap dest, const pixel_buffer &buffer, int x, int y)
+{
+    for (int j = 0; j < buffer.height; j++)
+    {
+        const unsigned int *row = &buffer.pixels[(size_t) j * buffer.width];
+        int i = 0;
+
+        while (i < buffer.width)
+        {
+            int run = 1;
+            while (i + run < buffer.width && row[i + run] == row[i])
+                run++;
+
+            if ((row[i] >> 24) != 0)
+                fill_rectangle_on_bitmap (dest, unpack_color (row[i]), x + i, y + j, run, 1);
+
+            i += run;
+        }
+    }
+}
+
+/**
+ * Set up the in-memory copy of the user image, with every tile stale and unpublished
+ *
+ * @param cache     The copy of the user image
+ */
+void init_canvas_cache (canvas_cache &cache)
+{
+    int tiles_x = (IMAGE_WIDTH + CACHE_TILE - 1) / CACHE_TILE;
+    int tiles_y = (HEIGHT + CACHE_TILE - 1) / CACHE_TILE;
+
+    cache.pixels = new_pixel_buffer (IMAGE_WIDTH, HEIGHT);
+    cache.stale.assign (tiles_x * tiles_y, true);
+    cache.unpublished.assign (tiles_x * tiles_y, true);
+}
+
+/**
+ * Mark the tiles of the in-memory copy of the user image covering an area as stale
+ *
+ * @param cache     The copy of the user image
+ * @param area      The area of the user image that has been drawn on
+ */
+void mark_stale (canvas_cache &cache, rectangle area)
+{
+    int tiles_x = (IMAGE_WIDTH + CACHE_TILE - 1) / CACHE_TILE;
+    int tiles_y = (HEIGHT + CACHE_TILE - 1) / CACHE_TILE;
+    int left = max ((int) floor (area.x) / CACHE_TILE, 0);
+    int top = max ((int) floor (area.y) / CACHE_TILE, 0);
+    int right = min ((int) ceil (area.x + area.width) / CACHE_TILE, tiles_x - 1);
+    int bottom = min ((int) ceil (area.y + area.height) / CACHE_TILE, tiles_y - 1);
+
+    for (int y = top; y <= bottom; y++)
+        for (int x = left; x <= right; x++)
+        {
+            cache.stale[y * tiles_x + x] = true;
+            cache.unpublished[y * tiles_x + x] = true;
+        }
+}
+
+/**
+ * Take the areas of the user image drawn on since they were last taken, for publishing to
+ * the shared canvas. Neighbouring tiles along a row are joined into one area.
+ *
+ * @param cache     The copy of the user image
+ *
+ * @returns         The areas drawn on
+ */
+vector<rectangle> take_unpublished (canvas_cache &cache)
+{
+    int tiles_x = (IMAGE_WIDTH + CACHE_TILE - 1) / CACHE_TILE;
+    int tiles_y = (HEIGHT + CACHE_TILE - 1) / CACHE_TILE;
+    vector<rectangle> result;
+
+    for (int y = 0; y < tiles_y; y++)
+    {
+        for (int x = 0; x < tiles_x; x++)
+        {
+            if (not cache.unpublished[y * tiles_x + x])
+                continue;
+
+            int end = x;
+            while (end < tiles_x && cache.unpublished[y * tiles_x + end])
+                cache.unpublished[y * tiles_x + end++] = false;
+
+            int top = y * CACHE_TILE, left = x * CACHE_TILE;
+            result.push_back (rectangle_from (left, top, min (end * CACHE_TILE, IMAGE_WIDTH) - left, min (CACHE_TILE, HEIGHT - top)));
+            x = end;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Copy a stale tile of the in-memory copy of the user image again from the image
+ *
+ * @param program   Struct containing program data
+ * @param tile      Index of the tile
+ */
+void refresh_cache_tile (program_data &program, int tile)
+{
+    canvas_cache &cache = program.canvas;
+    int tiles_x = (IMAGE_WIDTH + CACHE_TILE - 1) / CACHE_TILE;
+    int tile_x = tile % tiles_x * CACHE_TILE;
+    int tile_y = tile / tiles_x * CACHE_TILE;
+    pixel_buffer pixels = read_pixels (program.to_draw, tile_x, tile_y, min (CACHE_TILE, IMAGE_WIDTH - tile_x), min (CACHE_TILE, HEIGHT - tile_y));
+
+    kernels().copy_area (&cache.pixels.pixels[(size_t) tile_y * IMAGE_WIDTH + tile_x], IMAGE_WIDTH, pixels.pixels.data(), pixels.width,
+                         pixels.width, pixels.height);
+
+    cache.stale[tile] = false;
+}
+
+/**
+ * Get a pixel of the user image from the in-memory copy. A stale tile is copied again
+ * from the image first, so picking over an area that hasn't changed reads no pixels back.
+ *
+ * @param program   Struct containing program data
+ * @param x         x position of the pixel on the user image
+ * @param y         y position of the pixel on the user image
+ *
+ * @returns         The pixel as a packed 0xAARRGGBB value
+ */
+unsigned int canvas_pixel (program_data &program, int x, int y)
+{
+    canvas_cache &cache = program.canvas;
+    int tiles_x = (IMAGE_WIDTH + CACHE_TILE - 1) / CACHE_TILE;
+
+    x = min (max (x, 0), IMAGE_WIDTH - 1);
+    y = min (max (y, 0), HEIGHT - 1);
+
+    if (program.indexed.enabled)
+        return program.indexed.palette[program.indexed.pixels[y * IMAGE_WIDTH + x]];
+
+    int tile = (y / CACHE_TILE) * tiles_x + x / CACHE_TILE;
+
+    if (cache.stale[tile])
+        refresh_cache_tile (program, tile);
+
+    return cache.pixels.pixels[(size_t) y * IMAGE_WIDTH + x];
+}
+
+/**
+ * Get the whole user image from the in-memory copy, copying any stale tiles again first
+ *
+ * @param program   Struct containing program data
+ *
+ * @returns         The in-memory copy of the user image
+ */
+const pixel_buffer &canvas_pixels (program_data &program)
+{
+    for (size_t tile = 0; tile < program.canvas.stale.size(); tile++)
+        if (program.canvas.stale[tile])
+            refresh_cache_tile (program, tile);
+
+    return program.canvas.pixels;
+}
+
+/**
+ * Find the area covered by the tiles of a tile grid that are flagged
+ *
+ * @param flags         One flag for each tile, a row at a time
+ * @param tiles_x       Number of tiles across the grid
+ * @param tile_size     Width and height of each tile
+ * @param width         Width of the area the grid covers
+ * @param height        Height of the area the grid covers
+ *
+ * @returns             Bounds of the flagged tiles, with no size if none are flagged
+ */
+rectangle touched_bounds (const vector<char> &flags, int tiles_x, int tile_size, int width, int height)
+{
+    int left = tiles_x, top = flags.size(), right = -1, bottom = -1;
+
+    for (size_t tile = 0; tile < flags.size(); tile++)
+    {
+        if (not flags[tile])
+            continue;
+
+        left = min (left, (int) tile % tiles_x);
+        right = max (right, (int) tile % tiles_x);
+        top = min (top, (int) tile / tiles_x);
+        bottom = max (bottom, (int) tile / tiles_x);
+    }
+
+    if (right < 0)
+        return rectangle_from (0, 0, 0, 0);
+
+    return rectangle_from (left * tile_size, top * tile_size, min ((right + 1) * tile_size, width) - left * tile_size,
+                           min ((bottom + 1) * tile_size, height) - top * tile_size);
+}
+
+/**
+ * Split an area into square tiles and process them across the job pool. Each tile is
+ * handed to exactly one call of work, so tiles may be written without locking.
+ *
+ * @param width         Width of the area
+ * @param height        Height of the area
+ * @param tile_size     Width and height of each tile
+ * @param work          Function called with the x, y, width and height of each tile
+ */
+void parallel_tiles (int width, int height, int tile_size, function<void (int, int, int, int)> work)
+{
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+
+    parallel_for (tiles_x * tiles_y, [&](int tile)
+    {
+        int x = (tile % tiles_x) * tile_size;
+        int y = (tile / tiles_x) * tile_size;
+        work (x, y, min (tile_size, width - x), min (tile_size, height - y));
+    });
+}
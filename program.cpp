@@ -1,23 +1,46 @@
 #include "graphic_creator.h"
 
-int main()
+int main(int argc, char *argv[])
 {
     load_graphics();
 
+    // Check drawing against the golden images without opening the editor
+    if (argc > 1 && string(argv[1]) == "--regression")
+        return run_regression(argc > 2 && string(argv[2]) == "--record") == 0 ? 0 : 1;
+
+    // Time the pixel kernels of each instruction set this CPU supports
+    if (argc > 1 && string(argv[1]) == "--benchmark")
+    {
+        benchmark_kernels();
+        return 0;
+    }
+
     program_data program;
-    program = new_program_data();   
+    program = new_program_data(false);   
 
     draw_title_screen (program.the_window);
+
+    if (argc > 1)
+        start_import(program, argv[1]);
     
     while (not quit_requested())
     {
         process_events(); 
 
         process_input(program);
+        journal_pump(program);
+        import_pump(program);
+        publish_canvas(program);
 
-        draw_bitmap_on_window (program.the_window, program.to_draw, 0, 0);        
-        refresh_window(program.the_window);
+        queue_bitmap (program.the_window, program.to_draw, 0, 0);        
+        draw_onion_skin(program);
+        flush_render(program.the_window);
     }
+
+    cancel_import(program);
+    set_canvas_share(program, false);
+    close_journal(program.journal);
+    stop_jobs();
     
     return 0;
 }
\ No newline at end of file
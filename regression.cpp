@@ -0,0 +1,615 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Where the golden images and any difference images are kept, and where the check is run
+#define REGRESSION_DIR "regression"
+// Largest difference in any channel still counted as matching a golden image, since
+// graphics drivers can draw shape edges slightly differently
+#define GOLDEN_TOLERANCE 2
+#define REPLACE_CHECK_TOLERANCE 40
+// Rows of random pixels each kernel set is checked on, and the longest of them
+#define KERNEL_CHECK_ROWS 2000
+#define KERNEL_CHECK_LENGTH 70
+
+using namespace std;
+
+/*  The regression check draws a fixed set of scripted operations, one case at a time on a
+    blank image, and checks each result three ways: against a golden image saved by an
+    earlier run, against the same commands replayed onto a blank image, and through the
+    optimised pixel routines against plain versions of them. Operations go through
+    record_command exactly as the tools' commands do, so checkpoints, the canvas cache and
+    the undo journal are all exercised along the way. Golden images depend on how SplashKit
+    draws shapes, so they are recorded with --record on a working build before the first
+    check rather than kept with the source. Every kernel set the CPU supports is
+    then checked against the scalar set on random rows. */
+
+struct regression_case
+{
+    string name;
+    function<void (program_data &)> run;
+};
+
+/**
+ * Draw a command onto the user image and add it to the history, as a tool would
+ *
+ * @param program   Struct containing program data
+ * @param mode      The tool the command is for
+ * @param draw_color Color the command draws with
+ * @param points    Points of the command
+ * @param values    Values of the command
+ */
+void script_command (program_data &program, mode_option mode, color draw_color, const vector<point_2d> &points, const vector<double> &values)
+{
+    tool_command command = new_command (program);
+
+    command.mode = mode;
+    command.draw_color = draw_color;
+    command.points = points;
+    command.values = values;
+
+    apply_command (program.to_draw, command);
+    record_command (program, command);
+}
+
+/**
+ * Replace a color across the whole image the way the fill tool does when shift clicked
+ *
+ * @param program   Struct containing program data
+ * @param x         x position of the clicked pixel
+ * @param y         y position of the clicked pixel
+ * @param fill_color Color to replace it with
+ * @param tolerance Largest difference in any channel that is still replaced
+ */
+void script_replace (program_data &program, int x, int y, color fill_color, int tolerance)
+{
+    pixel_buffer pixels = canvas_pixels (program);
+    rectangle area = replace_color (pixels, pixels.pixels[y * IMAGE_WIDTH + x], pack_color (fill_color), tolerance);
+
+    script_command (program, FILL, fill_color, { point_2d { (double) x, (double) y } }, { (double) tolerance, area.x, area.y, area.width, area.height });
+}
+
+/**
+ * Draw a sampling brush stroke the way the brush tool does, on an in-memory copy of the
+ * whole image, and add it to the history. Replaying it only reads the area around the
+ * stroke, so the replay check compares the two.
+ *
+ * @param program   Struct containing program data
+ * @param mode      The brush
+ * @param points    Points the stroke passes through
+ * @param values    Values of the command
+ */
+void script_brush (program_data &program, mode_option mode, const vector<point_2d> &points, const vector<double> &values)
+{
+    tool_command command = new_command (program);
+    pixel_buffer pixels = canvas_pixels (program);
+
+    command.mode = mode;
+    command.values = values;
+
+    for (point_2d point : points)
+        extend_stroke (command.points, point, max (values[0] * 0.2, 1.0));
+
+    brush_stroke (pixels, 0, 0, command);
+    write_pixels (program.to_draw, pixels, 0, 0);
+    record_command (program, command);
+}
+
+/**
+ * Get the scripted operations that are checked
+ *
+ * @returns     The regression cases
+ */
+vector<regression_case> regression_cases()
+{
+    vector<regression_case> result;
+
+    result.push_back ({ "shapes", [](program_data &program)
+    {
+        script_command (program, DRAW_REC, COLOR_RED, {}, { 40, 40, 200, 120 });
+        script_command (program, FILL_REC, COLOR_BLUE, {}, { 300, 60, 150, 90 });
+        script_command (program, DRAW_ELL, COLOR_GREEN, {}, { 500, 40, 180, 180 });
+        script_command (program, FILL_ELL, COLOR_ORANGE, {}, { 80, 250, 240, 140 });
+        script_command (program, DRAW_TRI, COLOR_PURPLE, { { 400, 300 }, { 520, 520 }, { 300, 540 } }, {});
+        script_command (program, FILL_TRI, COLOR_CRIMSON, { { 600, 300 }, { 780, 420 }, { 560, 580 } }, {});
+    } });
+
+    result.push_back ({ "strokes", [](program_data &program)
+    {
+        vector<point_2d> stroke;
+
+        for (int i = 0; i < 300; i++)
+            extend_stroke (stroke, point_2d { 50.0 + i * 2, 300 + 120 * sin (i / 25.0) }, 2);
+
+        script_command (program, PEN, COLOR_BLACK, stroke, {});
+        stroke.clear();
+
+        for (int i = 0; i < 200; i++)
+            extend_stroke (stroke, point_2d { 100.0 + i * 3, 200.0 + i }, 5);
+
+        script_command (program, ERASER, COLOR_WHITE, stroke, {});
+    } });
+
+    // The indexed canvas draws every command into its indices and redraws the image from
+    // them, so these are compared with the same commands drawn by SplashKit
+    result.push_back ({ "indexed_shapes", [](program_data &program)
+    {
+        vector<point_2d> stroke;
+
+        set_indexed_mode (program, true);
+        script_command (program, DRAW_REC, COLOR_RED, {}, { 40, 40, 200, 120 });
+        script_command (program, DRAW_REC, COLOR_BLACK, {}, { 300, 260, -120, -100 });
+        script_command (program, FILL_REC, COLOR_BLUE, {}, { 450, 150, -100, -90 });
+        script_command (program, DRAW_ELL, COLOR_GREEN, {}, { 500, 40, 180, 180 });
+        script_command (program, FILL_ELL, COLOR_ORANGE, {}, { 320, 390, -240, -140 });
+        script_command (program, DRAW_TRI, COLOR_PURPLE, { { 400, 300 }, { 520, 520 }, { 300, 540 } }, {});
+        script_command (program, FILL_TRI, COLOR_CRIMSON, { { 600, 300 }, { 780, 420 }, { 560, 580 } }, {});
+
+        for (int i = 0; i < 150; i++)
+            extend_stroke (stroke, point_2d { 50.0 + i * 4, 450 + 80 * sin (i / 15.0) }, 2);
+        script_command (program, PEN, COLOR_BLACK, stroke, {});
+
+        // Sprays hanging off the left and top edges
+        script_command (program, SPRAY, COLOR_DARK_GREEN, { { 5, 300 }, { 400, 5 }, { 2, 2 } }, {});
+
+        script_command (program, FILL, COLOR_YELLOW, { { 100, 100 } }, {});
+    } });
+
+    result.push_back ({ "indexed_undo", [](program_data &program)
+    {
+        set_indexed_mode (program, true);
+
+        for (int i = 0; i < 20; i++)
+            script_command (program, i % 2 == 0 ? FILL_REC : DRAW_ELL, sidebar_palette_color (i + 2), {}, { 30.0 + i * 30, 30.0 + i * 20, 90, -60 });
+
+        for (int i = 0; i < 8; i++)
+            undo_changes (program);
+        for (int i = 0; i < 3; i++)
+            redo_changes (program);
+    } });
+
+    result.push_back ({ "spray", [](program_data &program)
+    {
+        vector<point_2d> points;
+
+        for (int i = 0; i < 60; i++)
+            points.push_back (point_2d { 100.0 + i * 10, 300 + 100 * cos (i / 8.0) });
+
+        script_command (program, SPRAY, COLOR_DARK_GREEN, points, {});
+    } });
+
+    // Each stroke starts off the image, so the brush starts with part of it hanging over the edge
+    result.push_back ({ "sampling_brushes", [](program_data &program)
+    {
+        vector<point_2d> stroke;
+
+        script_command (program, FILL_REC, COLOR_RED, {}, { 0, 0, 400, 300 });
+        script_command (program, FILL_ELL, COLOR_BLUE, {}, { 300, 200, 300, 250 });
+        script_command (program, FILL_TRI, COLOR_YELLOW, { { 500, 0 }, { 800, 100 }, { 650, 400 } }, {});
+
+        for (int i = 0; i < 40; i++)
+            stroke.push_back (point_2d { -20.0 + i * 12, 150 + 60 * sin (i / 6.0) });
+        script_brush (program, SMUDGE, stroke, { 40, 0.7 });
+        stroke.clear();
+
+        for (int i = 0; i < 40; i++)
+            stroke.push_back (point_2d { 350 + 80 * cos (i / 6.0), -10.0 + i * 10 });
+        script_brush (program, BLUR_BRUSH, stroke, { 30, 1 });
+        stroke.clear();
+
+        for (int i = 0; i < 40; i++)
+            stroke.push_back (point_2d { 820.0 - i * 8, 500 - i * 5.0 });
+        script_brush (program, CLONE, stroke, { 50, 1, -250, -180 });
+    } });
+
+    result.push_back ({ "fill", [](program_data &program)
+    {
+        script_command (program, DRAW_ELL, COLOR_BLACK, {}, { 100, 100, 300, 200 });
+        script_command (program, FILL_REC, rgba_color (200, 40, 40, 255), {}, { 500, 100, 100, 100 });
+        script_command (program, FILL_REC, rgba_color (210, 50, 35, 255), {}, { 600, 300, 100, 100 });
+        script_command (program, FILL, COLOR_YELLOW, { { 250, 200 } }, {});
+        script_replace (program, 550, 150, COLOR_BLUE, 20);
+    } });
+
+    result.push_back ({ "styled_fill", [](program_data &program)
+    {
+        script_command (program, FILL_REC, COLOR_BLACK, {}, { 50, 50, 300, 200 });
+        script_command (program, STYLED_FILL, COLOR_BLUE, { { 60, 60 }, { 50, 150 }, { 350, 150 } }, { FILL_LINEAR, (double) pack_color (COLOR_YELLOW), 50, 50, 300, 200, 0 });
+        script_command (program, STYLED_FILL, COLOR_RED, { { 400, 300 }, { 600, 450 }, { 750, 450 } }, { FILL_RADIAL, (double) pack_color (COLOR_WHITE), 400, 300, 400, 300, 1 });
+        script_command (program, STYLED_FILL, COLOR_GREEN, { { 0, 300 }, { 200, 450 }, { 300, 450 } }, { FILL_ANGULAR, (double) pack_color (COLOR_BLACK), 0, 300, 400, 300, 1 });
+        script_command (program, STYLED_FILL, COLOR_PURPLE, { { 400, 0 }, { 400, 0 }, { 800, 0 } }, { FILL_CHECKER, (double) pack_color (COLOR_WHITE), 400, 0, 400, 300, 1 });
+    } });
+
+    result.push_back ({ "filter", [](program_data &program)
+    {
+        script_command (program, FILL_ELL, COLOR_BLUE, {}, { 100, 100, 300, 300 });
+        script_command (program, FILL_TRI, COLOR_ORANGE, { { 400, 100 }, { 700, 500 }, { 300, 500 } }, {});
+        script_command (program, FILTER, COLOR_BLACK, {}, { 50, 50, 400, 400, FILTER_GAUSSIAN_BLUR, 4, 0 });
+        script_command (program, FILTER, COLOR_BLACK, {}, { 400, 300, 300, 250, FILTER_INVERT, 0, 0 });
+    } });
+
+    result.push_back ({ "transform", [](program_data &program)
+    {
+        script_command (program, FILL_REC, COLOR_RED, {}, { 100, 100, 120, 80 });
+        script_command (program, FILL_ELL, COLOR_BLUE, {}, { 140, 120, 60, 60 });
+        script_command (program, SELECT, COLOR_BLACK, {}, { 100, 100, 120, 80, 400, 300, 1, 1, 0 });
+        script_command (program, FILL_REC, COLOR_GREEN, {}, { 500, 50, 100, 100 });
+        script_command (program, SELECT, COLOR_BLACK, {}, { 500, 50, 100, 100, 550, 350, 1.5, 0.75, 30 });
+    } });
+
+    result.push_back ({ "undo", [](program_data &program)
+    {
+        for (int i = 0; i < 30; i++)
+            script_command (program, FILL_REC, rgba_color (i * 8, 255 - i * 8, 128, 255), {}, { 20.0 + i * 20, 20.0 + i * 15, 60, 60 });
+
+        for (int i = 0; i < 12; i++)
+            undo_changes (program);
+        for (int i = 0; i < 5; i++)
+            redo_changes (program);
+
+        script_command (program, FILL_ELL, COLOR_BLACK, {}, { 300, 200, 200, 200 });
+        undo_changes (program);
+        redo_changes (program);
+    } });
+
+    return result;
+}
+
+/**
+ * Count the pixels that differ between two images by more than a tolerance in any of red,
+ * green or blue. Alpha isn't compared, since golden images are saved without it.
+ *
+ * @param first     One image
+ * @param second    The other image, the same size
+ * @param tolerance Largest difference in a channel that still matches
+ * @param diff      Set to a copy of the first image faded out, with differing pixels in red
+ *
+ * @returns         Number of pixels that differ
+ */
+int count_differences (const pixel_buffer &first, const pixel_buffer &second, int tolerance, pixel_buffer &diff)
+{
+    int result = 0;
+
+    diff = new_pixel_buffer (first.width, first.height);
+
+    for (size_t i = 0; i < first.pixels.size(); i++)
+    {
+        unsigned int a = first.pixels[i], b = second.pixels[i];
+        int difference = 0;
+
+        for (int shift = 0; shift < 24; shift += 8)
+            difference = max (difference, abs ((int) ((a >> shift) & 0xFF) - (int) ((b >> shift) & 0xFF)));
+
+        if (difference > tolerance)
+        {
+            diff.pixels[i] = 0xFFFF0000;
+            result++;
+        }
+        else
+        {
+            unsigned int grey = (((a >> 16) & 0xFF) + ((a >> 8) & 0xFF) + (a & 0xFF)) / 3;
+            grey = 192 + grey / 4;
+            diff.pixels[i] = 0xFF000000 | (grey << 16) | (grey << 8) | grey;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Save pixels as an uncompressed 24 bit BMP file
+ *
+ * @param path      The file to be written
+ * @param pixels    The pixels to be saved
+ *
+ * @returns         True if the file was written
+ */
+bool write_bmp_file (string path, const pixel_buffer &pixels)
+{
+    FILE *file = fopen (path.c_str(), "wb");
+    size_t stride = ((size_t) pixels.width * 3 + 3) & ~(size_t) 3;
+    unsigned int size = 54 + stride * pixels.height;
+    unsigned char header[54] = { 'B', 'M' };
+    vector<unsigned char> row (stride, 0);
+    bool result;
+
+    if (file == nullptr)
+        return false;
+
+    auto put_le = [&](int offset, unsigned int value, int bytes)
+    {
+        for (int i = 0; i < bytes; i++)
+            header[offset + i] = (value >> (8 * i)) & 0xFF;
+    };
+
+    // Stored top down, which a negative height marks
+    put_le (2, size, 4);
+    put_le (10, 54, 4);
+    put_le (14, 40, 4);
+    put_le (18, pixels.width, 4);
+    put_le (22, (unsigned int) -pixels.height, 4);
+    put_le (26, 1, 2);
+    put_le (28, 24, 2);
+    put_le (34, stride * pixels.height, 4);
+
+    result = fwrite (header, 1, sizeof (header), file) == sizeof (header);
+
+    for (int y = 0; y < pixels.height && result; y++)
+    {
+        for (int x = 0; x < pixels.width; x++)
+        {
+            unsigned int pixel = pixels.pixels[(size_t) y * pixels.width + x];
+            row[x * 3] = pixel & 0xFF;
+            row[x * 3 + 1] = (pixel >> 8) & 0xFF;
+            row[x * 3 + 2] = (pixel >> 16) & 0xFF;
+        }
+
+        result = fwrite (row.data(), 1, stride, file) == stride;
+    }
+
+    fclose (file);
+    return result;
+}
+
+/**
+ * Replace a color the plain way, one pixel at a time, to check replace_color against
+ *
+ * @param pixels        The pixels to be changed
+ * @param target        The packed color to be replaced
+ * @param replacement   The packed color to replace it with
+ * @param tolerance     Largest difference in any channel that still matches
+ */
+void reference_replace_color (pixel_buffer &pixels, unsigned int target, unsigned int replacement, int tolerance)
+{
+    for (unsigned int &pixel : pixels.pixels)
+    {
+        bool match = true;
+
+        for (int shift = 0; shift < 24; shift += 8)
+            if (abs ((int) ((pixel >> shift) & 0xFF) - (int) ((target >> shift) & 0xFF)) > tolerance)
+                match = false;
+
+        if (match)
+            pixel = replacement;
+    }
+}
+
+/**
+ * Check the optimised paths against the plain ones for the image a case drew
+ *
+ * @param program   Struct containing program data
+ * @param image     The image read back from the user image
+ *
+ * @returns         Descriptions of any checks that failed
+ */
+vector<string> check_fast_paths (program_data &program, const pixel_buffer &image)
+{
+    vector<string> result;
+    pixel_buffer diff;
+
+    // The canvas cache only reads back tiles drawn on since, so should match a full read back
+    if (canvas_pixels (program).pixels != image.pixels)
+        result.push_back ("canvas cache differs from the image");
+
+    // Replaying every command from a blank image should draw exactly what was drawn
+    bitmap replay = create_bitmap ("regression_replay", IMAGE_WIDTH, HEIGHT);
+    clear_bitmap (replay, COLOR_WHITE);
+    for (const tool_command &command : program.history.commands)
+        apply_command (replay, command);
+
+    int replay_differences = count_differences (image, read_pixels (replay, 0, 0, IMAGE_WIDTH, HEIGHT), 0, diff);
+    free_bitmap (replay);
+
+    if (replay_differences > 0)
+        result.push_back (to_string (replay_differences) + " pixels differ from replaying the history");
+
+    // Replace the color at the centre of the image both ways
+    pixel_buffer fast = image, reference = image;
+    unsigned int target = image.pixels[(HEIGHT / 2) * IMAGE_WIDTH + IMAGE_WIDTH / 2];
+
+    replace_color (fast, target, 0xFF00FF00, REPLACE_CHECK_TOLERANCE);
+    reference_replace_color (reference, target, 0xFF00FF00, REPLACE_CHECK_TOLERANCE);
+
+    if (fast.pixels != reference.pixels)
+        result.push_back ("replace_color differs from the reference version");
+
+    return result;
+}
+
+/**
+ * Compare an image with the golden image saved for its case, saving a difference image if
+ * they differ. A missing golden image fails the case, unless recording.
+ *
+ * @param name      Name of the case
+ * @param image     The image the case drew
+ * @param record    True to replace the golden image
+ *
+ * @returns         A description of the difference, or an empty string if they match
+ */
+string check_golden (string name, const pixel_buffer &image, bool record)
+{
+    string golden_path = name + ".bmp", diff_path = name + "_diff.bmp";
+    pixel_buffer golden, diff;
+
+    unlink (diff_path.c_str());
+
+    if (record)
+        return write_bmp_file (golden_path, image) ? "" : "golden image could not be saved";
+
+    if (access (golden_path.c_str(), F_OK) != 0)
+        return "no golden image, record them first with --regression --record";
+
+    string error = read_image_file (golden_path, golden);
+    if (error != "")
+        return "golden image could not be read, " + error;
+
+    if (golden.width != image.width || golden.height != image.height)
+        return "golden image is a different size";
+
+    int differences = count_differences (image, golden, GOLDEN_TOLERANCE, diff);
+    if (differences == 0)
+        return "";
+
+    write_bmp_file (diff_path, diff);
+    return to_string (differences) + " pixels differ from the golden image, see " + diff_path;
+}
+
+/**
+ * Check every supported kernel set gives the same results as the scalar set, on random rows
+ * of every length up to a few vectors, starting at every alignment. Pixels are mostly close
+ * to the target color, so tolerance edges and runs of matches are both hit.
+ *
+ * @returns         Descriptions of any checks that failed
+ */
+vector<string> check_kernels()
+{
+    vector<string> result;
+    vector<const pixel_kernels *> sets = supported_kernels();
+    const pixel_kernels &scalar = *sets[0];
+    unsigned int state = 1;
+    unsigned int ramp[256];
+
+    for (int i = 0; i < 256; i++)
+        ramp[i] = next_random (state);
+
+    for (size_t k = 1; k < sets.size(); k++)
+    {
+        const pixel_kernels &set = *sets[k];
+        vector<string> problems;
+
+        for (int trial = 0; trial < KERNEL_CHECK_ROWS && problems.size() == 0; trial++)
+        {
+            int count = trial % (KERNEL_CHECK_LENGTH + 1), offset = trial / (KERNEL_CHECK_LENGTH + 1) % 4;
+            unsigned int target = next_random (state), replacement = next_random (state);
+            int tolerance = (int) (next_random (state) % 300) - 20;
+            vector<unsigned int> row (count + offset), source (count + offset), weights (count + offset);
+            vector<color> colors (count + offset);
+
+            for (int i = 0; i < count + offset; i++)
+            {
+                // Nudge each channel of the target a little, or leave it exactly the target
+                unsigned int nudge = next_random (state) % 4 == 0 ? 0 : next_random (state) & 0x07070707;
+                row[i] = next_random (state) % 8 == 0 ? next_random (state) : target ^ nudge;
+                source[i] = next_random (state);
+                weights[i] = next_random (state) % 257;
+                colors[i] = next_random (state) % 2 == 0 ? unpack_color (source[i])
+                          : color { (float) random_unit (state), (float) random_unit (state), (float) random_unit (state), (float) random_unit (state) };
+            }
+
+            vector<unsigned int> fast = row, reference = row;
+            if (set.replace_row (&fast[offset], count, target, replacement, tolerance)
+                    != scalar.replace_row (&reference[offset], count, target, replacement, tolerance) || fast != reference)
+                problems.push_back ("replace_row");
+
+            if (set.match_length (&row[offset], count, target) != scalar.match_length (&row[offset], count, target))
+                problems.push_back ("match_length");
+
+            fast = row;
+            reference = row;
+            set.fill_row (&fast[offset], count, replacement);
+            scalar.fill_row (&reference[offset], count, replacement);
+            if (fast != reference)
+                problems.push_back ("fill_row");
+
+            fast = row;
+            reference = row;
+            set.blend_row (&fast[offset], &source[offset], &weights[offset], count);
+            scalar.blend_row (&reference[offset], &source[offset], &weights[offset], count);
+            if (fast != reference)
+                problems.push_back ("blend_row");
+
+            set.pack_row (&colors[offset], &fast[offset], count);
+            scalar.pack_row (&colors[offset], &reference[offset], count);
+            if (fast != reference)
+                problems.push_back ("pack_row");
+
+            // Positions start anywhere from before the ramp to past its end, and can run off either end
+            int position = (int) (next_random (state) % (512 << 16)) - (128 << 16);
+            int step = (int) (next_random (state) % (16 << 16)) - (8 << 16);
+
+            set.ramp_row (&fast[offset], count, ramp, position, step);
+            scalar.ramp_row (&reference[offset], count, ramp, position, step);
+            if (fast != reference)
+                problems.push_back ("ramp_row");
+
+            fast = row;
+            set.copy_area (&fast[0], 1, &source[offset], 1, 1, count);
+            if (not equal (fast.begin(), fast.begin() + count, source.begin() + offset))
+                problems.push_back ("copy_area");
+        }
+
+        for (string &problem : problems)
+            result.push_back (string (set.name) + " " + problem + " differs from the scalar version");
+    }
+
+    return result;
+}
+
+/**
+ * Draw every regression case without waiting for the user, and check each result. Runs
+ * inside the regression directory, so it has its own undo journal and never touches the
+ * one holding the user's unsaved work. No window is opened, since everything is drawn on
+ * bitmaps.
+ *
+ * @param record    True to save new golden images rather than compare with the old ones
+ *
+ * @returns         Number of cases that failed
+ */
+int run_regression (bool record)
+{
+    int failures = 0;
+
+    mkdir (REGRESSION_DIR, 0755);
+    if (chdir (REGRESSION_DIR) != 0)
+    {
+        write_line ("Could not open the " + string (REGRESSION_DIR) + " directory");
+        return 1;
+    }
+
+    program_data program = new_program_data (true);
+
+    for (regression_case &test : regression_cases())
+    {
+        // Each case starts from a blank image with no history, in full color
+        set_indexed_mode (program, false);
+        clear_bitmap (program.to_draw, COLOR_WHITE);
+        init_canvas_cache (program.canvas);
+        journal_reset (program.journal);
+        init_history (program);
+
+        test.run (program);
+
+        pixel_buffer image = read_pixels (program.to_draw, 0, 0, IMAGE_WIDTH, HEIGHT);
+        vector<string> problems = check_fast_paths (program, image);
+        string golden = check_golden (test.name, image, record);
+        unsigned int hash = hash_bytes ((const unsigned char *) image.pixels.data(), image.pixels.size() * sizeof (unsigned int));
+        char hash_text[9];
+
+        if (golden != "")
+            problems.push_back (golden);
+
+        snprintf (hash_text, sizeof (hash_text), "%08x", hash);
+        write_line ((problems.size() == 0 ? "PASS " : "FAIL ") + test.name + " " + hash_text);
+
+        for (string &problem : problems)
+            write_line ("    " + problem);
+
+        failures += problems.size() > 0;
+    }
+
+    vector<string> problems = check_kernels();
+    write_line ((problems.size() == 0 ? "PASS kernels " : "FAIL kernels ") + string (kernels().name));
+    for (string &problem : problems)
+        write_line ("    " + problem);
+    failures += problems.size() > 0;
+
+    write_line (to_string (failures) + " of " + to_string (regression_cases().size() + 1) + " cases failed");
+
+    close_journal (program.journal);
+    stop_jobs();
+
+    return failures;
+}
@@ -0,0 +1,469 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <map>
+
+using namespace std;
+
+/*  Everything drawn to the window is queued rather than drawn straight away, and the queue
+    is drawn when the window is refreshed. Before drawing, commands are put in layers: each
+    command goes in the layer after the last one holding a command it overlaps, so anything
+    it covers is still drawn before it. Within a layer the order doesn't matter, so commands
+    are grouped by kind, bitmap and color, which keeps the renderer on one texture and one
+    draw color for longer. Neighbouring filled rectangles of one color are then joined into
+    one. */
+
+enum render_kind
+{
+    RENDER_CLEAR,
+    RENDER_BITMAP,
+    RENDER_RECTANGLE,
+    RENDER_FILL_RECTANGLE,
+    RENDER_ELLIPSE,
+    RENDER_FILL_ELLIPSE,
+    RENDER_CIRCLE,
+    RENDER_FILL_CIRCLE,
+    RENDER_TRIANGLE,
+    RENDER_FILL_TRIANGLE,
+    RENDER_LINE,
+    RENDER_TEXT,
+    RENDER_KIND_COUNT
+};
+
+struct render_command
+{
+    render_kind kind;
+    color draw_color;
+    bitmap graphic;
+    bool has_options;
+    drawing_options options;
+    double v[6];
+    string text;
+    string font;
+    int font_size;
+
+    // Area of the window the command can draw to, and the layer it was put in
+    rectangle bounds;
+    int layer;
+};
+
+struct render_queue
+{
+    vector<render_command> commands;
+    bool debug;
+    string last_counts;
+};
+
+static map<window, render_queue> queues;
+
+/**
+ * Start a command on the queue for a window
+ *
+ * @param the_window    The window to be drawn to
+ * @param kind          What the command draws
+ * @param draw_color    Color the command draws with
+ * @param bounds        Area of the window the command can draw to
+ *
+ * @returns             The new command
+ */
+render_command &queue_command (window the_window, render_kind kind, color draw_color, rectangle bounds)
+{
+    render_command command;
+
+    command.kind = kind;
+    command.draw_color = draw_color;
+    command.graphic = nullptr;
+    command.has_options = false;
+    command.font_size = 0;
+    command.bounds = bounds;
+    command.layer = 0;
+
+    // A program without a window, as the regression check uses, draws nothing
+    if (the_window == nullptr)
+    {
+        static render_command discarded;
+        discarded = command;
+        return discarded;
+    }
+
+    queues[the_window].commands.push_back (command);
+    return queues[the_window].commands.back();
+}
+
+/**
+ * Get the bounds of a shape given by its top left corner and size, with a pixel spare all
+ * round for outlines
+ */
+rectangle shape_bounds (double x, double y, double width, double height)
+{
+    return rectangle_from (min (x, x + width) - 1, min (y, y + height) - 1, abs (width) + 2, abs (height) + 2);
+}
+
+/**
+ * Get the bounds of a shape given by two or three points, with a pixel spare all round
+ */
+rectangle point_bounds (const double *v, int count)
+{
+    double left = v[0], top = v[1], right = v[0], bottom = v[1];
+
+    for (int i = 1; i < count; i++)
+    {
+        left = min (left, v[i * 2]);
+        right = max (right, v[i * 2]);
+        top = min (top, v[i * 2 + 1]);
+        bottom = max (bottom, v[i * 2 + 1]);
+    }
+
+    return shape_bounds (left, top, right - left, bottom - top);
+}
+
+/**
+ * Queue clearing the window to a color
+ */
+void queue_clear (window the_window, color clear_color)
+{
+    queue_command (the_window, RENDER_CLEAR, clear_color, rectangle_from (0, 0, WINDOW_WIDTH, HEIGHT));
+}
+
+/**
+ * Queue drawing a bitmap on the window at its full size
+ */
+void queue_bitmap (window the_window, bitmap graphic, double x, double y)
+{
+    render_command &command = queue_command (the_window, RENDER_BITMAP, COLOR_WHITE, rectangle_from (x, y, bitmap_width (graphic), bitmap_height (graphic)));
+
+    command.graphic = graphic;
+    command.v[0] = x;
+    command.v[1] = y;
+}
+
+/**
+ * Queue drawing a bitmap on the window with drawing options. The options can scale or
+ * rotate it anywhere, so it is treated as covering the whole window.
+ */
+void queue_bitmap (window the_window, bitmap graphic, double x, double y, drawing_options options)
+{
+    render_command &command = queue_command (the_window, RENDER_BITMAP, COLOR_WHITE, rectangle_from (0, 0, WINDOW_WIDTH, HEIGHT));
+
+    command.graphic = graphic;
+    command.has_options = true;
+    command.options = options;
+    command.v[0] = x;
+    command.v[1] = y;
+}
+
+/**
+ * Queue a shape given by its top left corner and size
+ */
+void queue_shape (window the_window, render_kind kind, color draw_color, double x, double y, double width, double height)
+{
+    render_command &command = queue_command (the_window, kind, draw_color, shape_bounds (x, y, width, height));
+
+    command.v[0] = x;
+    command.v[1] = y;
+    command.v[2] = width;
+    command.v[3] = height;
+}
+
+void queue_rectangle (window the_window, color draw_color, double x, double y, double width, double height)
+{
+    queue_shape (the_window, RENDER_RECTANGLE, draw_color, x, y, width, height);
+}
+
+void queue_fill_rectangle (window the_window, color draw_color, double x, double y, double width, double height)
+{
+    queue_shape (the_window, RENDER_FILL_RECTANGLE, draw_color, x, y, width, height);
+}
+
+void queue_ellipse (window the_window, color draw_color, double x, double y, double width, double height)
+{
+    queue_shape (the_window, RENDER_ELLIPSE, draw_color, x, y, width, height);
+}
+
+void queue_fill_ellipse (window the_window, color draw_color, double x, double y, double width, double height)
+{
+    queue_shape (the_window, RENDER_FILL_ELLIPSE, draw_color, x, y, width, height);
+}
+
+void queue_circle (window the_window, color draw_color, double x, double y, double radius)
+{
+    render_command &command = queue_command (the_window, RENDER_CIRCLE, draw_color, shape_bounds (x - radius, y - radius, radius * 2, radius * 2));
+
+    command.v[0] = x;
+    command.v[1] = y;
+    command.v[2] = radius;
+}
+
+void queue_fill_circle (window the_window, color draw_color, double x, double y, double radius)
+{
+    render_command &command = queue_command (the_window, RENDER_FILL_CIRCLE, draw_color, shape_bounds (x - radius, y - radius, radius * 2, radius * 2));
+
+    command.v[0] = x;
+    command.v[1] = y;
+    command.v[2] = radius;
+}
+
+/**
+ * Queue a shape given by two or three points
+ */
+void queue_points (window the_window, render_kind kind, color draw_color, const double *v, int count)
+{
+    render_command &command = queue_command (the_window, kind, draw_color, point_bounds (v, count));
+
+    copy (v, v + count * 2, command.v);
+}
+
+void queue_triangle (window the_window, color draw_color, double x1, double y1, double x2, double y2, double x3, double y3)
+{
+    double v[6] = { x1, y1, x2, y2, x3, y3 };
+    queue_points (the_window, RENDER_TRIANGLE, draw_color, v, 3);
+}
+
+void queue_fill_triangle (window the_window, color draw_color, double x1, double y1, double x2, double y2, double x3, double y3)
+{
+    double v[6] = { x1, y1, x2, y2, x3, y3 };
+    queue_points (the_window, RENDER_FILL_TRIANGLE, draw_color, v, 3);
+}
+
+void queue_line (window the_window, color draw_color, double x1, double y1, double x2, double y2)
+{
+    double v[4] = { x1, y1, x2, y2 };
+    queue_points (the_window, RENDER_LINE, draw_color, v, 2);
+}
+
+/**
+ * Queue drawing text. How far it reaches depends on the font, so it is treated as covering
+ * the rest of the window to the right and below.
+ */
+void queue_text (window the_window, string text, color draw_color, string font, int font_size, double x, double y)
+{
+    render_command &command = queue_command (the_window, RENDER_TEXT, draw_color, rectangle_from (x, y, WINDOW_WIDTH - x, HEIGHT - y));
+
+    command.text = text;
+    command.font = font;
+    command.font_size = font_size;
+    command.v[0] = x;
+    command.v[1] = y;
+}
+
+/**
+ * Queue drawing text in the default font
+ */
+void queue_text (window the_window, string text, color draw_color, double x, double y)
+{
+    queue_text (the_window, text, draw_color, "", 0, x, y);
+}
+
+/**
+ * Check whether two areas overlap
+ */
+bool areas_overlap (const rectangle &a, const rectangle &b)
+{
+    return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+/**
+ * Check whether two commands give the same result whichever is drawn first, which is only
+ * known for opaque filled rectangles of one color
+ */
+bool draws_in_any_order (const render_command &a, const render_command &b)
+{
+    return a.kind == RENDER_FILL_RECTANGLE && b.kind == RENDER_FILL_RECTANGLE
+        && pack_color (a.draw_color) == pack_color (b.draw_color) && (pack_color (a.draw_color) >> 24) == 0xFF;
+}
+
+/**
+ * Put each queued command in the layer after the last one holding a command it overlaps
+ *
+ * @param commands  The queued commands, in the order they were queued
+ */
+void assign_layers (vector<render_command> &commands)
+{
+    // The bounds of everything in each layer so far, so most commands are placed without
+    // looking at every command before them
+    vector<rectangle> layer_bounds;
+    vector<vector<int>> layer_members;
+
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        render_command &command = commands[i];
+        int layer = 0;
+
+        for (int l = layer_bounds.size() - 1; l >= 0 && layer == 0; l--)
+        {
+            if (not areas_overlap (command.bounds, layer_bounds[l]))
+                continue;
+
+            for (int member : layer_members[l])
+                if (areas_overlap (command.bounds, commands[member].bounds) && not draws_in_any_order (command, commands[member]))
+                {
+                    layer = l + 1;
+                    break;
+                }
+        }
+
+        command.layer = layer;
+        if (layer == (int) layer_bounds.size())
+        {
+            layer_bounds.push_back (command.bounds);
+            layer_members.push_back (vector<int>());
+        }
+
+        rectangle &bounds = layer_bounds[layer];
+        double right = max (bounds.x + bounds.width, command.bounds.x + command.bounds.width);
+        double bottom = max (bounds.y + bounds.height, command.bounds.y + command.bounds.height);
+        bounds.x = min (bounds.x, command.bounds.x);
+        bounds.y = min (bounds.y, command.bounds.y);
+        bounds.width = right - bounds.x;
+        bounds.height = bottom - bounds.y;
+        layer_members[layer].push_back (i);
+    }
+}
+
+/**
+ * Join a filled rectangle onto the one before it, if they are the same color and together
+ * make one rectangle
+ *
+ * @param into      The rectangle before
+ * @param next      The rectangle after
+ *
+ * @returns         True if next was joined onto into
+ */
+bool join_rectangles (render_command &into, const render_command &next)
+{
+    if (into.kind != RENDER_FILL_RECTANGLE || next.kind != RENDER_FILL_RECTANGLE || pack_color (into.draw_color) != pack_color (next.draw_color))
+        return false;
+
+    const double *a = into.v, *b = next.v;
+
+    if (a[1] == b[1] && a[3] == b[3] && a[0] + a[2] == b[0])
+        into.v[2] += b[2];
+    else if (a[0] == b[0] && a[2] == b[2] && a[1] + a[3] == b[1])
+        into.v[3] += b[3];
+    else
+        return false;
+
+    into.bounds = shape_bounds (into.v[0], into.v[1], into.v[2], into.v[3]);
+    return true;
+}
+
+/**
+ * Draw a queued command on the window
+ */
+void draw_command (window the_window, const render_command &c)
+{
+    const double *v = c.v;
+
+    switch (c.kind)
+    {
+        case RENDER_CLEAR:          clear_window (the_window, c.draw_color);
+                                    break;
+        case RENDER_BITMAP:         if (c.has_options)
+                                        draw_bitmap_on_window (the_window, c.graphic, v[0], v[1], c.options);
+                                    else
+                                        draw_bitmap_on_window (the_window, c.graphic, v[0], v[1]);
+                                    break;
+        case RENDER_RECTANGLE:      draw_rectangle_on_window (the_window, c.draw_color, v[0], v[1], v[2], v[3]);
+                                    break;
+        case RENDER_FILL_RECTANGLE: fill_rectangle_on_window (the_window, c.draw_color, v[0], v[1], v[2], v[3]);
+                                    break;
+        case RENDER_ELLIPSE:        draw_ellipse_on_window (the_window, c.draw_color, v[0], v[1], v[2], v[3]);
+                                    break;
+        case RENDER_FILL_ELLIPSE:   fill_ellipse_on_window (the_window, c.draw_color, v[0], v[1], v[2], v[3]);
+                                    break;
+        case RENDER_CIRCLE:         draw_circle_on_window (the_window, c.draw_color, v[0], v[1], v[2]);
+                                    break;
+        case RENDER_FILL_CIRCLE:    fill_circle_on_window (the_window, c.draw_color, v[0], v[1], v[2]);
+                                    break;
+        case RENDER_TRIANGLE:       draw_triangle_on_window (the_window, c.draw_color, v[0], v[1], v[2], v[3], v[4], v[5]);
+                                    break;
+        case RENDER_FILL_TRIANGLE:  fill_triangle_on_window (the_window, c.draw_color, v[0], v[1], v[2], v[3], v[4], v[5]);
+                                    break;
+        case RENDER_LINE:           draw_line_on_window (the_window, c.draw_color, v[0], v[1], v[2], v[3]);
+                                    break;
+        case RENDER_TEXT:           if (c.font == "")
+                                        draw_text_on_window (the_window, c.text, c.draw_color, v[0], v[1]);
+                                    else
+                                        draw_text_on_window (the_window, c.text, c.draw_color, c.font, c.font_size, v[0], v[1]);
+                                    break;
+        case RENDER_KIND_COUNT:     break;
+    }
+}
+
+/**
+ * Draw everything queued for a window, then refresh it
+ *
+ * @param the_window    The window to be drawn and refreshed
+ */
+void flush_render (window the_window)
+{
+    if (the_window == nullptr)
+        return;
+
+    render_queue &queue = queues[the_window];
+    vector<render_command> &commands = queue.commands;
+    size_t queued = commands.size();
+    int counts[RENDER_KIND_COUNT] = {};
+
+    assign_layers (commands);
+
+    stable_sort (commands.begin(), commands.end(), [](const render_command &a, const render_command &b)
+    {
+        if (a.layer != b.layer)
+            return a.layer < b.layer;
+        if (a.kind != b.kind)
+            return a.kind < b.kind;
+        if (a.graphic != b.graphic)
+            return a.graphic < b.graphic;
+        return pack_color (a.draw_color) < pack_color (b.draw_color);
+    });
+
+    // Commands next to each other after sorting have nothing drawn between them, so they
+    // can be joined whichever layers they are in
+    size_t drawn = 0;
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        if (drawn > 0 && join_rectangles (commands[drawn - 1], commands[i]))
+            continue;
+        commands[drawn++] = commands[i];
+    }
+    commands.resize (drawn);
+
+    for (const render_command &command : commands)
+    {
+        draw_command (the_window, command);
+        counts[command.kind]++;
+    }
+
+    commands.clear();
+    refresh_window (the_window);
+
+    if (not queue.debug)
+        return;
+
+    // Only print when the counts change, so a steady frame doesn't flood the terminal
+    static const char *names[] = { "clear", "bitmap", "rect", "fill rect", "ellipse", "fill ellipse", "circle",
+                                   "fill circle", "triangle", "fill triangle", "line", "text" };
+    string text = to_string (queued) + " queued, " + to_string (drawn) + " drawn:";
+
+    for (int kind = 0; kind < RENDER_KIND_COUNT; kind++)
+        if (counts[kind] > 0)
+            text += " " + string (names[kind]) + " " + to_string (counts[kind]);
+
+    if (text != queue.last_counts)
+        write_line ("Render " + text);
+    queue.last_counts = text;
+}
+
+/**
+ * Turn printing the number of draw calls each frame on or off
+ *
+ * @param the_window    The window whose draw calls are counted
+ */
+void toggle_render_debug (window the_window)
+{
+    render_queue &queue = queues[the_window];
+
+    queue.debug = not queue.debug;
+    queue.last_counts = "";
+    write_line (queue.debug ? "Printing draw calls each frame" : "Stopped printing draw calls");
+}
@@ -0,0 +1,340 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cmath>
+
+// Distance between dabs along a stroke, as a share of the brush size
+#define BRUSH_SPACING 0.2
+// Share of the brush radius drawn at full strength, fading to nothing at the edge
+#define BRUSH_HARDNESS 0.5
+#define SMUDGE_STRENGTH 0.7
+#define BLUR_STRENGTH 1.0
+#define CLONE_STRENGTH 1.0
+// Radius of the box blur each dab of the blur brush mixes in
+#define BLUR_RADIUS 2
+
+using namespace std;
+
+/*  The sampling brushes read the image under them as well as writing it, so a stroke works
+    on an in-memory copy of the whole image rather than going through get_pixel. Each dab
+    blends a square of pixels towards a source the size of the brush: the colors the smudge
+    brush picked up, a blurred copy of the square, or the square the clone brush copies
+    from. The blend weight of each pixel of the square comes from a mask made once a stroke,
+    so a dab is one blend_row kernel call along each row. Only the area the dabs covered
+    since the last frame is written to the user image. */
+
+// The mask of a stroke, and the colors the smudge brush is carrying
+struct brush_state
+{
+    int size;
+    vector<unsigned int> weights;
+    vector<unsigned int> carried;
+    bool carrying;
+};
+
+/**
+ * Get the name of a sampling brush
+ *
+ * @param mode      The brush
+ *
+ * @returns         The name of the brush
+ */
+string brush_name (mode_option mode)
+{
+    switch (mode)
+    {
+        case SMUDGE:        return "Smudge";
+        case BLUR_BRUSH:    return "Blur brush";
+        case CLONE:         return "Clone stamp";
+        default:            break;
+    }
+
+    return "";
+}
+
+/**
+ * Set up the mask of a stroke. Each weight is out of 256, where 256 replaces the pixel.
+ *
+ * @param command   The stroke, with its size and strength
+ *
+ * @returns         The brush state for the start of the stroke
+ */
+brush_state start_brush (const tool_command &command)
+{
+    brush_state result;
+    int size = command.values[0];
+    double radius = size / 2.0;
+
+    result.size = size;
+    result.weights.assign ((size_t) size * size, 0);
+    result.carried.assign ((size_t) size * size, 0);
+    result.carrying = false;
+
+    for (int j = 0; j < size; j++)
+    {
+        for (int i = 0; i < size; i++)
+        {
+            double dx = i + 0.5 - radius, dy = j + 0.5 - radius;
+            double distance = sqrt (dx * dx + dy * dy) / radius;
+            double falloff = distance >= 1 ? 0 : distance <= BRUSH_HARDNESS ? 1 : (1 - distance) / (1 - BRUSH_HARDNESS);
+
+            result.weights[(size_t) j * size + i] = round (256 * command.values[1] * falloff);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Draw one dab of a sampling brush on a buffer of pixels
+ *
+ * @param pixels    The pixels to be drawn on
+ * @param left      x position of the buffer in the user image
+ * @param top       y position of the buffer in the user image
+ * @param command   The stroke
+ * @param state     The brush state, which the smudge brush updates
+ * @param point     Centre of the dab in the user image
+ *
+ * @returns         The area of the user image the dab changed
+ */
+rectangle brush_dab (pixel_buffer &pixels, int left, int top, const tool_command &command, brush_state &state, point_2d point)
+{
+    int size = state.size;
+    int brush_x = (int) floor (point.x) - size / 2 - left;
+    int brush_y = (int) floor (point.y) - size / 2 - top;
+    int start_x = max (brush_x, 0), start_y = max (brush_y, 0);
+    int end_x = min (brush_x + size, pixels.width), end_y = min (brush_y + size, pixels.height);
+
+    // The clone brush can only draw where the square it copies from is on the image too
+    if (command.mode == CLONE)
+    {
+        int offset_x = command.values[2], offset_y = command.values[3];
+
+        start_x = max (start_x, -offset_x);
+        start_y = max (start_y, -offset_y);
+        end_x = min (end_x, pixels.width - offset_x);
+        end_y = min (end_y, pixels.height - offset_y);
+    }
+
+    if (start_x >= end_x || start_y >= end_y)
+        return rectangle_from (0, 0, 0, 0);
+
+    int width = end_x - start_x, height = end_y - start_y;
+    pixel_buffer source;
+    int source_x = 0, source_y = 0;
+
+    if (command.mode == SMUDGE)
+    {
+        // The first dab only picks up the colors under the brush. Where the brush hangs off
+        // the image it picks up the nearest pixel on the image, so a later dab never blends
+        // in colors from outside it.
+        if (not state.carrying)
+        {
+            for (int j = 0; j < size; j++)
+            {
+                int y = min (max (brush_y + j, 0), pixels.height - 1);
+
+                for (int i = 0; i < size; i++)
+                {
+                    int x = min (max (brush_x + i, 0), pixels.width - 1);
+                    state.carried[(size_t) j * size + i] = pixels.pixels[(size_t) y * pixels.width + x];
+                }
+            }
+            state.carrying = true;
+            return rectangle_from (0, 0, 0, 0);
+        }
+
+        for (int y = start_y; y < end_y; y++)
+        {
+            unsigned int *row = &pixels.pixels[(size_t) y * pixels.width + start_x];
+            unsigned int *carried = &state.carried[(size_t) (y - brush_y) * size + start_x - brush_x];
+
+            kernels().blend_row (row, carried, &state.weights[(size_t) (y - brush_y) * size + start_x - brush_x], width);
+            copy (row, row + width, carried);
+        }
+
+        return rectangle_from (start_x + left, start_y + top, width, height);
+    }
+
+    if (command.mode == BLUR_BRUSH)
+    {
+        // Blur a little past the square, so its edges are blurred with the pixels beside them
+        source_x = max (start_x - BLUR_RADIUS, 0);
+        source_y = max (start_y - BLUR_RADIUS, 0);
+        source = copy_pixels (pixels, source_x, source_y, min (end_x + BLUR_RADIUS, pixels.width) - source_x,
+                              min (end_y + BLUR_RADIUS, pixels.height) - source_y);
+        box_blur (source, BLUR_RADIUS);
+        source_x -= start_x;
+        source_y -= start_y;
+    }
+    else
+        source = copy_pixels (pixels, start_x + command.values[2], start_y + command.values[3], width, height);
+
+    for (int y = start_y; y < end_y; y++)
+        kernels().blend_row (&pixels.pixels[(size_t) y * pixels.width + start_x],
+                             &source.pixels[(size_t) (y - start_y - source_y) * source.width - source_x],
+                             &state.weights[(size_t) (y - brush_y) * size + start_x - brush_x], width);
+
+    return rectangle_from (start_x + left, start_y + top, width, height);
+}
+
+/**
+ * Find the area of the user image a sampling brush stroke reads, which is the area it
+ * changes along with the pixels the blur reaches past it or the area the clone copies from
+ *
+ * @param command   The stroke
+ *
+ * @returns         The area, inside the user image
+ */
+rectangle brush_read_area (const tool_command &command)
+{
+    rectangle area = command_bounds (command);
+    double left = area.x, top = area.y, right = area.x + area.width, bottom = area.y + area.height;
+
+    if (command.mode == BLUR_BRUSH)
+    {
+        left -= BLUR_RADIUS;
+        top -= BLUR_RADIUS;
+        right += BLUR_RADIUS;
+        bottom += BLUR_RADIUS;
+    }
+    else if (command.mode == CLONE)
+    {
+        left = min (left, left + command.values[2]);
+        top = min (top, top + command.values[3]);
+        right = max (right, right + command.values[2]);
+        bottom = max (bottom, bottom + command.values[3]);
+    }
+
+    left = max (floor (left), 0.0);
+    top = max (floor (top), 0.0);
+    right = min (ceil (right), (double) IMAGE_WIDTH);
+    bottom = min (ceil (bottom), (double) HEIGHT);
+
+    return rectangle_from (left, top, max (right - left, 0.0), max (bottom - top, 0.0));
+}
+
+/**
+ * Draw a whole sampling brush stroke on a buffer of pixels. The buffer must hold the area
+ * given by brush_read_area, and then gives the same result as the tool did on the whole image.
+ *
+ * @param pixels    The pixels to be drawn on
+ * @param left      x position of the buffer in the user image
+ * @param top       y position of the buffer in the user image
+ * @param command   The stroke
+ */
+void brush_stroke (pixel_buffer &pixels, int left, int top, const tool_command &command)
+{
+    brush_state state = start_brush (command);
+
+    for (point_2d point : command.points)
+        brush_dab (pixels, left, top, command, state, point);
+}
+
+/**
+ * Grow an area to cover another
+ *
+ * @param area      The area to be grown, with a width of 0 if it is empty
+ * @param added     The area to be covered
+ */
+void add_area (rectangle &area, rectangle added)
+{
+    if (added.width <= 0 || added.height <= 0)
+        return;
+
+    if (area.width <= 0)
+    {
+        area = added;
+        return;
+    }
+
+    double right = max (area.x + area.width, added.x + added.width);
+    double bottom = max (area.y + area.height, added.y + added.height);
+    area.x = min (area.x, added.x);
+    area.y = min (area.y, added.y);
+    area.width = right - area.x;
+    area.height = bottom - area.y;
+}
+
+/**
+ * Copy an area of the working pixels of a stroke to the user image
+ *
+ * @param program   Struct containing program data
+ * @param pixels    The working pixels, covering the whole image
+ * @param area      The area to be copied, which is emptied afterwards
+ */
+void write_brush_area (program_data &program, const pixel_buffer &pixels, rectangle &area)
+{
+    if (area.width <= 0)
+        return;
+
+    write_pixels (program.to_draw, copy_pixels (pixels, area.x, area.y, area.width, area.height), area.x, area.y);
+    area = rectangle_from (0, 0, 0, 0);
+}
+
+/**
+ * Smudge, blur brush and clone stamp draw modes. Draws dabs along the stroke while the left
+ * mouse is down, reading the image under the brush from the in-memory copy. Shift clicking
+ * with the clone stamp chooses where it copies from.
+ *
+ * @param program   Struct containing program data
+ */
+void sampling_brush_tool (program_data &program)
+{
+    sampling_brush &brush = program.brush;
+
+    if (program.mode == CLONE && (key_down (LEFT_SHIFT_KEY) || key_down (RIGHT_SHIFT_KEY) || not brush.has_source))
+    {
+        if (key_down (LEFT_SHIFT_KEY) || key_down (RIGHT_SHIFT_KEY))
+        {
+            brush.source = mouse_position();
+            brush.has_source = true;
+            brush.has_offset = false;
+        }
+        else
+            write_line ("Shift click to choose where the clone stamp copies from");
+
+        while (mouse_down (LEFT_BUTTON))
+            process_events();
+        return;
+    }
+
+    tool_command command = new_command (program);
+    command.values.push_back (brush.size);
+    command.values.push_back (program.mode == SMUDGE ? SMUDGE_STRENGTH : program.mode == BLUR_BRUSH ? BLUR_STRENGTH : CLONE_STRENGTH);
+
+    // The first stroke after choosing the source sets how far from the brush it is
+    if (program.mode == CLONE)
+    {
+        if (not brush.has_offset)
+        {
+            brush.offset_x = round (brush.source.x - mouse_x());
+            brush.offset_y = round (brush.source.y - mouse_y());
+            brush.has_offset = true;
+        }
+        command.values.push_back (brush.offset_x);
+        command.values.push_back (brush.offset_y);
+    }
+
+    pixel_buffer pixels = canvas_pixels (program);
+    brush_state state = start_brush (command);
+    rectangle changed = rectangle_from (0, 0, 0, 0);
+    double spacing = max (brush.size * BRUSH_SPACING, 1.0);
+    bool drawing = true;
+
+    while (drawing)
+    {
+        input_sample sample = sample_input (program);
+        int added = extend_stroke (command.points, sample.position, spacing);
+
+        for (size_t i = command.points.size() - added; i < command.points.size(); i++)
+            add_area (changed, brush_dab (pixels, 0, 0, command, state, command.points[i]));
+        drawing = sample.left_down;
+
+        if (frame_due (program))
+            write_brush_area (program, pixels, changed);
+        present_frame (program);
+    }
+
+    write_brush_area (program, pixels, changed);
+    record_command (program, command);
+}
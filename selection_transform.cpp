@@ -0,0 +1,371 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cmath>
+
+#define PI 3.14159
+#define HANDLE_SIZE 8
+#define ROTATE_HANDLE_OFFSET 20
+#define MIN_SCALE 0.05
+#define RESAMPLE_TILE 64
+
+using namespace std;
+
+/**
+ * Rotate a vector clockwise on screen by an angle in degrees
+ *
+ * @param v         The vector to be rotated
+ * @param angle     The angle to rotate by, in degrees
+ *
+ * @returns         The rotated vector
+ */
+point_2d rotate_vector (point_2d v, double angle)
+{
+    point_2d result;
+    double rad = angle * PI / 180;
+
+    result.x = v.x * cos (rad) - v.y * sin (rad);
+    result.y = v.x * sin (rad) + v.y * cos (rad);
+
+    return result;
+}
+
+/**
+ * Find the centre of a selection. Scaling and rotation are both done around this point,
+ * which matches the way SplashKit applies drawing options to a bitmap.
+ *
+ * @param selection     The selected area
+ *
+ * @returns             The centre point of the selection
+ */
+point_2d selection_centre (select_tool_data &selection)
+{
+    point_2d result;
+
+    result.x = selection.x + bitmap_width (selection.graphic) / 2.0;
+    result.y = selection.y + bitmap_height (selection.graphic) / 2.0;
+
+    return result;
+}
+
+/**
+ * Find a point on the selection outline after scaling and rotation
+ *
+ * @param selection     The selected area
+ * @param x_side        -1 for the left edge, 1 for the right edge, 0 for the middle
+ * @param y_side        -1 for the top edge, 1 for the bottom edge, 0 for the middle
+ *
+ * @returns             The point in window coordinates
+ */
+point_2d selection_corner (select_tool_data &selection, int x_side, int y_side)
+{
+    point_2d centre = selection_centre (selection);
+    point_2d offset;
+
+    offset.x = x_side * bitmap_width (selection.graphic) * selection.scale_x / 2;
+    offset.y = y_side * bitmap_height (selection.graphic) * selection.scale_y / 2;
+    offset = rotate_vector (offset, selection.angle);
+
+    offset.x += centre.x;
+    offset.y += centre.y;
+
+    return offset;
+}
+
+/**
+ * Find the position of the rotate handle, which sits above the top edge of the selection
+ *
+ * @param selection     The selected area
+ *
+ * @returns             The handle position in window coordinates
+ */
+point_2d rotate_handle (select_tool_data &selection)
+{
+    point_2d centre = selection_centre (selection);
+    point_2d offset;
+
+    offset.x = 0;
+    offset.y = -(bitmap_height (selection.graphic) * selection.scale_y / 2 + ROTATE_HANDLE_OFFSET);
+    offset = rotate_vector (offset, selection.angle);
+
+    offset.x += centre.x;
+    offset.y += centre.y;
+
+    return offset;
+}
+
+/**
+ * Convert a window position into the selection's own unscaled, unrotated space, relative to its centre
+ *
+ * @param selection     The selected area
+ * @param x             x position in the window
+ * @param y             y position in the window
+ *
+ * @returns             The position relative to the selection centre
+ */
+point_2d selection_local (select_tool_data &selection, double x, double y)
+{
+    point_2d centre = selection_centre (selection);
+    point_2d offset;
+
+    offset.x = x - centre.x;
+    offset.y = y - centre.y;
+
+    return rotate_vector (offset, -selection.angle);
+}
+
+/**
+ * Check if the mouse cursor is over a handle
+ *
+ * @param handle    The handle position
+ *
+ * @returns         True if the cursor is over the handle, false otherwise
+ */
+bool mouse_on_handle (point_2d handle)
+{
+    return fabs (mouse_x() - handle.x) <= HANDLE_SIZE && fabs (mouse_y() - handle.y) <= HANDLE_SIZE;
+}
+
+/**
+ * Draw the selected area with its current scale and rotation, along with its outline and handles.
+ * The preview is drawn by SplashKit directly from the selection bitmap, so no pixels are resampled here.
+ *
+ * @param the_window    The window to be drawn to
+ * @param selection     The selected area
+ */
+void draw_transformed_selection (window &the_window, select_tool_data &selection)
+{
+    point_2d corners[4] = { selection_corner (selection, -1, -1), selection_corner (selection, 1, -1),
+                            selection_corner (selection, 1, 1), selection_corner (selection, -1, 1) };
+    point_2d top = selection_corner (selection, 0, -1);
+    point_2d handle = rotate_handle (selection);
+
+    queue_bitmap (the_window, selection.graphic, selection.x, selection.y,
+                  option_scale_bmp (selection.scale_x, selection.scale_y, option_rotate_bmp (selection.angle)));
+
+    for (int i = 0; i < 4; i++)
+        queue_line (the_window, COLOR_GRAY, corners[i].x, corners[i].y, corners[(i + 1) % 4].x, corners[(i + 1) % 4].y);
+
+    // Scale handle on the bottom right corner, rotate handle above the top edge
+    queue_fill_rectangle (the_window, COLOR_GRAY, corners[2].x - HANDLE_SIZE / 2, corners[2].y - HANDLE_SIZE / 2, HANDLE_SIZE, HANDLE_SIZE);
+    queue_line (the_window, COLOR_GRAY, top.x, top.y, handle.x, handle.y);
+    queue_fill_circle (the_window, COLOR_GRAY, handle.x, handle.y, HANDLE_SIZE / 2);
+}
+
+/**
+ * Move, scale or rotate the selected area while the left mouse button is held down, depending
+ * on where the mouse was pressed.
+ *
+ * @param program       Struct containing program data
+ * @param selection     The selected area
+ *
+ * @returns             False if the mouse was pressed outside the selection, true otherwise
+ */
+bool transform_selection (program_data &program, select_tool_data &selection)
+{
+    point_2d start = selection_local (selection, mouse_x(), mouse_y());
+    double half_width = bitmap_width (selection.graphic) / 2.0;
+    double half_height = bitmap_height (selection.graphic) / 2.0;
+    double last_x = mouse_x();
+    double last_y = mouse_y();
+    point_2d local, centre;
+    bool scaling = mouse_on_handle (selection_corner (selection, 1, 1));
+    bool rotating = not scaling && mouse_on_handle (rotate_handle (selection));
+
+    if (not scaling && not rotating
+        && (fabs (start.x) > half_width * selection.scale_x || fabs (start.y) > half_height * selection.scale_y))
+        return false;
+
+    while (mouse_down (LEFT_BUTTON))
+    {
+        process_events();
+
+        if (scaling)
+        {
+            local = selection_local (selection, mouse_x(), mouse_y());
+            selection.scale_x = max (fabs (local.x) / half_width, MIN_SCALE);
+            selection.scale_y = max (fabs (local.y) / half_height, MIN_SCALE);
+        }
+
+        else if (rotating)
+        {
+            // The handle starts straight above the centre, so add a quarter turn
+            centre = selection_centre (selection);
+            selection.angle = atan2 (mouse_y() - centre.y, mouse_x() - centre.x) * 180 / PI + 90;
+        }
+
+        else
+        {
+            selection.x += mouse_x() - last_x;
+            selection.y += mouse_y() - last_y;
+        }
+
+        last_x = mouse_x();
+        last_y = mouse_y();
+
+        queue_bitmap (program.the_window, program.to_draw, 0, 0);
+        draw_transformed_selection (program.the_window, selection);
+        draw_sidebar (program);
+
+        flush_render (program.the_window);
+    }
+
+    return true;
+}
+
+/**
+ * Catmull-Rom cubic weight for a sample at a given distance
+ *
+ * @param t     Distance from the sample point
+ *
+ * @returns     The weight of the sample
+ */
+double cubic_weight (double t)
+{
+    t = fabs (t);
+
+    if (t < 1)
+        return 1.5 * t * t * t - 2.5 * t * t + 1;
+    if (t < 2)
+        return -0.5 * t * t * t + 2.5 * t * t - 4 * t + 2;
+    return 0;
+}
+
+/**
+ * Sample a pixel buffer at a fractional position using bicubic interpolation. Samples are
+ * weighted by alpha, and anything outside the buffer counts as transparent, so the
+ * edges of a rotated selection come out anti-aliased.
+ *
+ * @param source    The pixels to sample from
+ * @param u         x position to sample, in pixels
+ * @param v         y position to sample, in pixels
+ *
+ * @returns         The packed sampled pixel
+ */
+unsigned int sample_bicubic (const pixel_buffer &source, double u, double v)
+{
+    int base_x = floor (u);
+    int base_y = floor (v);
+    double weight_x[4], weight_y[4];
+    double sum_a = 0, sum_r = 0, sum_g = 0, sum_b = 0;
+
+    for (int k = 0; k < 4; k++)
+    {
+        weight_x[k] = cubic_weight (u - (base_x - 1 + k));
+        weight_y[k] = cubic_weight (v - (base_y - 1 + k));
+    }
+
+    for (int j = 0; j < 4; j++)
+    {
+        int sy = base_y - 1 + j;
+        if (sy < 0 || sy >= source.height)
+            continue;
+
+        for (int i = 0; i < 4; i++)
+        {
+            int sx = base_x - 1 + i;
+            if (sx < 0 || sx >= source.width)
+                continue;
+
+            unsigned int pixel = source.pixels[sy * source.width + sx];
+            double w = weight_x[i] * weight_y[j] * (pixel >> 24) / 255.0;
+
+            sum_a += w;
+            sum_r += w * ((pixel >> 16) & 0xFF);
+            sum_g += w * ((pixel >> 8) & 0xFF);
+            sum_b += w * (pixel & 0xFF);
+        }
+    }
+
+    if (sum_a <= 0.002)
+        return 0;
+
+    unsigned int a = min (sum_a, 1.0) * 255 + 0.5;
+    unsigned int r = min (max (sum_r / sum_a, 0.0), 255.0) + 0.5;
+    unsigned int g = min (max (sum_g / sum_a, 0.0), 255.0) + 0.5;
+    unsigned int b = min (max (sum_b / sum_a, 0.0), 255.0) + 0.5;
+
+    return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+/**
+ * Find the smallest upright rectangle holding the selection as it has been transformed
+ *
+ * @param selection     The selected area
+ *
+ * @returns             The bounding rectangle of the selection
+ */
+rectangle selection_bounds (select_tool_data &selection)
+{
+    point_2d corners[4] = { selection_corner (selection, -1, -1), selection_corner (selection, 1, -1),
+                            selection_corner (selection, 1, 1), selection_corner (selection, -1, 1) };
+    double left = corners[0].x, top = corners[0].y, right = corners[0].x, bottom = corners[0].y;
+
+    for (point_2d corner : corners)
+    {
+        left = min (left, corner.x);
+        top = min (top, corner.y);
+        right = max (right, corner.x);
+        bottom = max (bottom, corner.y);
+    }
+
+    return rectangle_from (left, top, right - left, bottom - top);
+}
+
+/**
+ * Draw the selected area onto the user image. If the selection was scaled or rotated it is
+ * resampled once with a bicubic filter, split into tiles across threads, and only the part
+ * that lands on the image is computed.
+ *
+ * @param to_draw       The main user image
+ * @param selection     The selected area
+ */
+void commit_selection (bitmap to_draw, select_tool_data &selection)
+{
+    if (selection.scale_x == 1 && selection.scale_y == 1 && selection.angle == 0)
+    {
+        draw_bitmap_on_bitmap (to_draw, selection.graphic, selection.x, selection.y);
+        free_bitmap (selection.graphic);
+        return;
+    }
+
+    int width = bitmap_width (selection.graphic);
+    int height = bitmap_height (selection.graphic);
+    pixel_buffer source = read_pixels (selection.graphic, 0, 0, width, height);
+    rectangle bounds = selection_bounds (selection);
+    point_2d centre = selection_centre (selection);
+    double cos_a = cos (selection.angle * PI / 180);
+    double sin_a = sin (selection.angle * PI / 180);
+
+    // Only resample the part of the transformed selection that is on the image
+    int x_start = max ((int) floor (bounds.x), 0);
+    int y_start = max ((int) floor (bounds.y), 0);
+    int x_end = min ((int) ceil (bounds.x + bounds.width), IMAGE_WIDTH);
+    int y_end = min ((int) ceil (bounds.y + bounds.height), HEIGHT);
+
+    if (x_end > x_start && y_end > y_start)
+    {
+        pixel_buffer result = new_pixel_buffer (x_end - x_start, y_end - y_start);
+
+        parallel_tiles (result.width, result.height, RESAMPLE_TILE, [&](int tile_x, int tile_y, int tile_width, int tile_height)
+        {
+            for (int j = tile_y; j < tile_y + tile_height; j++)
+            {
+                for (int i = tile_x; i < tile_x + tile_width; i++)
+                {
+                    // Map the destination pixel centre back to a position in the source pixels
+                    double dx = x_start + i + 0.5 - centre.x;
+                    double dy = y_start + j + 0.5 - centre.y;
+                    double u = (dx * cos_a + dy * sin_a) / selection.scale_x + width / 2.0 - 0.5;
+                    double v = (dy * cos_a - dx * sin_a) / selection.scale_y + height / 2.0 - 0.5;
+
+                    if (u > -1 && v > -1 && u < width && v < height)
+                        result.pixels[j * result.width + i] = sample_bicubic (source, u, v);
+                }
+            }
+        });
+
+        write_pixels (to_draw, result, x_start, y_start);
+    }
+
+    free_bitmap (selection.graphic);
+}
@@ -0,0 +1,48 @@
+#ifndef SHARED_CANVAS_H
+#define SHARED_CANVAS_H
+
+#include <atomic>
+#include <cstdint>
+
+/*  Layout of the shared memory the user image is published to, so other programs on the same
+    machine can map it and read the image without copying it through a file.
+
+    The header is followed by the pixels, packed 0xAARRGGBB a row at a time. Each publish
+    makes sequence odd, copies in the areas that changed, adds them to the ring of dirty
+    areas and makes sequence even again. A reader that sees the same even sequence before
+    and after copying has a consistent copy. Dirty areas are numbered from the start, so a
+    reader only copies the areas numbered after the last one it saw. If those have already
+    been overwritten in the ring, it copies the whole image instead.
+
+    Each time the editor starts sharing, session changes. Stopping removes the shared memory,
+    so starting again usually creates new memory under the same name, which a reader notices
+    by opening the name again. After a crash the editor reuses the memory left behind, and
+    a reader notices the new session instead. Either way it copies the whole image again. */
+
+#define SHARED_CANVAS_NAME "/graphic_creator_canvas"
+#define SHARED_CANVAS_MAGIC 0x53434743
+#define SHARED_CANVAS_VERSION 2
+#define SHARED_DIRTY_SLOTS 256
+
+struct shared_dirty_area
+{
+    uint64_t sequence;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+};
+
+struct shared_canvas_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint64_t session;
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> dirty_count;
+    shared_dirty_area dirty[SHARED_DIRTY_SLOTS];
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include "../shared_canvas.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Microseconds between checks for a new publish
+#define POLL_INTERVAL 16000
+
+using namespace std;
+
+// An area copied out of shared memory, kept apart until the copy is known not to be torn
+struct copied_area
+{
+    shared_dirty_area area;
+    vector<uint32_t> pixels;
+};
+
+/*  Sample reader for the shared canvas. It keeps its own copy of the image up to date by
+    copying only the areas published since it last looked, and prints what it copied. Build
+    it on its own, away from the editor:
+
+        g++ -O2 -o shared_canvas_reader tools/shared_canvas_reader.cpp -lrt
+
+    then run it while the editor is sharing the image (Ctrl+B). Given a file name it also
+    saves its copy as a PPM image after each update. */
+
+/**
+ * Map the shared canvas read only, waiting until the editor has created it
+ *
+ * @param size      Set to the size of the mapping
+ * @param inode     Set to the inode of the shared memory, to tell it apart from memory
+ *                  created under the same name later
+ *
+ * @returns         The header of the shared canvas
+ */
+const shared_canvas_header *map_shared_canvas (size_t &size, ino_t &inode)
+{
+    while (true)
+    {
+        int file = shm_open (SHARED_CANVAS_NAME, O_RDONLY, 0);
+        struct stat info;
+
+        if (file >= 0 && fstat (file, &info) == 0 && (size_t) info.st_size > sizeof (shared_canvas_header))
+        {
+            void *map = mmap (nullptr, info.st_size, PROT_READ, MAP_SHARED, file, 0);
+            close (file);
+
+            const shared_canvas_header *header = (const shared_canvas_header *) map;
+            if (map != MAP_FAILED && header->magic == SHARED_CANVAS_MAGIC && header->version == SHARED_CANVAS_VERSION)
+            {
+                size = info.st_size;
+                inode = info.st_ino;
+                return header;
+            }
+
+            if (map != MAP_FAILED)
+                munmap (map, info.st_size);
+        }
+        else if (file >= 0)
+            close (file);
+
+        usleep (POLL_INTERVAL * 10);
+    }
+}
+
+/**
+ * Check whether the editor has stopped sharing and started again since the shared canvas
+ * was mapped, which leaves the old mapping with the last image it published
+ *
+ * @param inode     Inode of the mapped shared memory
+ *
+ * @returns         True if there is different shared memory under the name now
+ */
+bool shared_canvas_replaced (ino_t inode)
+{
+    int file = shm_open (SHARED_CANVAS_NAME, O_RDONLY, 0);
+    struct stat info;
+    bool replaced = false;
+
+    if (file < 0)
+        return false;
+
+    if (fstat (file, &info) == 0)
+        replaced = info.st_ino != inode;
+    close (file);
+
+    return replaced;
+}
+
+/**
+ * Copy an area of the shared pixels out of shared memory. Areas are read from the ring
+ * while the editor may be overwriting them, so the area is clamped to the image first.
+ *
+ * @param shared    Pixels in shared memory
+ * @param width     Width of the image
+ * @param height    Height of the image
+ * @param area      The area to be copied
+ *
+ * @returns         The area, clamped to the image, and its pixels
+ */
+copied_area copy_area (const uint32_t *shared, int width, int height, shared_dirty_area area)
+{
+    copied_area result;
+    int64_t left = min (max ((int64_t) area.x, (int64_t) 0), (int64_t) width);
+    int64_t top = min (max ((int64_t) area.y, (int64_t) 0), (int64_t) height);
+    int64_t right = min (max ((int64_t) area.x + area.width, left), (int64_t) width);
+    int64_t bottom = min (max ((int64_t) area.y + area.height, top), (int64_t) height);
+
+    result.area = { area.sequence, (int32_t) left, (int32_t) top, (int32_t) (right - left), (int32_t) (bottom - top) };
+    result.pixels.resize ((size_t) result.area.width * result.area.height);
+
+    for (int y = 0; y < result.area.height; y++)
+        memcpy (&result.pixels[(size_t) y * result.area.width], &shared[(size_t) (top + y) * width + left], result.area.width * sizeof (uint32_t));
+
+    return result;
+}
+
+/**
+ * Put the pixels of a copied area into the local copy
+ *
+ * @param local     The local copy
+ * @param width     Width of the image
+ * @param copy      The area and its pixels
+ */
+void paste_area (vector<uint32_t> &local, int width, const copied_area &copy)
+{
+    const shared_dirty_area &area = copy.area;
+
+    for (int y = 0; y < area.height; y++)
+        memcpy (&local[(size_t) (area.y + y) * width + area.x], &copy.pixels[(size_t) y * area.width], area.width * sizeof (uint32_t));
+}
+
+/**
+ * Save the local copy as a binary PPM image
+ *
+ * @param path      The file to be written
+ * @param pixels    The local copy
+ * @param width     Width of the image
+ * @param height    Height of the image
+ */
+void save_ppm (string path, const vector<uint32_t> &pixels, int width, int height)
+{
+    FILE *file = fopen (path.c_str(), "wb");
+    vector<unsigned char> row (width * 3);
+
+    if (file == nullptr)
+        return;
+
+    fprintf (file, "P6\n%d %d\n255\n", width, height);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            uint32_t pixel = pixels[(size_t) y * width + x];
+            row[x * 3] = (pixel >> 16) & 0xFF;
+            row[x * 3 + 1] = (pixel >> 8) & 0xFF;
+            row[x * 3 + 2] = pixel & 0xFF;
+        }
+        fwrite (row.data(), 1, row.size(), file);
+    }
+
+    fclose (file);
+}
+
+int main (int argc, char *argv[])
+{
+    size_t size;
+    ino_t inode;
+    const shared_canvas_header *header = map_shared_canvas (size, inode);
+    const uint32_t *shared = (const uint32_t *) (header + 1);
+    int width = header->width, height = header->height;
+    vector<uint32_t> local ((size_t) width * height, 0);
+    uint64_t last_sequence = 0, last_count = 0, last_session = 0;
+    bool have_image = false;
+
+    printf ("Reading %dx%d shared canvas\n", width, height);
+
+    while (true)
+    {
+        uint64_t sequence = header->sequence.load (memory_order_acquire);
+
+        if (sequence % 2 == 1 || (have_image && sequence == last_sequence))
+        {
+            // Nothing changes in memory the editor has stopped sharing, so while idle check
+            // whether it is sharing new memory instead
+            if (sequence % 2 == 0 && shared_canvas_replaced (inode))
+            {
+                munmap ((void *) header, size);
+                header = map_shared_canvas (size, inode);
+                shared = (const uint32_t *) (header + 1);
+                width = header->width;
+                height = header->height;
+                local.assign ((size_t) width * height, 0);
+                have_image = false;
+                printf ("The editor started sharing again\n");
+                continue;
+            }
+
+            usleep (POLL_INTERVAL);
+            continue;
+        }
+
+        uint64_t count = header->dirty_count.load (memory_order_relaxed);
+        uint64_t session = header->session;
+        vector<copied_area> copies;
+        size_t copied = 0, areas = 0;
+
+        // Copy everything if this is the first look, the editor started a new session in
+        // memory left over from a crash, or the areas since the last look have been
+        // overwritten in the ring
+        if (not have_image || session != last_session || count - last_count > SHARED_DIRTY_SLOTS)
+        {
+            shared_dirty_area whole = { sequence, 0, 0, width, height };
+            copies.push_back (copy_area (shared, width, height, whole));
+        }
+        else
+        {
+            for (uint64_t i = last_count; i < count; i++, areas++)
+                copies.push_back (copy_area (shared, width, height, header->dirty[i % SHARED_DIRTY_SLOTS]));
+        }
+
+        // The editor published again while copying, so the copy may be torn and is thrown
+        // away without touching the local copy
+        atomic_thread_fence (memory_order_acquire);
+        if (header->sequence.load (memory_order_relaxed) != sequence)
+            continue;
+
+        for (const copied_area &copy : copies)
+        {
+            paste_area (local, width, copy);
+            copied += copy.pixels.size();
+        }
+
+        printf ("Sequence %llu: %zu areas, %zu pixels copied\n", (unsigned long long) sequence, areas, copied);
+        fflush (stdout);
+
+        if (argc > 1)
+            save_ppm (argv[1], local, width, height);
+
+        last_sequence = sequence;
+        last_count = count;
+        last_session = session;
+        have_image = true;
+    }
+}
@@ -0,0 +1,485 @@
+#include "graphic_creator.h"
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define JOURNAL_FILE "undo_journal.dat"
+#define JOURNAL_MAGIC 0x314A4153
+#define JOURNAL_RECORD_MAGIC 0x4345524A
+#define JOURNAL_HEADER_SIZE 64
+#define JOURNAL_INITIAL_SIZE (64 << 20)
+#define JOURNAL_ROWS_PER_FRAME 40
+
+using namespace std;
+
+struct journal_record_header
+{
+    uint32_t magic;
+    uint32_t type;
+    uint32_t size;
+    uint32_t checksum;
+};
+
+struct journal_queued
+{
+    size_t offset;
+    journal_record_type type;
+    vector<unsigned int> data;
+};
+
+// State shared with the background thread that appends records to the mapped file
+struct journal_writer
+{
+    int file;
+    unsigned char *map;
+    size_t capacity;
+    size_t written;
+    deque<journal_queued> queue;
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    thread worker;
+    bool stopping;
+};
+
+/**
+ * Make sure the mapped file is big enough to hold a given number of bytes, growing and
+ * remapping it if not. The writer lock must be held.
+ *
+ * @param writer    The journal writer
+ * @param needed    Number of bytes that must fit in the mapping
+ *
+ * @returns         True if the mapping is big enough, false if it could not be grown
+ */
+bool journal_reserve (journal_writer &writer, size_t needed)
+{
+    size_t capacity = writer.capacity;
+
+    if (needed <= capacity)
+        return true;
+
+    while (capacity < needed)
+        capacity *= 2;
+
+    if (ftruncate (writer.file, capacity) != 0)
+        return false;
+
+    munmap (writer.map, writer.capacity);
+    writer.map = (unsigned char *) mmap (nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, writer.file, 0);
+    writer.capacity = capacity;
+
+    if (writer.map == MAP_FAILED)
+        writer.map = nullptr;
+
+    return writer.map != nullptr;
+}
+
+/**
+ * Background thread that appends queued records to the journal. Records are taken off the
+ * queue in batches and copied in file order, so the file is only ever written sequentially.
+ *
+ * @param writer    The journal writer
+ */
+void journal_write_loop (journal_writer *writer)
+{
+    unique_lock<mutex> guard (writer->lock);
+
+    while (true)
+    {
+        writer->wake.wait (guard, [&]() { return writer->stopping || not writer->queue.empty(); });
+
+        if (writer->queue.empty())
+            break;
+
+        deque<journal_queued> batch;
+        batch.swap (writer->queue);
+
+        journal_queued &last = batch.back();
+        if (not journal_reserve (*writer, last.offset + sizeof (journal_record_header) + last.data.size() * 4))
+        {
+            write_line ("Undo journal could not be grown, history is no longer being saved");
+            writer->stopping = true;
+            writer->done.notify_all();
+            break;
+        }
+
+        // Copy without the lock, since nothing else touches the unwritten end of the file
+        guard.unlock();
+
+        for (journal_queued &record : batch)
+        {
+            journal_record_header header;
+            unsigned char *dest = writer->map + record.offset;
+
+            header.magic = JOURNAL_RECORD_MAGIC;
+            header.type = record.type;
+            header.size = record.data.size() * 4;
+            header.checksum = hash_bytes ((const unsigned char *) record.data.data(), header.size);
+
+            memcpy (dest + sizeof (header), record.data.data(), header.size);
+            memcpy (dest, &header, sizeof (header));
+        }
+
+        size_t end = last.offset + sizeof (journal_record_header) + last.data.size() * 4;
+        size_t page = sysconf (_SC_PAGESIZE);
+        size_t start = batch.front().offset / page * page;
+        msync (writer->map + start, end - start, MS_ASYNC);
+
+        guard.lock();
+        writer->written = end;
+        writer->done.notify_all();
+    }
+}
+
+/**
+ * Queue a record to be appended to the journal
+ *
+ * @param journal   The undo journal
+ * @param type      The type of record
+ * @param data      The record data
+ *
+ * @returns         The offset the record will be written at
+ */
+size_t journal_append (undo_journal &journal, journal_record_type type, vector<unsigned int> &data)
+{
+    journal_queued record;
+    size_t offset = journal.end;
+
+    record.offset = offset;
+    record.type = type;
+    record.data.swap (data);
+
+    journal.end += sizeof (journal_record_header) + record.data.size() * 4;
+
+    lock_guard<mutex> guard (journal.writer->lock);
+    journal.writer->queue.push_back (move (record));
+    journal.writer->wake.notify_one();
+
+    return offset;
+}
+
+/**
+ * Read a checkpoint record back out of the journal, waiting for it to be written if needed
+ *
+ * @param journal   The undo journal
+ * @param offset    Offset of the checkpoint record
+ *
+ * @returns         The pixels of the checkpoint
+ */
+pixel_buffer journal_read (undo_journal &journal, size_t offset)
+{
+    journal_writer &writer = *journal.writer;
+    pixel_buffer result = new_pixel_buffer (IMAGE_WIDTH, HEIGHT);
+    unique_lock<mutex> guard (writer.lock);
+
+    writer.done.wait (guard, [&]() { return writer.stopping || writer.written > offset; });
+
+    if (writer.written <= offset || writer.map == nullptr)
+        return result;
+
+    journal_record_header header;
+    memcpy (&header, writer.map + offset, sizeof (header));
+
+    // Checkpoint data is the command index, then a list of (run length, pixel) pairs
+    const unsigned int *data = (const unsigned int *) (writer.map + offset + sizeof (header));
+    size_t pos = 0;
+
+    for (size_t i = 1; i + 1 < header.size / 4; i += 2)
+        for (unsigned int run = 0; run < data[i] && pos < result.pixels.size(); run++)
+            result.pixels[pos++] = data[i + 1];
+
+    return result;
+}
+
+/**
+ * Replay the records of an existing journal to rebuild the command history and its
+ * checkpoints, then redraw the image from them. Reading stops at the first record that is
+ * incomplete or fails its checksum.
+ *
+ * @param program   Struct containing program data
+ * @param size      Size of the journal file in bytes
+ */
+void recover_journal (program_data &program, size_t size)
+{
+    undo_journal &journal = program.journal;
+    command_history &history = program.history;
+    unsigned char *map = journal.writer->map;
+    size_t offset = JOURNAL_HEADER_SIZE;
+    journal_record_header header;
+    history_checkpoint checkpoint;
+
+    while (offset + sizeof (header) <= size)
+    {
+        memcpy (&header, map + offset, sizeof (header));
+
+        if (header.magic != JOURNAL_RECORD_MAGIC || offset + sizeof (header) + header.size > size
+            || hash_bytes (map + offset + sizeof (header), header.size) != header.checksum)
+            break;
+
+        const unsigned int *data = (const unsigned int *) (map + offset + sizeof (header));
+
+        // Checkpoints can be written after the commands that follow them, so check the index they belong to
+        if (header.type == JOURNAL_CHECKPOINT && data[0] <= history.commands.size())
+        {
+            while (history.checkpoints.size() > 0 && history.checkpoints.back().command_index >= data[0])
+                history.checkpoints.pop_back();
+
+            checkpoint.command_index = data[0];
+            checkpoint.graphic = nullptr;
+            checkpoint.journal_offset = offset;
+            history.checkpoints.push_back (checkpoint);
+        }
+
+        else if (header.type == JOURNAL_POP && data[0] <= history.commands.size())
+        {
+            history.commands.resize (data[0]);
+            drop_checkpoints_after (history, data[0]);
+        }
+
+        else if (header.type == JOURNAL_COMMAND)
+            history.commands.push_back (deserialise_command (data, header.size / 4));
+
+        offset += sizeof (header) + header.size;
+    }
+
+    // Clear whatever follows the last good record, so stale records can't be replayed after a later crash
+    memset (map + offset, 0, size - offset);
+    journal.end = offset;
+    journal.writer->written = offset;
+
+    if (history.checkpoints.size() == 0)
+    {
+        history.commands.clear();
+        return;
+    }
+
+    restore_history (program);
+    write_line ("Recovered image and " + to_string (history.commands.size() - history.checkpoints.front().command_index) + " undo steps");
+}
+
+/**
+ * Open the undo journal. If a journal was left behind by a crash, the image and command
+ * history it holds are restored first.
+ *
+ * @param program   Struct containing program data
+ */
+void open_journal (program_data &program)
+{
+    undo_journal &journal = program.journal;
+    journal_writer *writer = new journal_writer;
+    struct stat info;
+    uint32_t header[4] = { JOURNAL_MAGIC, 2, IMAGE_WIDTH, HEIGHT };
+    bool existing;
+
+    journal.writer = writer;
+    journal.end = JOURNAL_HEADER_SIZE;
+    writer->stopping = false;
+    writer->written = JOURNAL_HEADER_SIZE;
+    writer->map = nullptr;
+    writer->file = open (JOURNAL_FILE, O_RDWR | O_CREAT, 0644);
+
+    if (writer->file < 0 || fstat (writer->file, &info) != 0)
+    {
+        write_line ("Undo journal could not be opened, history will only be kept in memory");
+        writer->stopping = true;
+        return;
+    }
+
+    existing = info.st_size >= JOURNAL_HEADER_SIZE;
+    writer->capacity = max ((size_t) info.st_size, (size_t) JOURNAL_INITIAL_SIZE);
+
+    if (ftruncate (writer->file, writer->capacity) == 0)
+        writer->map = (unsigned char *) mmap (nullptr, writer->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, writer->file, 0);
+
+    if (writer->map == nullptr || writer->map == MAP_FAILED)
+    {
+        write_line ("Undo journal could not be mapped, history will only be kept in memory");
+        writer->map = nullptr;
+        writer->stopping = true;
+        return;
+    }
+
+    if (existing && memcmp (writer->map, header, sizeof (header)) == 0)
+        recover_journal (program, info.st_size);
+    else
+        memcpy (writer->map, header, sizeof (header));
+
+    writer->worker = thread (journal_write_loop, writer);
+}
+
+/**
+ * Finish writing the journal and remove it. Only called on a clean exit, so a journal that
+ * still exists at startup means the program did not shut down properly.
+ *
+ * @param journal   The undo journal
+ */
+void close_journal (undo_journal &journal)
+{
+    journal_writer *writer = journal.writer;
+
+    for (journal_pending &entry : journal.pending)
+        free_bitmap (entry.source);
+    journal.pending.clear();
+
+    {
+        lock_guard<mutex> guard (writer->lock);
+        writer->stopping = true;
+        writer->wake.notify_one();
+    }
+
+    if (writer->worker.joinable())
+        writer->worker.join();
+
+    if (writer->map != nullptr)
+        munmap (writer->map, writer->capacity);
+
+    if (writer->file >= 0)
+    {
+        close (writer->file);
+        unlink (JOURNAL_FILE);
+    }
+
+    delete writer;
+    journal.writer = nullptr;
+}
+
+/**
+ * Start saving a checkpoint to the journal. The checkpoint is copied and read back in the
+ * background by journal_pump, so this does not delay the tool.
+ *
+ * @param journal       The undo journal
+ * @param source        The checkpoint image
+ * @param command_index Number of commands drawn on the checkpoint image
+ */
+void journal_checkpoint (undo_journal &journal, bitmap source, size_t command_index)
+{
+    journal_pending entry;
+
+    if (journal.writer->map == nullptr)
+        return;
+
+    entry.command_index = command_index;
+    entry.source = create_bitmap ("journal", IMAGE_WIDTH, HEIGHT);
+    entry.next_row = 0;
+    entry.data.push_back (command_index);
+    draw_bitmap_on_bitmap (entry.source, source, 0, 0);
+
+    journal.pending.push_back (entry);
+}
+
+/**
+ * Write a command to the journal. Commands are small, so they are queued straight away.
+ *
+ * @param journal   The undo journal
+ * @param command   The command to be written
+ */
+void journal_command (undo_journal &journal, const tool_command &command)
+{
+    vector<unsigned int> data = serialise_command (command);
+
+    if (journal.writer->map != nullptr)
+        journal_append (journal, JOURNAL_COMMAND, data);
+}
+
+/**
+ * Record in the journal that commands were undone
+ *
+ * @param journal       The undo journal
+ * @param command_count Number of commands left after the undo
+ */
+void journal_pop (undo_journal &journal, size_t command_count)
+{
+    vector<unsigned int> data (1, command_count);
+
+    if (journal.writer->map == nullptr)
+        return;
+
+    // Checkpoints past the undo that haven't been written yet don't need to be
+    for (size_t i = journal.pending.size(); i > 0; i--)
+    {
+        if (journal.pending[i - 1].command_index > command_count)
+        {
+            free_bitmap (journal.pending[i - 1].source);
+            journal.pending.erase (journal.pending.begin() + i - 1);
+        }
+    }
+
+    journal_append (journal, JOURNAL_POP, data);
+}
+
+/**
+ * Record in the journal that the whole history was replaced, such as by opening a document
+ *
+ * @param journal   The undo journal
+ */
+void journal_reset (undo_journal &journal)
+{
+    for (journal_pending &entry : journal.pending)
+        free_bitmap (entry.source);
+    journal.pending.clear();
+
+    journal_pop (journal, 0);
+}
+
+/**
+ * Read back part of the oldest pending checkpoint, and queue it for writing once it is
+ * complete. Called once per frame so that the cost of reading back is spread out.
+ *
+ * @param program   Struct containing program data
+ */
+void journal_pump (program_data &program)
+{
+    undo_journal &journal = program.journal;
+
+    if (journal.writer->map == nullptr || journal.pending.size() == 0)
+        return;
+
+    journal_pending &entry = journal.pending.front();
+    int last_row = min (entry.next_row + JOURNAL_ROWS_PER_FRAME, HEIGHT);
+
+    // Run length encode each row as (run length, pixel) pairs
+    for (int y = entry.next_row; y < last_row; y++)
+    {
+        unsigned int run_pixel = pack_color (get_pixel (entry.source, 0, y));
+        unsigned int run = 1;
+
+        for (int x = 1; x < IMAGE_WIDTH; x++)
+        {
+            unsigned int pixel = pack_color (get_pixel (entry.source, x, y));
+
+            if (pixel == run_pixel)
+                run++;
+            else
+            {
+                entry.data.push_back (run);
+                entry.data.push_back (run_pixel);
+                run_pixel = pixel;
+                run = 1;
+            }
+        }
+
+        entry.data.push_back (run);
+        entry.data.push_back (run_pixel);
+    }
+
+    entry.next_row = last_row;
+
+    if (entry.next_row == HEIGHT)
+    {
+        size_t offset = journal_append (journal, JOURNAL_CHECKPOINT, entry.data);
+
+        for (history_checkpoint &checkpoint : program.history.checkpoints)
+            if (checkpoint.command_index == entry.command_index)
+                checkpoint.journal_offset = offset;
+
+        free_bitmap (entry.source);
+        journal.pending.pop_front();
+        trim_checkpoints (program.history);
+    }
+}
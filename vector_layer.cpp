@@ -0,0 +1,613 @@
+#include "graphic_creator.h"
+#include <algorithm>
+#include <cmath>
+
+#define VECTOR_CELL 64
+#define HIT_MARGIN 3
+// Vector edit values before the redrawn pixels: shape, move x, move y, deleted, then the area
+#define EDIT_HEADER 8
+#define EXPORT_FILE "User_vector_export"
+
+using namespace std;
+
+/*  While the vector layer is on, every shape and stroke drawn is also kept as the command
+    that drew it, along with the image as it was when the layer was turned on. A shape can
+    then be picked and moved or deleted, which redraws only the area it covered, from the
+    base image and the shapes overlapping that area. Edits are recorded as VECTOR commands
+    holding the redrawn pixels, so they undo and replay without the layer. */
+
+/**
+ * Check whether a command draws something that can be kept as a shape on the vector layer
+ *
+ * @param mode  The mode of the command
+ *
+ * @returns     True for shapes and strokes
+ */
+bool is_vector_shape (mode_option mode)
+{
+    return mode == ERASER || mode == PEN || mode == SPRAY || (mode >= DRAW_REC && mode <= FILL_TRI);
+}
+
+/**
+ * Set up an empty vector layer, turned off
+ *
+ * @param layer     The vector layer
+ */
+void init_vector_layer (vector_layer &layer)
+{
+    int cells_x = (IMAGE_WIDTH + VECTOR_CELL - 1) / VECTOR_CELL;
+    int cells_y = (HEIGHT + VECTOR_CELL - 1) / VECTOR_CELL;
+
+    layer.enabled = false;
+    layer.base = nullptr;
+    layer.first_command = 0;
+    layer.shapes.clear();
+    layer.deleted.clear();
+    layer.grid.assign (cells_x * cells_y, vector<int>());
+}
+
+/**
+ * Find the grid cells an area of the image covers
+ *
+ * @param area      The area
+ * @param left      Set to the first column of cells
+ * @param top       Set to the first row of cells
+ * @param right     Set to the last column of cells
+ * @param bottom    Set to the last row of cells
+ */
+void grid_range (rectangle area, int &left, int &top, int &right, int &bottom)
+{
+    int cells_x = (IMAGE_WIDTH + VECTOR_CELL - 1) / VECTOR_CELL;
+    int cells_y = (HEIGHT + VECTOR_CELL - 1) / VECTOR_CELL;
+
+    left = max ((int) floor (area.x) / VECTOR_CELL, 0);
+    top = max ((int) floor (area.y) / VECTOR_CELL, 0);
+    right = min ((int) ceil (area.x + area.width) / VECTOR_CELL, cells_x - 1);
+    bottom = min ((int) ceil (area.y + area.height) / VECTOR_CELL, cells_y - 1);
+}
+
+/**
+ * Add a shape to or remove it from every grid cell its bounds overlap
+ *
+ * @param layer     The vector layer
+ * @param shape     Index of the shape
+ * @param add       True to add the shape, false to remove it
+ */
+void grid_update (vector_layer &layer, int shape, bool add)
+{
+    int cells_x = (IMAGE_WIDTH + VECTOR_CELL - 1) / VECTOR_CELL;
+    int left, top, right, bottom;
+
+    grid_range (command_bounds (layer.shapes[shape]), left, top, right, bottom);
+
+    for (int y = top; y <= bottom; y++)
+    {
+        for (int x = left; x <= right; x++)
+        {
+            vector<int> &cell = layer.grid[y * cells_x + x];
+
+            if (add)
+                cell.push_back (shape);
+            else
+                cell.erase (remove (cell.begin(), cell.end(), shape), cell.end());
+        }
+    }
+}
+
+/**
+ * Find the shapes whose bounds overlap an area, in the order they were drawn
+ *
+ * @param layer     The vector layer
+ * @param area      The area
+ *
+ * @returns         Indexes of the shapes, lowest first
+ */
+vector<int> shapes_in_area (const vector_layer &layer, rectangle area)
+{
+    int cells_x = (IMAGE_WIDTH + VECTOR_CELL - 1) / VECTOR_CELL;
+    int left, top, right, bottom;
+    vector<int> result;
+
+    grid_range (area, left, top, right, bottom);
+
+    for (int y = top; y <= bottom; y++)
+        for (int x = left; x <= right; x++)
+            result.insert (result.end(), layer.grid[y * cells_x + x].begin(), layer.grid[y * cells_x + x].end());
+
+    sort (result.begin(), result.end());
+    result.erase (unique (result.begin(), result.end()), result.end());
+
+    // A shape in an overlapping cell may still be outside the area itself
+    result.erase (remove_if (result.begin(), result.end(), [&](int shape)
+    {
+        rectangle bounds = command_bounds (layer.shapes[shape]);
+        return bounds.x >= area.x + area.width || bounds.y >= area.y + area.height
+               || bounds.x + bounds.width <= area.x || bounds.y + bounds.height <= area.y;
+    }), result.end());
+
+    return result;
+}
+
+/**
+ * Move a shape, keeping the grid up to date
+ *
+ * @param layer     The vector layer
+ * @param shape     Index of the shape
+ * @param dx        Distance to move across
+ * @param dy        Distance to move down
+ */
+void move_shape (vector_layer &layer, int shape, double dx, double dy)
+{
+    tool_command &command = layer.shapes[shape];
+
+    if (not layer.deleted[shape])
+        grid_update (layer, shape, false);
+
+    for (point_2d &point : command.points)
+    {
+        point.x += dx;
+        point.y += dy;
+    }
+
+    // Rectangles and ellipses keep their position in their values rather than points
+    if (command.mode >= DRAW_REC && command.mode <= FILL_ELL)
+    {
+        command.values[0] += dx;
+        command.values[1] += dy;
+    }
+
+    if (not layer.deleted[shape])
+        grid_update (layer, shape, true);
+}
+
+/**
+ * Delete a shape, or bring a deleted one back
+ *
+ * @param layer     The vector layer
+ * @param shape     Index of the shape
+ * @param deleted   True to delete the shape
+ */
+void set_shape_deleted (vector_layer &layer, int shape, bool deleted)
+{
+    if (layer.deleted[shape] == deleted)
+        return;
+
+    layer.deleted[shape] = deleted;
+    grid_update (layer, shape, not deleted);
+}
+
+/**
+ * Make the image as it is now the base of the vector layer, with no shapes on it
+ *
+ * @param program   Struct containing program data
+ */
+void flatten_vector_layer (program_data &program)
+{
+    vector_layer &layer = program.vectors;
+
+    draw_bitmap_on_bitmap (layer.base, program.to_draw, 0, 0);
+    layer.first_command = program.history.commands.size();
+    layer.shapes.clear();
+    layer.deleted.clear();
+    for (vector<int> &cell : layer.grid)
+        cell.clear();
+}
+
+/**
+ * Add a recorded command to the vector layer. Shapes are kept, vector edits are applied to
+ * the shape they change, and anything else draws straight onto the image, so the layer is
+ * flattened to keep its base in step with the image.
+ *
+ * @param program   Struct containing program data
+ * @param command   The command that has just been recorded
+ */
+void vector_record (program_data &program, const tool_command &command)
+{
+    vector_layer &layer = program.vectors;
+    const vector<double> &v = command.values;
+
+    if (is_vector_shape (command.mode))
+    {
+        layer.shapes.push_back (command);
+        layer.deleted.push_back (false);
+        grid_update (layer, layer.shapes.size() - 1, true);
+    }
+
+    else if (command.mode == VECTOR)
+    {
+        if (v[0] < 0 || v[0] >= (double) layer.shapes.size())
+            return;
+
+        move_shape (layer, v[0], v[1], v[2]);
+        set_shape_deleted (layer, v[0], v[3] != 0);
+    }
+
+    else
+        flatten_vector_layer (program);
+}
+
+/**
+ * Rebuild the vector layer's shapes from the history, after undoing or redoing. Undoing
+ * past the point the layer was started from flattens it there instead.
+ *
+ * @param program   Struct containing program data
+ */
+void rebuild_vector_layer (program_data &program)
+{
+    vector_layer &layer = program.vectors;
+    command_history &history = program.history;
+
+    if (history.commands.size() < layer.first_command)
+    {
+        flatten_vector_layer (program);
+        return;
+    }
+
+    layer.shapes.clear();
+    layer.deleted.clear();
+    for (vector<int> &cell : layer.grid)
+        cell.clear();
+
+    for (size_t i = layer.first_command; i < history.commands.size(); i++)
+        vector_record (program, history.commands[i]);
+}
+
+/**
+ * Turn the vector layer on or off. Turning it on takes the image as it is as the base the
+ * shapes are drawn over. Turning it off leaves the shapes drawn where they are. The indexed
+ * canvas draws from its own indices, so it is turned off first.
+ *
+ * @param program   Struct containing program data
+ * @param enabled   True to keep shapes on the vector layer
+ */
+void set_vector_mode (program_data &program, bool enabled)
+{
+    vector_layer &layer = program.vectors;
+
+    if (layer.enabled == enabled)
+        return;
+
+    if (enabled)
+    {
+        if (program.indexed.enabled)
+            set_indexed_mode (program, false);
+
+        layer.base = create_bitmap ("vector_base", IMAGE_WIDTH, HEIGHT);
+        layer.enabled = true;
+        flatten_vector_layer (program);
+    }
+    else
+    {
+        free_bitmap (layer.base);
+        init_vector_layer (layer);
+    }
+
+    write_line (enabled ? "Vector layer on" : "Vector layer flattened");
+}
+
+/**
+ * Redraw an area of the image from the base of the vector layer and the shapes overlapping
+ * the area, in the order they were drawn. Nothing outside the area is changed.
+ *
+ * @param program   Struct containing program data
+ * @param area      The area to be redrawn
+ */
+void redraw_vector_area (program_data &program, rectangle area)
+{
+    vector_layer &layer = program.vectors;
+
+    push_clip (program.to_draw, area);
+    draw_bitmap_on_bitmap (program.to_draw, layer.base, 0, 0);
+
+    for (int shape : shapes_in_area (layer, area))
+        apply_command (program.to_draw, layer.shapes[shape]);
+
+    pop_clip (program.to_draw);
+}
+
+/**
+ * Get the distance from a point to a line segment
+ *
+ * @param p     The point
+ * @param a     One end of the segment
+ * @param b     The other end of the segment
+ *
+ * @returns     The distance
+ */
+double segment_distance (point_2d p, point_2d a, point_2d b)
+{
+    double length = (b.x - a.x) * (b.x - a.x) + (b.y - a.y) * (b.y - a.y);
+    double t = length > 0 ? ((p.x - a.x) * (b.x - a.x) + (p.y - a.y) * (b.y - a.y)) / length : 0;
+
+    t = min (max (t, 0.0), 1.0);
+
+    return sqrt (pow (p.x - a.x - t * (b.x - a.x), 2) + pow (p.y - a.y - t * (b.y - a.y), 2));
+}
+
+/**
+ * Check whether a point is on a shape. Outlines and strokes count as hit within a few pixels.
+ *
+ * @param command   The shape
+ * @param p         The point
+ *
+ * @returns         True if the point is on the shape
+ */
+bool shape_hit (const tool_command &command, point_2d p)
+{
+    const vector<double> &v = command.values;
+    const vector<point_2d> &q = command.points;
+
+    switch (command.mode)
+    {
+        case ERASER:
+        case PEN:
+        {
+            double size = command.mode == ERASER ? 10 : 4;
+
+            for (point_2d point : q)
+                if (p.x >= point.x - HIT_MARGIN && p.x <= point.x + size + HIT_MARGIN && p.y >= point.y - HIT_MARGIN && p.y <= point.y + size + HIT_MARGIN)
+                    return true;
+            return false;
+        }
+        case SPRAY:
+            for (point_2d point : q)
+                if (sqrt (pow (p.x - point.x, 2) + pow (p.y - point.y, 2)) <= SPRAY_RADIUS)
+                    return true;
+            return false;
+        case DRAW_REC:
+        case FILL_REC:
+        {
+            double left = min (v[0], v[0] + v[2]), right = max (v[0], v[0] + v[2]);
+            double top = min (v[1], v[1] + v[3]), bottom = max (v[1], v[1] + v[3]);
+            bool inside = p.x >= left - HIT_MARGIN && p.x <= right + HIT_MARGIN && p.y >= top - HIT_MARGIN && p.y <= bottom + HIT_MARGIN;
+
+            if (command.mode == FILL_REC)
+                return inside;
+            return inside && not (p.x > left + HIT_MARGIN && p.x < right - HIT_MARGIN && p.y > top + HIT_MARGIN && p.y < bottom - HIT_MARGIN);
+        }
+        case DRAW_ELL:
+        case FILL_ELL:
+        {
+            double rx = fabs (v[2]) / 2, ry = fabs (v[3]) / 2;
+            double dx = p.x - (v[0] + v[2] / 2), dy = p.y - (v[1] + v[3] / 2);
+            double outer = pow (dx / (rx + HIT_MARGIN), 2) + pow (dy / (ry + HIT_MARGIN), 2);
+
+            if (command.mode == FILL_ELL || rx <= HIT_MARGIN || ry <= HIT_MARGIN)
+                return outer <= 1;
+            return outer <= 1 && pow (dx / (rx - HIT_MARGIN), 2) + pow (dy / (ry - HIT_MARGIN), 2) >= 1;
+        }
+        case DRAW_TRI:
+        case FILL_TRI:
+        {
+            for (int e = 0; e < 3; e++)
+                if (segment_distance (p, q[e], q[(e + 1) % 3]) <= HIT_MARGIN)
+                    return true;
+
+            if (command.mode == DRAW_TRI)
+                return false;
+
+            // Inside if the point is on the same side of all three edges
+            double sides[3];
+            for (int e = 0; e < 3; e++)
+                sides[e] = (q[(e + 1) % 3].x - q[e].x) * (p.y - q[e].y) - (p.x - q[e].x) * (q[(e + 1) % 3].y - q[e].y);
+            return (sides[0] >= 0 && sides[1] >= 0 && sides[2] >= 0) || (sides[0] <= 0 && sides[1] <= 0 && sides[2] <= 0);
+        }
+        default:
+            return false;
+    }
+}
+
+/**
+ * Find the topmost shape under a point. Only the shapes in the grid cell the point is in
+ * are looked at, so this stays fast with thousands of shapes.
+ *
+ * @param layer     The vector layer
+ * @param p         The point
+ *
+ * @returns         Index of the shape, or -1 if there is none
+ */
+int shape_at (const vector_layer &layer, point_2d p)
+{
+    vector<int> candidates = shapes_in_area (layer, rectangle_from (p.x - HIT_MARGIN, p.y - HIT_MARGIN, 2 * HIT_MARGIN + 1, 2 * HIT_MARGIN + 1));
+
+    for (int i = candidates.size() - 1; i >= 0; i--)
+        if (shape_hit (layer.shapes[candidates[i]], p))
+            return candidates[i];
+
+    return -1;
+}
+
+/**
+ * Get the pixels a vector edit redrew, from the runs stored in its values
+ *
+ * @param command   The vector edit
+ *
+ * @returns         The redrawn pixels, positioned at values 4 and 5
+ */
+pixel_buffer vector_edit_pixels (const tool_command &command)
+{
+    const vector<double> &v = command.values;
+    pixel_buffer result = new_pixel_buffer (v[6], v[7]);
+    size_t pos = 0;
+
+    for (size_t i = EDIT_HEADER; i + 1 < v.size() && pos < result.pixels.size(); i += 2)
+    {
+        size_t run = min ((size_t) v[i], result.pixels.size() - pos);
+        fill (result.pixels.begin() + pos, result.pixels.begin() + pos + run, (unsigned int) v[i + 1]);
+        pos += run;
+    }
+
+    return result;
+}
+
+/**
+ * Move or delete a shape on the vector layer, redrawing the area it covered before and
+ * after, and record it as a command holding the redrawn pixels
+ *
+ * @param program   Struct containing program data
+ * @param shape     Index of the shape
+ * @param dx        Distance to move across
+ * @param dy        Distance to move down
+ * @param deleted   True to delete the shape
+ */
+void edit_shape (program_data &program, int shape, double dx, double dy, bool deleted)
+{
+    vector_layer &layer = program.vectors;
+    tool_command command = new_command (program);
+    rectangle before = command_bounds (layer.shapes[shape]);
+
+    move_shape (layer, shape, dx, dy);
+    set_shape_deleted (layer, shape, deleted);
+
+    rectangle after = command_bounds (layer.shapes[shape]);
+    int left = max ((int) floor (min (before.x, after.x)), 0);
+    int top = max ((int) floor (min (before.y, after.y)), 0);
+    int right = min ((int) ceil (max (before.x + before.width, after.x + after.width)), IMAGE_WIDTH);
+    int bottom = min ((int) ceil (max (before.y + before.height, after.y + after.height)), HEIGHT);
+
+    if (right > left && bottom > top)
+        redraw_vector_area (program, rectangle_from (left, top, right - left, bottom - top));
+
+    pixel_buffer pixels = read_pixels (program.to_draw, left, top, max (right - left, 0), max (bottom - top, 0));
+
+    // The layer is changed again when the command is recorded, the same as when it is redone
+    set_shape_deleted (layer, shape, false);
+    move_shape (layer, shape, -dx, -dy);
+
+    command.mode = VECTOR;
+    command.values = { (double) shape, dx, dy, (double) deleted, (double) left, (double) top, (double) pixels.width, (double) pixels.height };
+
+    for (size_t i = 0; i < pixels.pixels.size(); )
+    {
+        size_t run = 1;
+        while (i + run < pixels.pixels.size() && pixels.pixels[i + run] == pixels.pixels[i])
+            run++;
+
+        command.values.push_back (run);
+        command.values.push_back (pixels.pixels[i]);
+        i += run;
+    }
+
+    record_command (program, command);
+}
+
+/**
+ * Pick the topmost shape under the mouse on the vector layer. Dragging moves it, and if it
+ * is not dragged it stays picked until Delete removes it or the mouse is pressed again.
+ *
+ * @param program   Struct containing program data
+ */
+void vector_tool (program_data &program)
+{
+    vector_layer &layer = program.vectors;
+    point_2d start = mouse_position();
+    int shape = shape_at (layer, start);
+    double dx = 0, dy = 0;
+
+    if (shape < 0)
+    {
+        while (mouse_down (LEFT_BUTTON))
+            process_events();
+        return;
+    }
+
+    rectangle bounds = command_bounds (layer.shapes[shape]);
+
+    while (mouse_down (LEFT_BUTTON))
+    {
+        process_events();
+
+        dx = mouse_x() - start.x;
+        dy = mouse_y() - start.y;
+
+        queue_bitmap (program.the_window, program.to_draw, 0, 0);
+        queue_rectangle (program.the_window, COLOR_GRAY, bounds.x + dx, bounds.y + dy, bounds.width, bounds.height);
+        flush_render (program.the_window);
+    }
+
+    if (dx != 0 || dy != 0)
+    {
+        edit_shape (program, shape, dx, dy, false);
+        return;
+    }
+
+    while (not quit_requested() && not mouse_down (LEFT_BUTTON) && not mouse_down (RIGHT_BUTTON) && not key_typed (ESCAPE_KEY))
+    {
+        process_events();
+
+        if (key_typed (DELETE_KEY) || key_typed (BACKSPACE_KEY))
+        {
+            edit_shape (program, shape, 0, 0, true);
+            break;
+        }
+
+        queue_bitmap (program.the_window, program.to_draw, 0, 0);
+        queue_rectangle (program.the_window, COLOR_GRAY, bounds.x, bounds.y, bounds.width, bounds.height);
+        flush_render (program.the_window);
+    }
+}
+
+/**
+ * Draw a shape onto a bitmap at a larger or smaller size, drawn again rather than scaled
+ * so it stays sharp
+ *
+ * @param dest      The bitmap to be drawn to
+ * @param command   The shape
+ * @param scale     How much bigger to draw it
+ */
+void draw_scaled_shape (bitmap dest, const tool_command &command, double scale)
+{
+    tool_command scaled = command;
+    unsigned int state = command.seed;
+    color c = command.draw_color;
+
+    for (point_2d &point : scaled.points)
+    {
+        point.x *= scale;
+        point.y *= scale;
+    }
+    for (double &value : scaled.values)
+        value *= scale;
+
+    switch (command.mode)
+    {
+        case ERASER:   for (point_2d point : scaled.points)
+                           fill_rectangle_on_bitmap (dest, COLOR_WHITE, point.x, point.y, 10 * scale, 10 * scale);
+                       break;
+        case PEN:      for (point_2d point : scaled.points)
+                           fill_ellipse_on_bitmap (dest, c, point.x, point.y, 4 * scale, 4 * scale);
+                       break;
+        case SPRAY:    // Each pixel of the spray is drawn as a square the size of the scale
+                       for (point_2d point : command.points)
+                           for (point_2d pixel : spray_pixels (point.x, point.y, state, scale))
+                               fill_rectangle_on_bitmap (dest, c, pixel.x, pixel.y, scale, scale);
+                       break;
+        default:       apply_command (dest, scaled);
+                       break;
+    }
+}
+
+/**
+ * Save the image with the vector layer's shapes drawn again at a larger size. The base
+ * image is scaled up, and the shapes drawn over it at full detail.
+ *
+ * @param program   Struct containing program data
+ * @param scale     How many times bigger than the image to export
+ */
+void export_vector_layer (program_data &program, double scale)
+{
+    vector_layer &layer = program.vectors;
+    bitmap result = create_bitmap ("vector_export", IMAGE_WIDTH * scale, HEIGHT * scale);
+
+    // Bitmaps are scaled about their centre
+    draw_bitmap_on_bitmap (result, layer.base, IMAGE_WIDTH * (scale - 1) / 2, HEIGHT * (scale - 1) / 2, option_scale_bmp (scale, scale));
+
+    for (size_t i = 0; i < layer.shapes.size(); i++)
+        if (not layer.deleted[i])
+            draw_scaled_shape (result, layer.shapes[i], scale);
+
+    save_bitmap (result, EXPORT_FILE);
+    free_bitmap (result);
+
+    write_line ("Exported " + string (EXPORT_FILE) + " at " + to_string ((int) scale) + "x");
+}